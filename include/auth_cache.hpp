@@ -0,0 +1,103 @@
+#ifndef SECUREWEBPASS_AUTH_CACHE_HPP
+#define SECUREWEBPASS_AUTH_CACHE_HPP
+
+#include <array>
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace swp {
+
+// Remembers which (owner, session id) and (owner, token) pairs were found
+// valid in the database, and until when. Sharded so concurrent lookups from
+// the I/O threads only contend when they hash to the same shard, and lookups
+// only take the shard's lock in shared mode.
+//
+// Only this process' writes invalidate entries: a row deleted behind the
+// server's back stays valid here until the entry expires.
+class AuthCache {
+  public:
+    enum class Kind : char { session = 's', token = 't' };
+
+  private:
+    static constexpr std::size_t SHARDS = 16;
+    static constexpr std::size_t SHARD_CAPACITY = 4096;
+
+    struct Shard {
+        mutable std::shared_mutex mutex;
+        std::unordered_map<std::string, std::time_t> entries; // key -> expiration (epoch seconds)
+    };
+
+    std::array<Shard, SHARDS> shards;
+
+    // Builds the lookup key in a per-thread buffer so a warm lookup doesn't allocate.
+    static const std::string& key(Kind kind, std::string_view owner, std::string_view credential) {
+        thread_local std::string buffer;
+        buffer.clear();
+        buffer += static_cast<char>(kind);
+        buffer.append(owner);
+        buffer += '\0';
+        buffer.append(credential);
+        return buffer;
+    }
+
+    Shard& shard(const std::string& key) { return shards[std::hash<std::string>{}(key) % SHARDS]; }
+
+    static std::size_t purge(Shard& shard, std::time_t now) {
+        std::size_t removed = 0;
+        for (auto it = shard.entries.begin(); it != shard.entries.end();) {
+            if (it->second < now) {
+                it = shard.entries.erase(it);
+                ++removed;
+            } else {
+                ++it;
+            }
+        }
+        return removed;
+    }
+
+  public:
+    [[nodiscard]] bool contains(Kind kind, std::string_view owner, std::string_view credential, std::time_t now = std::time(nullptr)) {
+        const auto& k = key(kind, owner, credential);
+        auto& s = shard(k);
+        std::shared_lock lock{s.mutex};
+        const auto it = s.entries.find(k);
+        return it != s.entries.end() && it->second >= now;
+    }
+
+    void insert(Kind kind, std::string_view owner, std::string_view credential, std::time_t expiration) {
+        const auto& k = key(kind, owner, credential);
+        auto& s = shard(k);
+        std::unique_lock lock{s.mutex};
+        // A full shard makes room by dropping expired entries; if that's not enough
+        // the credential simply isn't cached and will be checked in the database.
+        if (s.entries.size() >= SHARD_CAPACITY && purge(s, std::time(nullptr)) == 0 && s.entries.count(k) == 0)
+            return;
+        s.entries.insert_or_assign(k, expiration);
+    }
+
+    void erase(Kind kind, std::string_view owner, std::string_view credential) {
+        const auto& k = key(kind, owner, credential);
+        auto& s = shard(k);
+        std::unique_lock lock{s.mutex};
+        s.entries.erase(k);
+    }
+
+    // Drops every entry that expired before now; returns how many were removed.
+    std::size_t purgeExpired(std::time_t now = std::time(nullptr)) {
+        std::size_t removed = 0;
+        for (auto& s : shards) {
+            std::unique_lock lock{s.mutex};
+            removed += purge(s, now);
+        }
+        return removed;
+    }
+};
+} // namespace swp
+
+#endif // SECUREWEBPASS_AUTH_CACHE_HPP
@@ -0,0 +1,206 @@
+#ifndef SECUREWEBPASS_CONNECTION_POOL_HPP
+#define SECUREWEBPASS_CONNECTION_POOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <sqlite3.h>
+
+namespace swp {
+
+struct StatementCacheStats {
+    std::uint64_t hits;
+    std::uint64_t misses;
+};
+
+// A prepared statement borrowed from a connection's cache. It is reset and
+// its bindings cleared when the handle goes out of scope, so it is ready for
+// the next user and no longer references the caller's bound buffers.
+class Statement {
+    sqlite3_stmt* stmt{};
+
+  public:
+    Statement() = default;
+
+    explicit Statement(sqlite3_stmt* stmt) noexcept : stmt(stmt) {}
+
+    Statement(const Statement&) = delete;
+
+    Statement(Statement&& oth) noexcept : stmt(std::exchange(oth.stmt, nullptr)) {}
+
+    Statement& operator=(const Statement&) = delete;
+
+    Statement& operator=(Statement&&) = delete;
+
+    ~Statement() {
+        if (!stmt)
+            return;
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+    }
+
+    operator sqlite3_stmt*() const noexcept { return stmt; }
+};
+
+// A single SQLite connection. It is opened without the SQLite connection
+// mutex (SQLITE_OPEN_NOMUTEX): the pool guarantees that a connection is only
+// ever used by the thread that checked it out.
+class Connection {
+    sqlite3* db{};
+    // Keyed by the address of the SQL text: every query is a string literal,
+    // so the lookup never hashes nor compares the statement itself.
+    std::unordered_map<const char*, sqlite3_stmt*> statements;
+    std::atomic<std::uint64_t> hits{0};
+    std::atomic<std::uint64_t> misses{0};
+
+  public:
+    Connection() = default;
+
+    Connection(const Connection&) = delete;
+
+    Connection& operator=(const Connection&) = delete;
+
+    ~Connection() {
+        for (auto& [sql, stmt] : statements)
+            sqlite3_finalize(stmt);
+        if (!db)
+            return;
+        if (sqlite3_close_v2(db) != SQLITE_OK)
+            std::cerr << "Can't close database: " << sqlite3_errmsg(db) << std::endl;
+    }
+
+    int open(const char* filename) {
+        constexpr auto flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX;
+        int rc;
+        if (rc = sqlite3_open_v2(filename, &db, flags, nullptr); rc != SQLITE_OK) {
+            std::cerr << "Can't open database: " << sqlite3_errmsg(db) << std::endl;
+            return rc;
+        }
+        // Writers are serialized by SQLite; wait for the lock instead of failing with SQLITE_BUSY.
+        sqlite3_busy_timeout(db, 5000);
+        // WAL lets readers on the other connections run alongside the single writer.
+        if (rc = sqlite3_exec(db, "PRAGMA journal_mode=WAL;PRAGMA synchronous=NORMAL;", nullptr, nullptr, nullptr); rc != SQLITE_OK)
+            std::cerr << "Can't enable WAL mode: " << sqlite3_errmsg(db) << std::endl;
+        return rc;
+    }
+
+    [[nodiscard]] sqlite3* handle() const noexcept { return db; }
+
+    // Returns the cached statement for sql, preparing it on first use.
+    // sql must have static storage duration (a string literal): its address is the cache key.
+    [[nodiscard]] std::pair<Statement, int> prepare(std::string_view sql) {
+        if (auto it = statements.find(sql.data()); it != statements.end()) {
+            hits.fetch_add(1, std::memory_order_relaxed);
+            return {Statement{it->second}, SQLITE_OK};
+        }
+        misses.fetch_add(1, std::memory_order_relaxed);
+        sqlite3_stmt* stmt = nullptr;
+        const int rc = sqlite3_prepare_v3(db, sql.data(), static_cast<int>(sql.size()), SQLITE_PREPARE_PERSISTENT, &stmt, nullptr);
+        if (rc != SQLITE_OK) {
+            sqlite3_finalize(stmt);
+            return {Statement{}, rc};
+        }
+        statements.emplace(sql.data(), stmt);
+        return {Statement{stmt}, rc};
+    }
+
+    [[nodiscard]] StatementCacheStats cacheStats() const noexcept {
+        return {hits.load(std::memory_order_relaxed), misses.load(std::memory_order_relaxed)};
+    }
+};
+
+// A bounded checkout pool of connections to the same database file.
+// acquire() blocks until a connection is idle, so the number of concurrent
+// SQLite users never exceeds the pool size.
+class ConnectionPool {
+    std::vector<std::unique_ptr<Connection>> connections;
+    std::vector<Connection*> idle;
+    std::mutex mutex;
+    std::condition_variable available;
+
+    void release(Connection* conn) {
+        {
+            std::lock_guard lock{mutex};
+            idle.push_back(conn);
+        }
+        available.notify_one();
+    }
+
+  public:
+    // RAII handle over a checked out connection; gives it back on destruction.
+    class Lease {
+        ConnectionPool* pool{};
+        Connection* conn{};
+
+      public:
+        Lease(ConnectionPool& pool, Connection& conn) : pool(&pool), conn(&conn) {}
+
+        Lease(const Lease&) = delete;
+
+        Lease(Lease&& oth) noexcept : pool(oth.pool), conn(oth.conn) { oth.conn = nullptr; }
+
+        Lease& operator=(const Lease&) = delete;
+
+        Lease& operator=(Lease&&) = delete;
+
+        ~Lease() {
+            if (conn)
+                pool->release(conn);
+        }
+
+        Connection& operator*() const noexcept { return *conn; }
+
+        Connection* operator->() const noexcept { return conn; }
+    };
+
+    ConnectionPool() = default;
+
+    ConnectionPool(const ConnectionPool&) = delete;
+
+    ConnectionPool& operator=(const ConnectionPool&) = delete;
+
+    // Opens one more connection to filename and makes it available.
+    int add(const char* filename) {
+        auto conn = std::make_unique<Connection>();
+        if (int rc = conn->open(filename); rc != SQLITE_OK)
+            return rc;
+        {
+            std::lock_guard lock{mutex};
+            idle.push_back(conn.get());
+            connections.push_back(std::move(conn));
+        }
+        available.notify_one();
+        return SQLITE_OK;
+    }
+
+    [[nodiscard]] Lease acquire() {
+        std::unique_lock lock{mutex};
+        available.wait(lock, [this] { return !idle.empty(); });
+        auto* conn = idle.back();
+        idle.pop_back();
+        return Lease{*this, *conn};
+    }
+
+    [[nodiscard]] std::size_t size() const noexcept { return connections.size(); }
+
+    // Statement cache counters summed over every connection.
+    [[nodiscard]] StatementCacheStats cacheStats() const noexcept {
+        StatementCacheStats total{0, 0};
+        for (const auto& conn : connections) {
+            const auto stats = conn->cacheStats();
+            total.hits += stats.hits;
+            total.misses += stats.misses;
+        }
+        return total;
+    }
+};
+} // namespace swp
+
+#endif // SECUREWEBPASS_CONNECTION_POOL_HPP
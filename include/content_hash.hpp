@@ -0,0 +1,57 @@
+#ifndef SECUREWEBPASS_CONTENT_HASH_HPP
+#define SECUREWEBPASS_CONTENT_HASH_HPP
+
+#include <cstddef>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <openssl/evp.h>
+
+namespace swp {
+
+// The SHA-256 of a vault's content, fed a chunk at a time as uploads arrive,
+// in lowercase hex: what the vault's ETag is made of.
+class ContentHash {
+    EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+
+  public:
+    static constexpr std::size_t HEX_SIZE = 64;
+
+    ContentHash() {
+        if (!ctx || EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr) != 1) {
+            std::cerr << "Cannot initialize SHA-256" << std::endl;
+            std::abort();
+        }
+    }
+
+    ContentHash(const ContentHash&) = delete;
+
+    ContentHash& operator=(const ContentHash&) = delete;
+
+    ~ContentHash() { EVP_MD_CTX_free(ctx); }
+
+    void update(const void* data, std::size_t n) { EVP_DigestUpdate(ctx, data, n); }
+
+    // Finishes the hash: no more update() afterwards.
+    [[nodiscard]] std::string hex() {
+        unsigned char digest[EVP_MAX_MD_SIZE];
+        unsigned int size = 0;
+        EVP_DigestFinal_ex(ctx, digest, &size);
+        constexpr char digits[] = "0123456789abcdef";
+        std::string result(2 * size, '\0');
+        for (unsigned int i = 0; i < size; ++i) {
+            result[2 * i] = digits[digest[i] >> 4];
+            result[2 * i + 1] = digits[digest[i] & 15];
+        }
+        return result;
+    }
+
+    [[nodiscard]] static std::string of(const void* data, std::size_t n) {
+        ContentHash hash;
+        hash.update(data, n);
+        return hash.hex();
+    }
+};
+} // namespace swp
+
+#endif // SECUREWEBPASS_CONTENT_HASH_HPP
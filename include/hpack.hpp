@@ -0,0 +1,429 @@
+#ifndef SECUREWEBPASS_HPACK_HPP
+#define SECUREWEBPASS_HPACK_HPP
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <utility>
+
+// HPACK, the header compression of HTTP/2 (RFC 7541).
+namespace swp::hpack {
+
+struct Code {
+    std::uint32_t bits;
+    std::uint8_t length;
+};
+
+// The Huffman code of each octet, then of EOS (RFC 7541, appendix B).
+constexpr std::array<Code, 257> HUFFMAN = {{
+    {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28}, {0xfffffe4, 28}, {0xfffffe5, 28}, {0xfffffe6, 28}, {0xfffffe7, 28},
+    {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28}, {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28},
+    {0xfffffed, 28}, {0xfffffee, 28}, {0xfffffef, 28}, {0xffffff0, 28}, {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+    {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28}, {0xffffff8, 28}, {0xffffff9, 28}, {0xffffffa, 28}, {0xffffffb, 28}, {0x14, 6},
+    {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12}, {0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11}, {0x3fa, 10}, {0x3fb, 10}, {0xf9, 8}, {0x7fb, 11},
+    {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6}, {0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6}, {0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6}, {0x1e, 6},
+    {0x1f, 6}, {0x5c, 7}, {0xfb, 8}, {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10}, {0x1ffa, 13}, {0x21, 6}, {0x5d, 7}, {0x5e, 7}, {0x5f, 7},
+    {0x60, 7}, {0x61, 7}, {0x62, 7}, {0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7}, {0x67, 7}, {0x68, 7}, {0x69, 7}, {0x6a, 7}, {0x6b, 7}, {0x6c, 7},
+    {0x6d, 7}, {0x6e, 7}, {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7}, {0xfc, 8}, {0x73, 7}, {0xfd, 8}, {0x1ffb, 13}, {0x7fff0, 19}, {0x1ffc, 13},
+    {0x3ffc, 14}, {0x22, 6}, {0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5}, {0x24, 6}, {0x5, 5}, {0x25, 6}, {0x26, 6}, {0x27, 6}, {0x6, 5}, {0x74, 7},
+    {0x75, 7}, {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5}, {0x2b, 6}, {0x76, 7}, {0x2c, 6}, {0x8, 5}, {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+    {0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15}, {0x7fc, 11}, {0x3ffd, 14}, {0x1ffd, 13}, {0xffffffc, 28}, {0xfffe6, 20}, {0x3fffd2, 22},
+    {0xfffe7, 20}, {0xfffe8, 20}, {0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23}, {0x3fffd6, 22}, {0x7fffda, 23}, {0x7fffdb, 23},
+    {0x7fffdc, 23}, {0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23}, {0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23},
+    {0xffffee, 24}, {0x7fffe1, 23}, {0x7fffe2, 23}, {0x7fffe3, 23}, {0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23}, {0x3fffd9, 22},
+    {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24}, {0x3fffda, 22}, {0x1fffdd, 21}, {0xfffe9, 20}, {0x3fffdb, 22}, {0x3fffdc, 22}, {0x7fffe8, 23},
+    {0x7fffe9, 23}, {0x1fffde, 21}, {0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24}, {0x1fffdf, 21}, {0x3fffdf, 22}, {0x7fffeb, 23},
+    {0x7fffec, 23}, {0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21}, {0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23},
+    {0xfffea, 20}, {0x3fffe2, 22}, {0x3fffe3, 22}, {0x3fffe4, 22}, {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23}, {0x3ffffe0, 26},
+    {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19}, {0x3fffe7, 22}, {0x7ffff2, 23}, {0x3fffe8, 22}, {0x1ffffec, 25}, {0x3ffffe2, 26}, {0x3ffffe3, 26},
+    {0x3ffffe4, 26}, {0x7ffffde, 27}, {0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25}, {0x7fff2, 19}, {0x1fffe3, 21},
+    {0x3ffffe6, 26}, {0x7ffffe0, 27}, {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24}, {0x1fffe4, 21}, {0x1fffe5, 21},
+    {0x3ffffe8, 26}, {0x3ffffe9, 26}, {0xffffffd, 28}, {0x7ffffe3, 27}, {0x7ffffe4, 27}, {0x7ffffe5, 27}, {0xfffec, 20}, {0xfffff3, 24},
+    {0xfffed, 20}, {0x1fffe6, 21}, {0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23}, {0x3fffea, 22}, {0x3fffeb, 22}, {0x1ffffee, 25},
+    {0x1ffffef, 25}, {0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23}, {0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26},
+    {0x3ffffed, 26}, {0x7ffffe7, 27}, {0x7ffffe8, 27}, {0x7ffffe9, 27}, {0x7ffffea, 27}, {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27},
+    {0x7ffffed, 27}, {0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26}, {0x3fffffff, 30},
+}};
+
+// Decoding walks a binary trie of the code: an entry is the next node, or
+// LEAF | symbol. The code is complete, so every entry is set.
+constexpr std::uint16_t LEAF = 0x8000;
+
+constexpr std::array<std::array<std::uint16_t, 2>, 256> make_trie() {
+    std::array<std::array<std::uint16_t, 2>, 256> trie{};
+    std::uint16_t nodes = 1;
+    for (std::size_t sym = 0; sym < HUFFMAN.size(); ++sym) {
+        std::size_t node = 0;
+        for (auto i = HUFFMAN[sym].length - 1; i > 0; --i) {
+            auto const bit = (HUFFMAN[sym].bits >> i) & 1;
+            if (trie[node][bit] == 0)
+                trie[node][bit] = nodes++;
+            node = trie[node][bit];
+        }
+        trie[node][HUFFMAN[sym].bits & 1] = static_cast<std::uint16_t>(LEAF | sym);
+    }
+    return trie;
+}
+
+constexpr auto TRIE = make_trie();
+
+constexpr std::array<std::pair<std::string_view, std::string_view>, 61> STATIC_TABLE = {{
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+}};
+
+// The table size both ends start with, and the most this server uses.
+constexpr std::size_t DEFAULT_TABLE_SIZE = 4096;
+
+inline void encode_integer(std::string& out, std::uint8_t first, unsigned prefix, std::uint64_t value) {
+    auto const max = (1u << prefix) - 1;
+    if (value < max) {
+        out.push_back(static_cast<char>(first | value));
+        return;
+    }
+    out.push_back(static_cast<char>(first | max));
+    for (value -= max; value >= 128; value /= 128)
+        out.push_back(static_cast<char>(value % 128 + 128));
+    out.push_back(static_cast<char>(value));
+}
+
+// Fails on truncated input and on values past 2^28, which no sane peer sends.
+inline bool decode_integer(const std::uint8_t*& p, const std::uint8_t* end, unsigned prefix, std::uint64_t& value) {
+    if (p == end)
+        return false;
+    auto const max = (1u << prefix) - 1;
+    value = *p++ & max;
+    if (value < max)
+        return true;
+    for (unsigned shift = 0; p != end && shift <= 21; shift += 7) {
+        auto const byte = *p++;
+        value += std::uint64_t{byte & 127u} << shift;
+        if (!(byte & 128))
+            return true;
+    }
+    return false;
+}
+
+inline std::size_t huffman_size(std::string_view s) {
+    std::size_t bits = 0;
+    for (auto c : s)
+        bits += HUFFMAN[static_cast<unsigned char>(c)].length;
+    return (bits + 7) / 8;
+}
+
+inline void huffman_encode(std::string& out, std::string_view s) {
+    std::uint64_t pending = 0;
+    unsigned count = 0;
+    for (auto c : s) {
+        auto const [bits, length] = HUFFMAN[static_cast<unsigned char>(c)];
+        pending = (pending << length) | bits;
+        for (count += length; count >= 8; count -= 8)
+            out.push_back(static_cast<char>(pending >> (count - 8)));
+        pending &= (std::uint64_t{1} << count) - 1;
+    }
+    // Padded with the most significant bits of EOS, all ones
+    if (count > 0)
+        out.push_back(static_cast<char>((pending << (8 - count)) | (0xff >> count)));
+}
+
+inline bool huffman_decode(const std::uint8_t* p, std::size_t size, std::string& out) {
+    std::size_t node = 0;
+    unsigned padding = 0;
+    bool ones = true;
+    for (auto const end = p + size; p != end; ++p) {
+        for (int i = 7; i >= 0; --i) {
+            auto const bit = (*p >> i) & 1;
+            auto const next = TRIE[node][bit];
+            ++padding;
+            ones = ones && bit;
+            if (!(next & LEAF)) {
+                node = next;
+                continue;
+            }
+            auto const sym = next & ~LEAF;
+            if (sym == 256)
+                return false;
+            out.push_back(static_cast<char>(sym));
+            node = 0;
+            padding = 0;
+            ones = true;
+        }
+    }
+    return padding <= 7 && ones;
+}
+
+inline bool decode_string(const std::uint8_t*& p, const std::uint8_t* end, std::string& out) {
+    if (p == end)
+        return false;
+    auto const huffman = (*p & 0x80) != 0;
+    std::uint64_t length;
+    if (!decode_integer(p, end, 7, length) || length > static_cast<std::uint64_t>(end - p))
+        return false;
+    out.clear();
+    if (huffman) {
+        if (!huffman_decode(p, length, out))
+            return false;
+    } else {
+        out.assign(reinterpret_cast<const char*>(p), length);
+    }
+    p += length;
+    return true;
+}
+
+// Huffman coded whenever that is shorter.
+inline void encode_string(std::string& out, std::string_view s) {
+    if (auto const coded = huffman_size(s); coded < s.size()) {
+        encode_integer(out, 0x80, 7, coded);
+        huffman_encode(out, s);
+    } else {
+        encode_integer(out, 0, 7, s.size());
+        out.append(s);
+    }
+}
+
+// The static table followed by a dynamic one, indexed from 1.
+class Table {
+    std::deque<std::pair<std::string, std::string>> entries; // newest first
+    std::size_t size = 0;
+    std::size_t max = DEFAULT_TABLE_SIZE;
+
+    static std::size_t entry_size(std::string_view name, std::string_view value) { return name.size() + value.size() + 32; }
+
+    void evict(std::size_t room) {
+        while (!entries.empty() && size + room > max) {
+            size -= entry_size(entries.back().first, entries.back().second);
+            entries.pop_back();
+        }
+    }
+
+  public:
+    [[nodiscard]] std::size_t max_size() const noexcept { return max; }
+
+    void resize(std::size_t max_size) {
+        max = max_size;
+        evict(0);
+    }
+
+    void add(std::string_view name, std::string_view value) {
+        // Copied first: name or value may view an entry about to be evicted
+        std::pair<std::string, std::string> entry{name, value};
+        auto const bytes = entry_size(name, value);
+        evict(bytes);
+        if (bytes > max)
+            return;
+        entries.push_front(std::move(entry));
+        size += bytes;
+    }
+
+    [[nodiscard]] bool get(std::uint64_t index, std::string_view& name, std::string_view& value) const {
+        if (index == 0)
+            return false;
+        if (index <= STATIC_TABLE.size()) {
+            std::tie(name, value) = STATIC_TABLE[index - 1];
+            return true;
+        }
+        index -= STATIC_TABLE.size() + 1;
+        if (index >= entries.size())
+            return false;
+        name = entries[index].first;
+        value = entries[index].second;
+        return true;
+    }
+
+    // The index of the field, with full set, or else of its name; 0 if neither is in the table.
+    [[nodiscard]] std::uint64_t find(std::string_view name, std::string_view value, bool& full) const {
+        std::uint64_t by_name = 0;
+        full = true;
+        for (std::size_t i = 0; i < STATIC_TABLE.size(); ++i) {
+            if (STATIC_TABLE[i].first != name)
+                continue;
+            if (STATIC_TABLE[i].second == value)
+                return i + 1;
+            if (!by_name)
+                by_name = i + 1;
+        }
+        for (std::size_t i = 0; i < entries.size(); ++i) {
+            if (entries[i].first != name)
+                continue;
+            if (entries[i].second == value)
+                return STATIC_TABLE.size() + i + 1;
+            if (!by_name)
+                by_name = STATIC_TABLE.size() + i + 1;
+        }
+        full = false;
+        return by_name;
+    }
+};
+
+class Decoder {
+    Table table;
+    std::string name;
+    std::string value;
+
+    template <class OnField> bool literal(const std::uint8_t*& p, const std::uint8_t* end, unsigned prefix, bool indexed, OnField& on_field) {
+        std::uint64_t index;
+        if (!decode_integer(p, end, prefix, index))
+            return false;
+        if (index == 0) {
+            if (!decode_string(p, end, name))
+                return false;
+        } else {
+            std::string_view indexed_name, ignored;
+            if (!table.get(index, indexed_name, ignored))
+                return false;
+            name.assign(indexed_name);
+        }
+        if (!decode_string(p, end, value))
+            return false;
+        on_field(std::string_view(name), std::string_view(value));
+        if (indexed)
+            table.add(name, value);
+        return true;
+    }
+
+  public:
+    // Calls on_field(name, value) for each field of a header block, in order.
+    // Returns false on a compression error, which is fatal to the connection.
+    template <class OnField> bool decode(const std::uint8_t* p, std::size_t size, OnField&& on_field) {
+        for (auto const end = p + size; p != end;) {
+            if (*p & 0x80) {
+                std::uint64_t index;
+                std::string_view field_name, field_value;
+                if (!decode_integer(p, end, 7, index) || !table.get(index, field_name, field_value))
+                    return false;
+                on_field(field_name, field_value);
+            } else if ((*p & 0xc0) == 0x40) {
+                if (!literal(p, end, 6, true, on_field))
+                    return false;
+            } else if ((*p & 0xe0) == 0x20) {
+                std::uint64_t max;
+                if (!decode_integer(p, end, 5, max) || max > DEFAULT_TABLE_SIZE)
+                    return false;
+                table.resize(max);
+            } else if (!literal(p, end, 4, false, on_field)) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+class Encoder {
+    Table table;
+    std::optional<std::size_t> smallest; // the smallest size since the last block, to signal
+
+  public:
+    enum class Indexing { index, skip, never };
+
+    // Follows the peer's SETTINGS_HEADER_TABLE_SIZE, up to DEFAULT_TABLE_SIZE.
+    void set_max_size(std::size_t max) {
+        max = std::min(max, DEFAULT_TABLE_SIZE);
+        if (max == table.max_size())
+            return;
+        smallest = std::min(smallest.value_or(max), max);
+        table.resize(max);
+    }
+
+    // Starts a header block, signalling table size changes first.
+    void begin(std::string& out) {
+        if (!smallest)
+            return;
+        if (*smallest < table.max_size())
+            encode_integer(out, 0x20, 5, *smallest);
+        encode_integer(out, 0x20, 5, table.max_size());
+        smallest.reset();
+    }
+
+    void encode(std::string& out, std::string_view name, std::string_view value, Indexing indexing) {
+        bool full;
+        auto const index = table.find(name, value, full);
+        if (full && indexing != Indexing::never) {
+            encode_integer(out, 0x80, 7, index);
+            return;
+        }
+        switch (indexing) {
+        case Indexing::index:
+            encode_integer(out, 0x40, 6, index);
+            break;
+        case Indexing::skip:
+            encode_integer(out, 0x00, 4, index);
+            break;
+        case Indexing::never:
+            encode_integer(out, 0x10, 4, index);
+            break;
+        }
+        if (index == 0)
+            encode_string(out, name);
+        encode_string(out, value);
+        if (indexing == Indexing::index)
+            table.add(name, value);
+    }
+};
+} // namespace swp::hpack
+
+#endif // SECUREWEBPASS_HPACK_HPP
@@ -0,0 +1,187 @@
+#ifndef SECUREWEBPASS_HTTP2_HPP
+#define SECUREWEBPASS_HTTP2_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/ssl/context.hpp>
+#include <boost/beast/core/buffer_traits.hpp>
+#include <boost/beast/core/buffers_suffix.hpp>
+#include <boost/beast/core/error.hpp>
+#include <boost/beast/http/message.hpp>
+#include <openssl/ssl.h>
+
+// The framing layer of HTTP/2 (RFC 7540), and its negotiation through ALPN.
+namespace swp::http2 {
+
+constexpr std::string_view PREFACE = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+constexpr std::size_t FRAME_HEADER_SIZE = 9;
+constexpr std::uint32_t DEFAULT_MAX_FRAME_SIZE = 16384; // also the largest frame the server accepts
+constexpr std::uint32_t MAX_MAX_FRAME_SIZE = 0xffffff;
+constexpr std::int64_t DEFAULT_WINDOW = 65535;
+constexpr std::int64_t MAX_WINDOW = 0x7fffffff;
+
+enum class FrameType : std::uint8_t {
+    data = 0x0,
+    headers = 0x1,
+    priority = 0x2,
+    rst_stream = 0x3,
+    settings = 0x4,
+    push_promise = 0x5,
+    ping = 0x6,
+    goaway = 0x7,
+    window_update = 0x8,
+    continuation = 0x9,
+};
+
+namespace flags {
+constexpr std::uint8_t END_STREAM = 0x1;
+constexpr std::uint8_t ACK = 0x1;
+constexpr std::uint8_t END_HEADERS = 0x4;
+constexpr std::uint8_t PADDED = 0x8;
+constexpr std::uint8_t PRIORITY = 0x20;
+} // namespace flags
+
+enum class Setting : std::uint16_t {
+    header_table_size = 0x1,
+    enable_push = 0x2,
+    max_concurrent_streams = 0x3,
+    initial_window_size = 0x4,
+    max_frame_size = 0x5,
+    max_header_list_size = 0x6,
+};
+
+enum class Error : std::uint32_t {
+    no_error = 0x0,
+    protocol_error = 0x1,
+    internal_error = 0x2,
+    flow_control_error = 0x3,
+    settings_timeout = 0x4,
+    stream_closed = 0x5,
+    frame_size_error = 0x6,
+    refused_stream = 0x7,
+    cancel = 0x8,
+    compression_error = 0x9,
+    connect_error = 0xa,
+    enhance_your_calm = 0xb,
+    inadequate_security = 0xc,
+    http_1_1_required = 0xd,
+};
+
+struct FrameHeader {
+    std::uint32_t length;
+    FrameType type;
+    std::uint8_t flags;
+    std::uint32_t stream;
+};
+
+inline std::uint32_t read_u32(const std::uint8_t* p) {
+    return std::uint32_t{p[0]} << 24 | std::uint32_t{p[1]} << 16 | std::uint32_t{p[2]} << 8 | p[3];
+}
+
+inline void write_u32(std::string& out, std::uint32_t value) {
+    char bytes[] = {static_cast<char>(value >> 24), static_cast<char>(value >> 16), static_cast<char>(value >> 8), static_cast<char>(value)};
+    out.append(bytes, sizeof(bytes));
+}
+
+inline FrameHeader read_frame_header(const std::uint8_t* p) {
+    return {std::uint32_t{p[0]} << 16 | std::uint32_t{p[1]} << 8 | p[2], static_cast<FrameType>(p[3]), p[4], read_u32(p + 5) & 0x7fffffff};
+}
+
+inline void write_frame_header(char* p, std::uint32_t length, FrameType type, std::uint8_t flags, std::uint32_t stream) {
+    p[0] = static_cast<char>(length >> 16);
+    p[1] = static_cast<char>(length >> 8);
+    p[2] = static_cast<char>(length);
+    p[3] = static_cast<char>(type);
+    p[4] = static_cast<char>(flags);
+    p[5] = static_cast<char>(stream >> 24);
+    p[6] = static_cast<char>(stream >> 16);
+    p[7] = static_cast<char>(stream >> 8);
+    p[8] = static_cast<char>(stream);
+}
+
+inline void write_frame_header(std::string& out, std::uint32_t length, FrameType type, std::uint8_t flags, std::uint32_t stream) {
+    char bytes[FRAME_HEADER_SIZE];
+    write_frame_header(bytes, length, type, flags, stream);
+    out.append(bytes, sizeof(bytes));
+}
+
+// Offered protocols, by preference, in the wire format of ALPN.
+constexpr unsigned char ALPN_PROTOCOLS[] = "\x02h2\x08http/1.1";
+
+// Picks h2 when the client offers it. A client offering neither protocol
+// gets no ALPN answer, and HTTP/1.1 without it.
+inline int select_alpn(SSL*, const unsigned char** out, unsigned char* outlen, const unsigned char* in, unsigned int inlen, void*) {
+    auto const selected = SSL_select_next_proto(const_cast<unsigned char**>(out), outlen, ALPN_PROTOCOLS, sizeof(ALPN_PROTOCOLS) - 1, in, inlen);
+    return selected == OPENSSL_NPN_NEGOTIATED ? SSL_TLSEXT_ERR_OK : SSL_TLSEXT_ERR_NOACK;
+}
+
+// Offers h2 on the connections of ctx.
+inline void enable_alpn(boost::asio::ssl::context& ctx) { SSL_CTX_set_alpn_select_cb(ctx.native_handle(), &select_alpn, nullptr); }
+
+// Whether the handshake of ssl settled on h2.
+inline bool negotiated(SSL* ssl) {
+    const unsigned char* protocol = nullptr;
+    unsigned int length = 0;
+    SSL_get0_alpn_selected(ssl, &protocol, &length);
+    return length == 2 && std::memcmp(protocol, "h2", 2) == 0;
+}
+
+// The body of a response, pulled a DATA frame at a time.
+class ResponseSource {
+  public:
+    virtual ~ResponseSource() = default;
+
+    // Whether the body has no more bytes.
+    virtual bool at_end(boost::beast::error_code& ec) = 0;
+
+    // Copies up to size bytes of the body to out.
+    virtual std::size_t read(char* out, std::size_t size, boost::beast::error_code& ec) = 0;
+};
+
+// Serializes the body of a response with its Body::writer, as http::serializer does.
+template <class Message> class MessageSource final : public ResponseSource {
+    using writer_type = typename Message::body_type::writer;
+
+    Message msg;
+    writer_type writer;
+    std::optional<boost::beast::buffers_suffix<typename writer_type::const_buffers_type>> pending;
+    bool more = true;
+
+  public:
+    MessageSource(Message&& m, boost::beast::error_code& ec) : msg(std::move(m)), writer(msg.base(), msg.body()) { writer.init(ec); }
+
+    [[nodiscard]] const Message& message() const noexcept { return msg; }
+
+    bool at_end(boost::beast::error_code& ec) override {
+        while (!pending || boost::beast::buffer_bytes(*pending) == 0) {
+            if (!more)
+                return true;
+            auto next = writer.get(ec);
+            if (ec || !next) {
+                more = false;
+                return true;
+            }
+            pending.emplace(next->first);
+            more = next->second;
+        }
+        return false;
+    }
+
+    std::size_t read(char* out, std::size_t size, boost::beast::error_code& ec) override {
+        std::size_t n = 0;
+        while (n < size && !at_end(ec)) {
+            auto const copied = boost::asio::buffer_copy(boost::asio::buffer(out + n, size - n), *pending);
+            pending->consume(copied);
+            n += copied;
+        }
+        return n;
+    }
+};
+} // namespace swp::http2
+
+#endif // SECUREWEBPASS_HTTP2_HPP
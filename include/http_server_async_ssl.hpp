@@ -15,15 +15,26 @@
 
 #pragma once
 
+#include "hpack.hpp"
+#include "http2.hpp"
 #include "request_handler.hpp"
+#include "tls_resumption.hpp"
 
 #include <algorithm>
+#include <charconv>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <functional>
 #include <iostream>
+#include <limits>
+#include <map>
 #include <memory>
+#include <optional>
 #include <string>
 #include <thread>
+#include <tuple>
 #include <utility>
 #include <vector>
 #include <boost/asio/dispatch.hpp>
@@ -67,42 +78,814 @@ void fail(beast::error_code ec, char const* what) {
     std::cerr << what << ": " << ec.message() << "\n";
 }
 
-// Handles an HTTP server connection
+// Size of the buffer vault uploads are read into before each BLOB write.
+constexpr std::size_t UPLOAD_CHUNK_SIZE = 64 * 1024;
+
+// HTTP/2 connections: bytes a client may send ahead on a stream, and on the
+// connection, before they are acknowledged. Bodies are either limited or
+// written to the database as they arrive, so this only bounds the bytes in flight.
+constexpr std::uint32_t H2_RECEIVE_WINDOW = 1 << 20;
+
+// Response bodies are framed up to this many bytes ahead of the socket.
+constexpr std::size_t H2_OUTPUT_TARGET = 64 * 1024;
+
+// Handles a connection which negotiated HTTP/2. Each stream carries one
+// request, handled once it was received whole, and up to
+// RequestLimits::pipeline streams are open at a time. Responses are framed as
+// soon as they are ready, their bodies taking turns within the client's flow
+// control windows.
+class http2_session : public std::enable_shared_from_this<http2_session> {
+    using Request = http::request<http::string_body>;
+
+    struct Stream {
+        Request req;
+        std::optional<std::uint64_t> content_length;
+        std::uint64_t received = 0; // body bytes
+        std::uint64_t limit = 0;
+        std::unique_ptr<swp::ServerDB::VaultUpload> upload;
+        std::unique_ptr<swp::http2::ResponseSource> response; // the body left to send
+        std::int64_t send_window = 0;
+        bool remote_closed = false; // the client sent its last frame
+        bool answered = false;      // handed to its handler, or refused
+        bool responding = false;    // the response headers were sent
+        bool ready = false;         // waits in ready_ to send its body
+    };
+
+    using StreamIterator = std::map<std::uint32_t, Stream>::iterator;
+
+    // Sends the response of one stream, whenever the handler is done.
+    struct send_lambda {
+        http2_session& self_;
+        std::uint32_t id_;
+
+        template <bool isRequest, class Body, class Fields> void operator()(http::message<isRequest, Body, Fields>&& msg) const {
+            self_.start_response(id_, std::move(msg));
+        }
+
+        [[nodiscard]] std::shared_ptr<http2_session> lifetime() const { return self_.shared_from_this(); }
+
+        [[nodiscard]] auto get_executor() const { return self_.stream_.get_executor(); }
+    };
+
+    beast::ssl_stream<beast::tcp_stream> stream_;
+    beast::flat_buffer buffer_;
+    std::shared_ptr<std::string const> doc_root_;
+    swp::hpack::Decoder decoder_;
+    swp::hpack::Encoder encoder_;
+    std::map<std::uint32_t, Stream> streams_;
+    std::deque<std::uint32_t> ready_; // streams with body bytes to send, in turn
+    std::string block_;               // the header block being received
+    std::uint32_t block_stream_ = 0;
+    std::uint8_t block_flags_ = 0;
+    bool block_opens_ = false;  // the block opens its stream, rather than carrying trailers
+    bool continuation_ = false; // the block continues in CONTINUATION frames
+    std::string header_out_;    // the header block being sent
+    std::string name_;          // a field name, lowercased
+    std::string out_;           // the frames being written
+    std::string queued_;        // the frames to write next
+    std::uint32_t last_stream_ = 0;
+    std::int64_t send_window_ = swp::http2::DEFAULT_WINDOW;
+    std::int64_t initial_window_ = swp::http2::DEFAULT_WINDOW;
+    std::uint32_t max_frame_ = swp::http2::DEFAULT_MAX_FRAME_SIZE;
+    bool preface_ = false;  // the client's connection preface was received
+    bool settings_ = false; // and its first SETTINGS
+    bool reading_ = false;
+    bool writing_ = false;
+    bool read_paused_ = false; // too many frames wait to be written
+    bool read_done_ = false;   // the client closed its side
+    bool goaway_ = false;      // the client won't open more streams
+    bool closing_ = false;
+    bool shutdown_ = false;
+    std::reference_wrapper<swp::ServerDB> m_db;
+    std::reference_wrapper<swp::KdfExecutor> m_kdf;
+    std::reference_wrapper<swp::StaticCache> m_assets;
+    swp::RequestLimits m_limits;
+
+  public:
+    // Takes over the connection of a session, right after its handshake
+    http2_session(beast::ssl_stream<beast::tcp_stream>&& stream, std::shared_ptr<std::string const> doc_root, swp::ServerDB& db,
+                  swp::KdfExecutor& kdf, swp::StaticCache& assets, const swp::RequestLimits& limits)
+        : stream_(std::move(stream)), doc_root_(std::move(doc_root)), m_db(db), m_kdf(kdf), m_assets(assets), m_limits(limits) {}
+
+    // Runs on the strand of the connection
+    void run() {
+        using namespace swp::http2;
+
+        // The server's preface: its SETTINGS, and room for uploads on the connection
+        write_frame_header(queued_, 3 * 6, FrameType::settings, 0, 0);
+        write_setting(Setting::max_concurrent_streams, static_cast<std::uint32_t>(m_limits.pipeline));
+        write_setting(Setting::initial_window_size, H2_RECEIVE_WINDOW);
+        write_setting(Setting::max_header_list_size, m_limits.header);
+        write_window_update(0, H2_RECEIVE_WINDOW - DEFAULT_WINDOW);
+
+        do_write();
+        do_read();
+    }
+
+  private:
+    void write_setting(swp::http2::Setting setting, std::uint32_t value) {
+        auto const id = static_cast<std::uint16_t>(setting);
+        queued_.push_back(static_cast<char>(id >> 8));
+        queued_.push_back(static_cast<char>(id));
+        swp::http2::write_u32(queued_, value);
+    }
+
+    void write_window_update(std::uint32_t stream, std::uint32_t increment) {
+        swp::http2::write_frame_header(queued_, 4, swp::http2::FrameType::window_update, 0, stream);
+        swp::http2::write_u32(queued_, increment);
+    }
+
+    void write_rst_stream(std::uint32_t stream, swp::http2::Error code) {
+        swp::http2::write_frame_header(queued_, 4, swp::http2::FrameType::rst_stream, 0, stream);
+        swp::http2::write_u32(queued_, static_cast<std::uint32_t>(code));
+    }
+
+    // Sends the header block in header_out_, split to the client's frame size.
+    void write_headers(std::uint32_t stream, bool end_stream) {
+        using namespace swp::http2;
+        std::string_view rest = header_out_;
+        auto type = FrameType::headers;
+        std::uint8_t frame_flags = end_stream ? flags::END_STREAM : 0;
+        do {
+            auto const n = std::min<std::size_t>(rest.size(), max_frame_);
+            write_frame_header(queued_, static_cast<std::uint32_t>(n), type, frame_flags | (n == rest.size() ? flags::END_HEADERS : 0), stream);
+            queued_.append(rest.substr(0, n));
+            rest.remove_prefix(n);
+            type = FrameType::continuation;
+            frame_flags = 0;
+        } while (!rest.empty());
+    }
+
+    // Fails the whole connection: tells the client why, then closes.
+    void connection_error(swp::http2::Error code) {
+        if (closing_)
+            return;
+        swp::http2::write_frame_header(queued_, 8, swp::http2::FrameType::goaway, 0, 0);
+        swp::http2::write_u32(queued_, last_stream_);
+        swp::http2::write_u32(queued_, static_cast<std::uint32_t>(code));
+        closing_ = true;
+        streams_.clear();
+        ready_.clear();
+    }
+
+    void reset_stream(StreamIterator it, swp::http2::Error code) {
+        write_rst_stream(it->first, code);
+        streams_.erase(it);
+    }
+
+    // The response was sent whole: a client still sending its request is told to stop.
+    void finish_stream(StreamIterator it) {
+        if (!it->second.remote_closed)
+            write_rst_stream(it->first, swp::http2::Error::no_error);
+        streams_.erase(it);
+    }
+
+    void schedule(std::uint32_t id, Stream& stream) {
+        if (stream.ready)
+            return;
+        stream.ready = true;
+        ready_.push_back(id);
+    }
+
+    void do_read() {
+        reading_ = true;
+
+        // Set the timeout.
+        beast::get_lowest_layer(stream_).expires_after(std::chrono::seconds(30));
+
+        stream_.async_read_some(buffer_.prepare(swp::http2::FRAME_HEADER_SIZE + swp::http2::DEFAULT_MAX_FRAME_SIZE),
+                                beast::bind_front_handler(&http2_session::on_read, shared_from_this()));
+    }
+
+    void on_read(beast::error_code ec, std::size_t bytes_transferred) {
+        reading_ = false;
+
+        // Canceled to close the connection
+        if (closing_)
+            return close_when_done();
+
+        // This means they closed the connection: close once the open streams are answered
+        if (ec == net::error::eof || ec == ssl::error::stream_truncated) {
+            read_done_ = true;
+            return flush();
+        }
+
+        if (ec)
+            return fail(ec, "read");
+
+        buffer_.commit(bytes_transferred);
+        process();
+
+        // Stop reading while the client doesn't read its responses
+        if (!closing_) {
+            if (queued_.size() > 4 * H2_OUTPUT_TARGET)
+                read_paused_ = true;
+            else
+                do_read();
+        }
+        flush();
+    }
+
+    // Handles every complete frame of the buffer.
+    void process() {
+        using namespace swp::http2;
+        auto const* data = static_cast<const std::uint8_t*>(buffer_.data().data());
+        auto const size = buffer_.size();
+        std::size_t used = 0;
+        if (!preface_) {
+            if (std::memcmp(data, PREFACE.data(), std::min(size, PREFACE.size())) != 0)
+                return connection_error(Error::protocol_error);
+            if (size < PREFACE.size())
+                return;
+            used = PREFACE.size();
+            preface_ = true;
+        }
+        while (!closing_ && size - used >= FRAME_HEADER_SIZE) {
+            auto const frame = read_frame_header(data + used);
+            if (frame.length > DEFAULT_MAX_FRAME_SIZE)
+                return connection_error(Error::frame_size_error);
+            if (size - used - FRAME_HEADER_SIZE < frame.length)
+                break;
+            on_frame(frame, data + used + FRAME_HEADER_SIZE);
+            used += FRAME_HEADER_SIZE + frame.length;
+        }
+        buffer_.consume(used);
+    }
+
+    // Drops the padding of a DATA or HEADERS frame; false when it exceeds the frame.
+    static bool strip_padding(const swp::http2::FrameHeader& frame, const std::uint8_t*& payload, std::uint32_t& length) {
+        if (!(frame.flags & swp::http2::flags::PADDED))
+            return true;
+        if (length == 0 || payload[0] >= length)
+            return false;
+        length -= 1 + payload[0];
+        ++payload;
+        return true;
+    }
+
+    void on_frame(const swp::http2::FrameHeader& frame, const std::uint8_t* payload) {
+        using namespace swp::http2;
+        if (!settings_ && frame.type != FrameType::settings)
+            return connection_error(Error::protocol_error);
+        // Nothing may come between the frames of a header block
+        if (continuation_ && (frame.type != FrameType::continuation || frame.stream != block_stream_))
+            return connection_error(Error::protocol_error);
+
+        auto length = frame.length;
+        switch (frame.type) {
+        case FrameType::data: {
+            if (frame.stream == 0 || !strip_padding(frame, payload, length))
+                return connection_error(Error::protocol_error);
+            // The bytes are consumed at once, so the whole frame is acknowledged, padding included
+            if (frame.length > 0)
+                write_window_update(0, frame.length);
+            auto const it = streams_.find(frame.stream);
+            if (it == streams_.end()) {
+                // Frames of a stream reset by the server may still be on their way
+                if (frame.stream > last_stream_)
+                    connection_error(Error::protocol_error);
+                return;
+            }
+            if (it->second.remote_closed)
+                return reset_stream(it, Error::stream_closed);
+            if (!(frame.flags & flags::END_STREAM) && frame.length > 0)
+                write_window_update(frame.stream, frame.length);
+            if (on_body(it, payload, length) && (frame.flags & flags::END_STREAM))
+                on_end_stream(frame.stream);
+            return;
+        }
+        case FrameType::headers: {
+            if (frame.stream == 0 || frame.stream % 2 == 0 || !strip_padding(frame, payload, length))
+                return connection_error(Error::protocol_error);
+            if (frame.flags & flags::PRIORITY) {
+                if (length < 5)
+                    return connection_error(Error::protocol_error);
+                payload += 5;
+                length -= 5;
+            }
+            auto const it = streams_.find(frame.stream);
+            if (it != streams_.end() && it->second.remote_closed)
+                return connection_error(Error::stream_closed);
+            block_opens_ = frame.stream > last_stream_;
+            last_stream_ = std::max(last_stream_, frame.stream);
+            block_.assign(reinterpret_cast<const char*>(payload), length);
+            block_stream_ = frame.stream;
+            block_flags_ = frame.flags;
+            continuation_ = !(frame.flags & flags::END_HEADERS);
+            if (!continuation_)
+                on_header_block();
+            return;
+        }
+        case FrameType::continuation:
+            if (!continuation_)
+                return connection_error(Error::protocol_error);
+            // Decoded at once, so the block is bounded before its fields are
+            if (block_.size() + length > 4 * std::size_t{m_limits.header})
+                return connection_error(Error::enhance_your_calm);
+            block_.append(reinterpret_cast<const char*>(payload), length);
+            continuation_ = !(frame.flags & flags::END_HEADERS);
+            if (!continuation_)
+                on_header_block();
+            return;
+        case FrameType::priority:
+            // Every stream is served as soon as it can be
+            if (frame.stream == 0)
+                return connection_error(Error::protocol_error);
+            if (length != 5)
+                write_rst_stream(frame.stream, Error::frame_size_error);
+            return;
+        case FrameType::rst_stream:
+            if (frame.stream == 0 || frame.stream > last_stream_)
+                return connection_error(Error::protocol_error);
+            if (length != 4)
+                return connection_error(Error::frame_size_error);
+            streams_.erase(frame.stream);
+            return;
+        case FrameType::settings:
+            return on_settings(frame, payload);
+        case FrameType::ping:
+            if (frame.stream != 0)
+                return connection_error(Error::protocol_error);
+            if (length != 8)
+                return connection_error(Error::frame_size_error);
+            if (!(frame.flags & flags::ACK)) {
+                write_frame_header(queued_, 8, FrameType::ping, flags::ACK, 0);
+                queued_.append(reinterpret_cast<const char*>(payload), 8);
+            }
+            return;
+        case FrameType::goaway:
+            if (frame.stream != 0)
+                return connection_error(Error::protocol_error);
+            goaway_ = true;
+            return;
+        case FrameType::window_update:
+            return on_window_update(frame, payload);
+        case FrameType::push_promise:
+            // Clients never push
+            return connection_error(Error::protocol_error);
+        default:
+            // Unknown frames are ignored
+            return;
+        }
+    }
+
+    void on_settings(const swp::http2::FrameHeader& frame, const std::uint8_t* payload) {
+        using namespace swp::http2;
+        if (frame.stream != 0)
+            return connection_error(Error::protocol_error);
+        if (frame.flags & flags::ACK) {
+            if (frame.length != 0)
+                connection_error(Error::frame_size_error);
+            return;
+        }
+        if (frame.length % 6 != 0)
+            return connection_error(Error::frame_size_error);
+        for (auto p = payload; p != payload + frame.length; p += 6) {
+            auto const value = read_u32(p + 2);
+            switch (static_cast<Setting>(p[0] << 8 | p[1])) {
+            case Setting::header_table_size:
+                encoder_.set_max_size(value);
+                break;
+            case Setting::enable_push:
+                if (value > 1)
+                    return connection_error(Error::protocol_error);
+                break;
+            case Setting::initial_window_size:
+                if (value > MAX_WINDOW)
+                    return connection_error(Error::flow_control_error);
+                for (auto& [id, stream] : streams_) {
+                    stream.send_window += value - initial_window_;
+                    if (stream.send_window > MAX_WINDOW)
+                        return connection_error(Error::flow_control_error);
+                    if (stream.response)
+                        schedule(id, stream);
+                }
+                initial_window_ = value;
+                break;
+            case Setting::max_frame_size:
+                if (value < DEFAULT_MAX_FRAME_SIZE || value > MAX_MAX_FRAME_SIZE)
+                    return connection_error(Error::protocol_error);
+                max_frame_ = value;
+                break;
+            default:
+                // The others bound what the server doesn't send: pushes and large header lists
+                break;
+            }
+        }
+        settings_ = true;
+        write_frame_header(queued_, 0, FrameType::settings, flags::ACK, 0);
+    }
+
+    void on_window_update(const swp::http2::FrameHeader& frame, const std::uint8_t* payload) {
+        using namespace swp::http2;
+        if (frame.length != 4)
+            return connection_error(Error::frame_size_error);
+        auto const increment = read_u32(payload) & 0x7fffffff;
+        if (frame.stream == 0) {
+            if (increment == 0)
+                return connection_error(Error::protocol_error);
+            if (send_window_ + increment > MAX_WINDOW)
+                return connection_error(Error::flow_control_error);
+            send_window_ += increment;
+            return;
+        }
+        auto const it = streams_.find(frame.stream);
+        if (it == streams_.end()) {
+            if (frame.stream > last_stream_)
+                connection_error(Error::protocol_error);
+            return;
+        }
+        auto& stream = it->second;
+        if (increment == 0)
+            return reset_stream(it, Error::protocol_error);
+        if (stream.send_window + increment > MAX_WINDOW)
+            return reset_stream(it, Error::flow_control_error);
+        stream.send_window += increment;
+        if (stream.response)
+            schedule(frame.stream, stream);
+    }
+
+    // Decodes a whole header block: even a block which is refused updates the
+    // decoder's table.
+    void on_header_block() {
+        using namespace swp::http2;
+        auto const id = block_stream_;
+        Request req;
+        req.version(11);
+        std::string authority;
+        std::size_t list_size = 0;
+        unsigned pseudo = 0;
+        bool regular = false, malformed = false, too_large = false;
+        auto const* block = reinterpret_cast<const std::uint8_t*>(block_.data());
+        auto const decoded = decoder_.decode(block, block_.size(), [&](std::string_view name, std::string_view value) {
+            // Sized as SETTINGS_MAX_HEADER_LIST_SIZE is
+            list_size += name.size() + value.size() + 32;
+            too_large = too_large || list_size > m_limits.header;
+            if (too_large || malformed || !block_opens_)
+                return;
+            if (!name.empty() && name.front() == ':') {
+                unsigned const bit = name == ":method" ? 1 : name == ":path" ? 2 : name == ":scheme" ? 4 : name == ":authority" ? 8 : 0;
+                malformed = regular || bit == 0 || (pseudo & bit) || value.empty();
+                pseudo |= bit;
+                if (bit == 1)
+                    req.method_string(sv2bsv(value));
+                else if (bit == 2)
+                    req.target(sv2bsv(value));
+                else if (bit == 8)
+                    authority.assign(value);
+                return;
+            }
+            regular = true;
+            // Field names are lowercase, and connection-specific fields are meaningless
+            auto const field = http::string_to_field(sv2bsv(name));
+            malformed = name.empty() || std::any_of(name.begin(), name.end(), [](char c) { return c >= 'A' && c <= 'Z'; }) ||
+                        field == http::field::connection || field == http::field::keep_alive || field == http::field::proxy_connection ||
+                        field == http::field::transfer_encoding || field == http::field::upgrade || (field == http::field::te && value != "trailers");
+            req.insert(sv2bsv(name), sv2bsv(value));
+        });
+        if (!decoded)
+            return connection_error(Error::compression_error);
+
+        auto const end_stream = (block_flags_ & flags::END_STREAM) != 0;
+        if (!block_opens_) {
+            // Trailers end their stream; a stream reset by the server may still get some
+            auto const it = streams_.find(id);
+            if (it == streams_.end())
+                return;
+            if (!end_stream)
+                return reset_stream(it, Error::protocol_error);
+            return on_end_stream(id);
+        }
+
+        if (goaway_ || streams_.size() >= m_limits.pipeline)
+            return write_rst_stream(id, Error::refused_stream);
+        if (malformed || (!too_large && (pseudo & 7) != 7))
+            return write_rst_stream(id, Error::protocol_error);
+        if (!authority.empty() && req.find(http::field::host) == req.end())
+            req.set(http::field::host, authority);
+
+        auto const it = streams_.try_emplace(id).first;
+        auto& stream = it->second;
+        stream.req = std::move(req);
+        stream.send_window = initial_window_;
+        stream.remote_closed = end_stream;
+        if (too_large)
+            return start_response(id, make_error(http::status::request_header_fields_too_large, 11, true, "The request header is too large."));
+        if (auto const field = stream.req.find(http::field::content_length); field != stream.req.end()) {
+            std::uint64_t length;
+            auto const value = field->value();
+            if (auto const [end, ec] = std::from_chars(value.begin(), value.end(), length); ec != std::errc() || end != value.end())
+                return reset_stream(it, Error::protocol_error);
+            stream.content_length = length;
+        }
+
+        // The same checks as an HTTP/1.1 request gets from its header
+        if (is_vault_upload(stream.req)) {
+            if (auto refusal = open_vault_upload(stream.req, stream.content_length, m_db, m_limits, stream.upload))
+                return start_response(id, std::move(*refusal));
+            stream.limit = *stream.content_length;
+            if (beast::iequals(stream.req[http::field::expect], "100-continue")) {
+                header_out_.clear();
+                encoder_.begin(header_out_);
+                encoder_.encode(header_out_, ":status", "100", swp::hpack::Encoder::Indexing::index);
+                write_headers(id, false);
+            }
+        } else {
+            if (auto refusal = screen_request(stream.req, stream.content_length, end_stream, m_db, m_limits))
+                return start_response(id, std::move(*refusal));
+            stream.limit = body_limit(stream.req, m_limits);
+        }
+        if (end_stream)
+            on_end_stream(id);
+    }
+
+    // Takes the body bytes of a DATA frame. Returns false once the stream is reset.
+    bool on_body(StreamIterator it, const std::uint8_t* data, std::size_t size) {
+        auto const id = it->first;
+        auto& stream = it->second;
+        stream.received += size;
+        if (stream.content_length && stream.received > *stream.content_length) {
+            reset_stream(it, swp::http2::Error::protocol_error);
+            return false;
+        }
+        // A refused request: the rest of its body is dropped
+        if (stream.answered)
+            return true;
+        if (stream.received > stream.limit) {
+            auto const limit = std::to_string(stream.limit);
+            start_response(id, make_error(http::status::payload_too_large, 11, true, "The request body exceeds ", limit, " bytes."));
+        } else if (stream.upload) {
+            if (stream.upload->write(data, size) != SQLITE_OK)
+                start_response(id, make_error(http::status::internal_server_error, 11, true, "An error occurred: 'Cannot store vault data.'"));
+        } else {
+            stream.req.body().append(reinterpret_cast<const char*>(data), size);
+        }
+        return streams_.count(id) != 0;
+    }
+
+    // The request of a stream was received whole: handle it.
+    void on_end_stream(std::uint32_t id) {
+        auto const it = streams_.find(id);
+        auto& stream = it->second;
+        stream.remote_closed = true;
+        if (stream.answered)
+            return;
+        if (stream.content_length && stream.received != *stream.content_length)
+            return reset_stream(it, swp::http2::Error::protocol_error);
+        if (stream.upload) {
+            auto res = close_vault_upload(stream.req, *stream.upload);
+            return start_response(id, std::move(res));
+        }
+        stream.answered = true;
+        auto req = std::move(stream.req);
+        handle_request(*doc_root_, std::move(req), send_lambda{*this, id}, m_db, m_kdf, m_assets);
+    }
+
+    // Encodes the status and the fields of a response into header_out_.
+    template <class Fields> void encode_headers(unsigned status, const Fields& fields) {
+        using Indexing = swp::hpack::Encoder::Indexing;
+        header_out_.clear();
+        encoder_.begin(header_out_);
+        char const code[] = {static_cast<char>('0' + status / 100 % 10), static_cast<char>('0' + status / 10 % 10),
+                             static_cast<char>('0' + status % 10)};
+        encoder_.encode(header_out_, ":status", std::string_view(code, sizeof(code)), Indexing::index);
+        for (auto const& field : fields) {
+            auto indexing = Indexing::index;
+            switch (field.name()) {
+            case http::field::connection:
+            case http::field::keep_alive:
+            case http::field::proxy_connection:
+            case http::field::transfer_encoding:
+            case http::field::upgrade:
+                continue;
+            case http::field::set_cookie:
+                // Session ids stay out of the compression context
+                indexing = Indexing::never;
+                break;
+            case http::field::content_length:
+            case http::field::date:
+            case http::field::etag:
+            case http::field::last_modified:
+            case http::field::content_range:
+            case http::field::location:
+                // Changes with every response: indexing would only evict the fields which repeat
+                indexing = Indexing::skip;
+                break;
+            default:
+                break;
+            }
+            auto const name = field.name_string();
+            name_.assign(name.data(), name.size());
+            std::transform(name_.begin(), name_.end(), name_.begin(),
+                           [](char c) { return c >= 'A' && c <= 'Z' ? static_cast<char>(c - 'A' + 'a') : c; });
+            encoder_.encode(header_out_, name_, bsv2sv(field.value()), indexing);
+        }
+    }
+
+    // Sends the headers of a response, and queues its body.
+    template <class Message> void start_response(std::uint32_t id, Message&& msg) {
+        using namespace swp::http2;
+        // The client may have reset the stream meanwhile
+        auto const it = streams_.find(id);
+        if (it == streams_.end() || it->second.responding)
+            return;
+        auto& stream = it->second;
+        stream.answered = stream.responding = true;
+        stream.upload.reset();
+
+        beast::error_code ec;
+        auto source = std::make_unique<MessageSource<Message>>(std::move(msg), ec);
+        auto const empty = !ec && source->at_end(ec);
+        if (ec) {
+            reset_stream(it, Error::internal_error);
+            return flush();
+        }
+        encode_headers(source->message().result_int(), source->message().base());
+        write_headers(id, empty);
+        if (empty) {
+            finish_stream(it);
+        } else {
+            stream.response = std::move(source);
+            schedule(id, stream);
+        }
+        flush();
+    }
+
+    // Frames the bodies of the ready streams in turn, as far as the flow
+    // control windows and the output target allow.
+    void send_data() {
+        using namespace swp::http2;
+        while (!closing_ && send_window_ > 0 && queued_.size() < H2_OUTPUT_TARGET && !ready_.empty()) {
+            auto const id = ready_.front();
+            ready_.pop_front();
+            auto const it = streams_.find(id);
+            if (it == streams_.end())
+                continue;
+            auto& stream = it->second;
+            stream.ready = false;
+            // Until a WINDOW_UPDATE of the stream
+            if (stream.send_window <= 0)
+                continue;
+
+            auto const limit = static_cast<std::size_t>(std::min<std::int64_t>({send_window_, stream.send_window, max_frame_}));
+            auto const header = queued_.size();
+            queued_.resize(header + FRAME_HEADER_SIZE + limit);
+            beast::error_code ec;
+            auto const n = stream.response->read(queued_.data() + header + FRAME_HEADER_SIZE, limit, ec);
+            auto const done = !ec && stream.response->at_end(ec);
+            if (ec) {
+                queued_.resize(header);
+                reset_stream(it, Error::internal_error);
+                continue;
+            }
+            queued_.resize(header + FRAME_HEADER_SIZE + n);
+            write_frame_header(queued_.data() + header, static_cast<std::uint32_t>(n), FrameType::data, done ? flags::END_STREAM : 0, id);
+            send_window_ -= static_cast<std::int64_t>(n);
+            stream.send_window -= static_cast<std::int64_t>(n);
+            if (done)
+                finish_stream(it);
+            else
+                schedule(id, stream);
+        }
+    }
+
+    // Frames what can be sent and writes it, then closes the connection if it is done.
+    void flush() {
+        send_data();
+        if (!closing_ && (read_done_ || goaway_) && streams_.empty())
+            closing_ = true;
+        do_write();
+        if (closing_)
+            close_when_done();
+    }
+
+    // Writes the queued frames, one write at a time.
+    void do_write() {
+        if (writing_ || queued_.empty())
+            return;
+        writing_ = true;
+        std::swap(out_, queued_);
+
+        // Set the timeout.
+        beast::get_lowest_layer(stream_).expires_after(std::chrono::seconds(30));
+
+        net::async_write(stream_, net::buffer(out_), beast::bind_front_handler(&http2_session::on_write, shared_from_this()));
+    }
+
+    void on_write(beast::error_code ec, std::size_t bytes_transferred) {
+        boost::ignore_unused(bytes_transferred);
+        writing_ = false;
+        out_.clear();
+
+        if (ec)
+            return fail(ec, "write");
+
+        // Read again, if the client was reading too slowly
+        if (read_paused_ && !closing_) {
+            read_paused_ = false;
+            do_read();
+        }
+        flush();
+    }
+
+    // Closes the connection once its last frames are written.
+    void close_when_done() {
+        if (writing_ || !queued_.empty() || shutdown_)
+            return;
+        // The pending read completes with an error, then closes
+        if (reading_)
+            return beast::get_lowest_layer(stream_).cancel();
+        shutdown_ = true;
+
+        // Set the timeout.
+        beast::get_lowest_layer(stream_).expires_after(std::chrono::seconds(30));
+
+        // Perform the SSL shutdown
+        stream_.async_shutdown(beast::bind_front_handler(&http2_session::on_shutdown, shared_from_this()));
+    }
+
+    void on_shutdown(beast::error_code ec) {
+        if (ec)
+            return fail(ec, "shutdown");
+
+        // At this point the connection is closed gracefully
+    }
+};
+
+// Handles an HTTP server connection. Requests are read ahead while the
+// responses of the previous ones are written, up to RequestLimits::pipeline
+// of them, and the responses are written in the order of the requests.
 class session : public std::enable_shared_from_this<session> {
+    // A response of the queue: written once it is ready and every response
+    // before it was written.
+    struct Pending {
+        swp::ResponseSlot message;
+        void (*write)(session&, Pending&) = nullptr; // set once the response is ready
+        bool close = false;
+    };
+
     // This is the C++11 equivalent of a generic lambda.
-    // The function object is used to send an HTTP message.
+    // The function object is used to send the HTTP response
+    // of one request, possibly after a later request's.
     struct send_lambda {
         session& self_;
+        std::size_t slot_;
 
-        explicit send_lambda(session& self) : self_(self) {}
+        send_lambda(session& self, std::size_t slot) : self_(self), slot_(slot) {}
 
         template <bool isRequest, class Body, class Fields> void operator()(http::message<isRequest, Body, Fields>&& msg) const {
             // The lifetime of the message has to extend
             // for the duration of the async operation so
-            // we use a shared_ptr to manage it.
-            auto sp = std::make_shared<http::message<isRequest, Body, Fields>>(std::move(msg));
-
-            // Store a type-erased version of the shared
-            // pointer in the class to keep it alive.
-            self_.res_ = sp;
+            // it is moved into the request's slot of the
+            // queue, which later requests reuse.
+            auto& pending = self_.pending_[slot_];
+            pending.close = pending.message.emplace(std::move(msg)).need_eof();
+            pending.write = [](session& self, Pending& pending) {
+                auto& res = *static_cast<http::message<isRequest, Body, Fields>*>(pending.message.get());
+                http::async_write(self.stream_, res, beast::bind_front_handler(&session::on_write, self.shared_from_this()));
+            };
 
-            // Write the response
-            http::async_write(self_.stream_, *sp, beast::bind_front_handler(&session::on_write, self_.shared_from_this(), sp->need_eof()));
+            // Write the response, unless it has to wait for the previous ones
+            self_.do_write();
         }
+
+        // Handlers that answer asynchronously hold on to this to keep the
+        // session alive, and resume on the session's strand through get_executor().
+        [[nodiscard]] std::shared_ptr<session> lifetime() const { return self_.shared_from_this(); }
+
+        [[nodiscard]] auto get_executor() const { return self_.stream_.get_executor(); }
     };
 
     beast::ssl_stream<beast::tcp_stream> stream_;
     beast::flat_buffer buffer_;
     std::shared_ptr<std::string const> doc_root_;
-    http::request<http::string_body> req_;
-    std::shared_ptr<void> res_;
-    send_lambda lambda_;
+    swp::RequestArena arena_; // backs the request being handled
+    std::optional<http::request_parser<http::empty_body, swp::ArenaAllocator>> header_parser_;
+    std::optional<http::request_parser<swp::ArenaStringBody, swp::ArenaAllocator>> parser_;
+    std::optional<http::request_parser<http::buffer_body, swp::ArenaAllocator>> upload_parser_;
+    std::unique_ptr<swp::ServerDB::VaultUpload> upload_;
+    std::unique_ptr<char[]> chunk_; // allocated by the session's first upload
+    swp::ResponseSlot interim_;     // a 100 Continue
+    std::unique_ptr<Pending[]> pending_;
+    std::size_t head_ = 0;  // the next response to write
+    std::size_t count_ = 0; // requests read and not answered yet
+    bool writing_ = false;
+    bool read_paused_ = false;    // the queue is full
+    bool upload_waiting_ = false; // an upload waits for the queue to drain
+    bool read_done_ = false;      // no more requests will be read
     std::reference_wrapper<swp::ServerDB> m_db;
+    std::reference_wrapper<swp::KdfExecutor> m_kdf;
+    std::reference_wrapper<swp::StaticCache> m_assets;
+    swp::RequestLimits m_limits;
 
   public:
     // Take ownership of the socket
-    explicit session(tcp::socket&& socket, ssl::context& ctx, std::shared_ptr<std::string const>  doc_root, swp::ServerDB& db)
-        : stream_(std::move(socket), ctx), doc_root_(std::move(doc_root)), m_db(db), lambda_(*this) {}
+    explicit session(tcp::socket&& socket, ssl::context& ctx, std::shared_ptr<std::string const>  doc_root, swp::ServerDB& db, swp::KdfExecutor& kdf,
+                     swp::StaticCache& assets, const swp::RequestLimits& limits)
+        : stream_(std::move(socket), ctx), doc_root_(std::move(doc_root)), pending_(std::make_unique<Pending[]>(std::max<std::size_t>(limits.pipeline, 1))),
+          m_db(db), m_kdf(kdf), m_assets(assets), m_limits(limits) {
+        m_limits.pipeline = std::max<std::size_t>(m_limits.pipeline, 1);
+    }
 
     // Start the asynchronous operation
     void run() {
@@ -125,38 +908,196 @@ class session : public std::enable_shared_from_this<session> {
         if (ec)
             return fail(ec, "handshake");
 
+        swp::TlsResumption::record_handshake(stream_.native_handle());
+
+        // Clients which negotiated HTTP/2 are served by a session of their own
+        if (swp::http2::negotiated(stream_.native_handle()))
+            return std::make_shared<http2_session>(std::move(stream_), doc_root_, m_db, m_kdf, m_assets, m_limits)->run();
+
         do_read();
     }
 
     void do_read() {
-        // Make the request empty before reading,
-        // otherwise the operation behavior is undefined.
-        req_ = {};
+        // The previous request is done with: free it at once
+        parser_.reset();
+        upload_parser_.reset();
+        header_parser_.reset();
+        arena_.reset();
+
+        // Read the header alone first: vault uploads are streamed from there,
+        // and each kind of request enforces its own body limit afterwards
+        header_parser_.emplace(std::piecewise_construct, std::make_tuple(), std::make_tuple(arena_.allocator()));
+        header_parser_->header_limit(m_limits.header);
+        header_parser_->body_limit(std::numeric_limits<std::uint64_t>::max());
 
         // Set the timeout.
         beast::get_lowest_layer(stream_).expires_after(std::chrono::seconds(30));
 
-        // Read a request
-        http::async_read(stream_, buffer_, req_, beast::bind_front_handler(&session::on_read, shared_from_this()));
+        // Read a request header
+        http::async_read_header(stream_, buffer_, *header_parser_, beast::bind_front_handler(&session::on_read_header, shared_from_this()));
     }
 
-    void on_read(beast::error_code ec, std::size_t bytes_transferred) {
+    void on_read_header(beast::error_code ec, std::size_t bytes_transferred) {
         boost::ignore_unused(bytes_transferred);
 
-        // This means they closed the connection
-        if (ec == http::error::end_of_stream)
-            return do_close();
+        // This means they closed the connection: close once they got their answers
+        if (ec == http::error::end_of_stream) {
+            read_done_ = true;
+            if (count_ == 0)
+                do_close();
+            return;
+        }
+
+        // The header couldn't be parsed: answer, then close
+        if (ec == http::error::header_limit) {
+            respond(make_error(http::status::request_header_fields_too_large, 11, false, "The request header is too large."));
+            return read_next(false);
+        }
 
         if (ec)
             return fail(ec, "read");
 
-        // Send the response
-        handle_request(*doc_root_, std::move(req_), lambda_, m_db);
+        // Uploads are streamed on their own, once the responses before them are written
+        if (is_vault_upload(header_parser_->get())) {
+            if (count_ > 0) {
+                upload_waiting_ = true;
+                return;
+            }
+            return start_upload();
+        }
+
+        // Every other request is buffered, once its header passed the checks of its route
+        parser_.emplace(std::move(*header_parser_), arena_.allocator());
+        if (auto refusal = screen_request(*parser_, m_db, m_limits)) {
+            auto const keep_alive = refusal->keep_alive();
+            respond(std::move(*refusal));
+            return read_next(keep_alive);
+        }
+
+        // Read the rest of the request
+        http::async_read(stream_, buffer_, *parser_, beast::bind_front_handler(&session::on_read, shared_from_this()));
+    }
+
+    void on_read(beast::error_code ec, std::size_t bytes_transferred) {
+        boost::ignore_unused(bytes_transferred);
+
+        if (ec)
+            return fail(ec, "read");
+
+        // Queue the response, then read the next request meanwhile
+        auto const keep_alive = parser_->get().keep_alive();
+        handle_request(*doc_root_, parser_->release(), send_lambda{*this, reserve()}, m_db, m_kdf, m_assets);
+        read_next(keep_alive);
+    }
+
+    // Takes the next slot of the response queue, for the request just read.
+    std::size_t reserve() { return (head_ + count_++) % m_limits.pipeline; }
+
+    template <class Message> void respond(Message&& msg) { send_lambda{*this, reserve()}(std::move(msg)); }
+
+    // Reads the next request unless the last one closes the connection. A full
+    // queue stops reading until a response is written.
+    void read_next(bool keep_alive) {
+        if (!keep_alive)
+            read_done_ = true;
+        else if (count_ == m_limits.pipeline)
+            read_paused_ = true;
+        else
+            do_read();
+    }
+
+    void start_upload() {
+        if (auto refusal = open_vault_upload(*header_parser_, m_db, m_limits, upload_)) {
+            respond(std::move(*refusal));
+            return read_next(false);
+        }
+
+        auto const expects_continue = beast::iequals(header_parser_->get()[http::field::expect], "100-continue");
+        auto const version = header_parser_->get().version();
+        upload_parser_.emplace(std::move(*header_parser_));
+        upload_parser_->body_limit(m_limits.vault_body);
+        if (!chunk_)
+            chunk_ = std::make_unique<char[]>(UPLOAD_CHUNK_SIZE);
+
+        if (!expects_continue)
+            return do_read_chunk();
+
+        // The upload was accepted: let the client send its body. The queue
+        // is empty, so nothing else is being written
+        auto& res = interim_.emplace(http::response<http::empty_body, swp::PooledFields>{http::status::continue_, version});
+        http::async_write(stream_, res, [self = shared_from_this()](beast::error_code ec, std::size_t) {
+            self->interim_.reset();
+            if (ec)
+                return fail(ec, "write");
+            self->do_read_chunk();
+        });
+    }
+
+    void do_read_chunk() {
+        if (upload_parser_->is_done())
+            return finish_upload();
+
+        auto& body = upload_parser_->get().body();
+        body.data = chunk_.get();
+        body.size = UPLOAD_CHUNK_SIZE;
+
+        beast::get_lowest_layer(stream_).expires_after(std::chrono::seconds(30));
+        http::async_read_some(stream_, buffer_, *upload_parser_, beast::bind_front_handler(&session::on_read_chunk, shared_from_this()));
+    }
+
+    void on_read_chunk(beast::error_code ec, std::size_t bytes_transferred) {
+        boost::ignore_unused(bytes_transferred);
+
+        // The chunk buffer is full, which is what we asked for
+        if (ec == http::error::need_buffer)
+            ec = {};
+
+        if (ec) {
+            upload_.reset();
+            return fail(ec, "read");
+        }
+
+        auto const received = UPLOAD_CHUNK_SIZE - upload_parser_->get().body().size;
+        if (received > 0 && upload_->write(chunk_.get(), received) != SQLITE_OK) {
+            upload_.reset();
+            respond(make_error(http::status::internal_server_error, upload_parser_->get().version(), false, "An error occurred: 'Cannot store vault data.'"));
+            return read_next(false);
+        }
+        do_read_chunk();
     }
 
-    void on_write(bool close, beast::error_code ec, std::size_t bytes_transferred) {
+    void finish_upload() {
+        auto res = close_vault_upload(upload_parser_->get(), *upload_);
+        auto const keep_alive = res.keep_alive();
+        upload_.reset();
+        respond(std::move(res));
+        read_next(keep_alive);
+    }
+
+    // Writes the oldest response once it is ready; one write at a time.
+    void do_write() {
+        if (writing_ || count_ == 0 || !pending_[head_].write)
+            return;
+        writing_ = true;
+
+        // Set the timeout.
+        beast::get_lowest_layer(stream_).expires_after(std::chrono::seconds(30));
+
+        pending_[head_].write(*this, pending_[head_]);
+    }
+
+    void on_write(beast::error_code ec, std::size_t bytes_transferred) {
         boost::ignore_unused(bytes_transferred);
 
+        // We're done with the response so destroy it
+        auto& pending = pending_[head_];
+        auto const close = pending.close;
+        pending.message.reset();
+        pending.write = nullptr;
+        head_ = (head_ + 1) % m_limits.pipeline;
+        --count_;
+        writing_ = false;
+
         if (ec)
             return fail(ec, "write");
 
@@ -166,11 +1107,22 @@ class session : public std::enable_shared_from_this<session> {
             return do_close();
         }
 
-        // We're done with the response so delete it
-        res_ = nullptr;
+        if (count_ == 0) {
+            if (upload_waiting_) {
+                upload_waiting_ = false;
+                return start_upload();
+            }
+            if (read_done_)
+                return do_close();
+        }
 
-        // Read another request
-        do_read();
+        // Read another request, if the queue was full
+        if (read_paused_) {
+            read_paused_ = false;
+            do_read();
+        }
+
+        do_write();
     }
 
     void do_close() {
@@ -191,6 +1143,12 @@ class session : public std::enable_shared_from_this<session> {
 
 //------------------------------------------------------------------------------
 
+#ifdef SO_REUSEPORT
+// Lets several sockets listen on the same port, the kernel spreading the
+// incoming connections among them.
+using reuse_port = net::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+#endif
+
 // Accepts incoming connections and launches the sessions
 class listener : public std::enable_shared_from_this<listener> {
     net::io_context& ioc_;
@@ -198,10 +1156,15 @@ class listener : public std::enable_shared_from_this<listener> {
     tcp::acceptor acceptor_;
     std::shared_ptr<std::string const> doc_root_;
     std::reference_wrapper<swp::ServerDB> db;
+    std::reference_wrapper<swp::KdfExecutor> kdf;
+    std::reference_wrapper<swp::StaticCache> assets;
+    swp::RequestLimits limits;
 
   public:
-    listener(net::io_context& ioc, ssl::context& ctx, const tcp::endpoint& endpoint, std::shared_ptr<std::string const> doc_root, swp::ServerDB& db)
-        : ioc_(ioc), ctx_(ctx), acceptor_(ioc), doc_root_(std::move(doc_root)), db(db) {
+    // With share_port, other listeners of the process may bind the same endpoint.
+    listener(net::io_context& ioc, ssl::context& ctx, const tcp::endpoint& endpoint, std::shared_ptr<std::string const> doc_root, swp::ServerDB& db,
+             swp::KdfExecutor& kdf, swp::StaticCache& assets, const swp::RequestLimits& limits, bool share_port = false)
+        : ioc_(ioc), ctx_(ctx), acceptor_(ioc), doc_root_(std::move(doc_root)), db(db), kdf(kdf), assets(assets), limits(limits) {
         beast::error_code ec;
 
         // Open the acceptor
@@ -218,6 +1181,19 @@ class listener : public std::enable_shared_from_this<listener> {
             return;
         }
 
+        // Each listener of the port gets its share of the connections
+        if (share_port) {
+#ifdef SO_REUSEPORT
+            acceptor_.set_option(reuse_port(true), ec);
+#else
+            ec = net::error::operation_not_supported;
+#endif
+            if (ec) {
+                fail(ec, "set_option");
+                return;
+            }
+        }
+
         // Bind to the server address
         acceptor_.bind(endpoint, ec);
         if (ec) {
@@ -247,7 +1223,7 @@ class listener : public std::enable_shared_from_this<listener> {
             fail(ec, "accept");
         } else {
             // Create the session and run it
-            std::make_shared<session>(std::move(socket), ctx_, doc_root_, db)->run();
+            std::make_shared<session>(std::move(socket), ctx_, doc_root_, db, kdf, assets, limits)->run();
         }
 
         // Accept another connection
@@ -0,0 +1,138 @@
+#ifndef SECUREWEBPASS_KDF_EXECUTOR_HPP
+#define SECUREWEBPASS_KDF_EXECUTOR_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <boost/asio/post.hpp>
+
+namespace swp {
+
+struct KdfStats {
+    std::size_t queued;      // jobs waiting for a worker
+    std::size_t running;     // jobs currently hashing
+    std::uint64_t completed; // jobs finished since startup
+    std::uint64_t rejected;  // jobs refused because the queue was full
+    std::chrono::nanoseconds total_wait;
+    std::chrono::nanoseconds max_wait;
+    std::chrono::nanoseconds total_run;
+
+    // Over the jobs which left the queue, and over those which finished
+    [[nodiscard]] std::chrono::nanoseconds average_wait() const {
+        const auto started = completed + running;
+        return started == 0 ? std::chrono::nanoseconds{} : total_wait / static_cast<std::chrono::nanoseconds::rep>(started);
+    }
+
+    [[nodiscard]] std::chrono::nanoseconds average_run() const {
+        return completed == 0 ? std::chrono::nanoseconds{} : total_run / static_cast<std::chrono::nanoseconds::rep>(completed);
+    }
+};
+
+// Runs password hashing off the I/O threads. Argon2 is slow by design and
+// commits its whole memory cost per hash, so the number of workers is capped
+// by a memory budget and the backlog by a queue limit: callers are told to
+// back off instead of piling up 64 MiB allocations.
+class KdfExecutor {
+    using clock = std::chrono::steady_clock;
+
+    struct Job {
+        std::function<void()> run;
+        clock::time_point enqueued;
+    };
+
+    std::size_t queue_limit;
+    std::deque<Job> jobs;
+    std::vector<std::thread> workers;
+    mutable std::mutex mutex;
+    std::condition_variable ready;
+    bool stopping = false;
+
+    std::size_t running = 0;
+    std::uint64_t completed = 0;
+    std::uint64_t rejected = 0;
+    clock::duration total_wait{};
+    clock::duration max_wait{};
+    clock::duration total_run{};
+
+    void work() {
+        std::unique_lock lock{mutex};
+        while (true) {
+            ready.wait(lock, [this] { return stopping || !jobs.empty(); });
+            if (jobs.empty())
+                return;
+            auto job = std::move(jobs.front());
+            jobs.pop_front();
+            const auto started = clock::now();
+            const auto waited = started - job.enqueued;
+            total_wait += waited;
+            max_wait = std::max(max_wait, waited);
+            ++running;
+
+            lock.unlock();
+            job.run();
+            lock.lock();
+
+            --running;
+            ++completed;
+            total_run += clock::now() - started;
+        }
+    }
+
+  public:
+    // At most min(workers, memory_budget / job_memory) hashes run at the same
+    // time, and at most queue_limit more wait for a worker.
+    KdfExecutor(std::size_t workers, std::size_t memory_budget, std::size_t job_memory, std::size_t queue_limit) : queue_limit(queue_limit) {
+        const auto count = std::max<std::size_t>(1, std::min(workers, memory_budget / job_memory));
+        this->workers.reserve(count);
+        for (std::size_t i = 0; i < count; ++i)
+            this->workers.emplace_back([this] { work(); });
+    }
+
+    KdfExecutor(const KdfExecutor&) = delete;
+
+    KdfExecutor& operator=(const KdfExecutor&) = delete;
+
+    // Drains the queue before joining the workers.
+    ~KdfExecutor() {
+        {
+            std::lock_guard lock{mutex};
+            stopping = true;
+        }
+        ready.notify_all();
+        for (auto& worker : workers)
+            worker.join();
+    }
+
+    // Runs work() on a worker and posts handler(result) to ex, typically the
+    // strand of the session that asked for it. Returns false without queuing
+    // anything when the backlog is full.
+    template <class Executor, class Work, class Handler> bool submit(const Executor& ex, Work&& work, Handler&& handler) {
+        {
+            std::lock_guard lock{mutex};
+            if (jobs.size() >= queue_limit) {
+                ++rejected;
+                return false;
+            }
+            jobs.push_back({[ex, work = std::forward<Work>(work), handler = std::forward<Handler>(handler)]() mutable {
+                                boost::asio::post(ex, [handler = std::move(handler), result = work()]() mutable { handler(std::move(result)); });
+                            },
+                            clock::now()});
+        }
+        ready.notify_one();
+        return true;
+    }
+
+    [[nodiscard]] KdfStats stats() const {
+        std::lock_guard lock{mutex};
+        return {jobs.size(), running, completed, rejected, total_wait, max_wait, total_run};
+    }
+};
+} // namespace swp
+
+#endif // SECUREWEBPASS_KDF_EXECUTOR_HPP
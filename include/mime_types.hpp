@@ -0,0 +1,140 @@
+#ifndef SECUREWEBPASS_MIME_TYPES_HPP
+#define SECUREWEBPASS_MIME_TYPES_HPP
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+
+namespace swp {
+
+// The extension, lowercased, is packed into a 64-bit key, and the built-in
+// types sit in a table indexed by a multiplicative hash whose multiplier is
+// searched at compile time so no two built-in extensions collide.
+namespace mime_detail {
+constexpr std::array<std::pair<std::string_view, std::string_view>, 21> BUILTIN = {{
+    {"htm", "text/html"},
+    {"html", "text/html"},
+    {"php", "text/html"},
+    {"css", "text/css"},
+    {"txt", "text/plain"},
+    {"js", "application/javascript"},
+    {"json", "application/json"},
+    {"xml", "application/xml"},
+    {"swf", "application/x-shockwave-flash"},
+    {"flv", "video/x-flv"},
+    {"png", "image/png"},
+    {"jpe", "image/jpeg"},
+    {"jpeg", "image/jpeg"},
+    {"jpg", "image/jpeg"},
+    {"gif", "image/gif"},
+    {"bmp", "image/bmp"},
+    {"ico", "image/vnd.microsoft.icon"},
+    {"tiff", "image/tiff"},
+    {"tif", "image/tiff"},
+    {"svg", "image/svg+xml"},
+    {"svgz", "image/svg+xml"},
+}};
+
+constexpr std::size_t BITS = 6;
+
+struct Slot {
+    std::uint64_t key = 0;
+    std::string_view type;
+};
+
+// Lowercased extension bytes, 0 when there is no room or no extension.
+constexpr std::uint64_t pack(std::string_view ext) noexcept {
+    if (ext.empty() || ext.size() > sizeof(std::uint64_t))
+        return 0;
+    std::uint64_t key = 0;
+    for (std::size_t i = 0; i < ext.size(); ++i) {
+        auto c = static_cast<unsigned char>(ext[i]);
+        if (c >= 'A' && c <= 'Z')
+            c |= 0x20;
+        key |= std::uint64_t{c} << (8 * i);
+    }
+    return key;
+}
+
+constexpr std::size_t hash(std::uint64_t key, std::uint64_t multiplier) noexcept { return (key * multiplier) >> (64 - BITS); }
+
+constexpr bool perfect(std::uint64_t multiplier) {
+    std::array<bool, std::size_t{1} << BITS> used{};
+    for (const auto& [ext, type] : BUILTIN) {
+        auto const h = hash(pack(ext), multiplier);
+        if (used[h])
+            return false;
+        used[h] = true;
+    }
+    return true;
+}
+
+constexpr std::uint64_t find_multiplier() {
+    std::uint64_t candidate = 0x9e3779b97f4a7c15;
+    for (int i = 0; i < 100000; ++i, candidate = candidate * 6364136223846793005u + 1442695040888963407u)
+        if (perfect(candidate | 1))
+            return candidate | 1;
+    return 0;
+}
+
+constexpr std::uint64_t MULTIPLIER = find_multiplier();
+static_assert(MULTIPLIER != 0, "no perfect hash for the built-in extensions, raise BITS");
+
+constexpr std::array<Slot, std::size_t{1} << BITS> make_table() {
+    std::array<Slot, std::size_t{1} << BITS> table{};
+    for (const auto& [ext, type] : BUILTIN)
+        table[hash(pack(ext), MULTIPLIER)] = {pack(ext), type};
+    return table;
+}
+
+constexpr auto TABLE = make_table();
+} // namespace mime_detail
+
+// Maps file extensions to content types in constant time, see mime_detail.
+// Deployments can register further types, checked before the built-in ones.
+class MimeTypes {
+    std::unordered_map<std::uint64_t, std::string> registered;
+
+  public:
+    static constexpr std::string_view DEFAULT = "application/text";
+
+    // Registers or overrides the type of an extension, given with or without
+    // its dot. Not synchronized: register types at startup, before serving.
+    // Extensions longer than 8 characters can't be registered.
+    bool add(std::string_view ext, std::string type) {
+        if (!ext.empty() && ext.front() == '.')
+            ext.remove_prefix(1);
+        auto const key = mime_detail::pack(ext);
+        if (key == 0)
+            return false;
+        registered.insert_or_assign(key, std::move(type));
+        return true;
+    }
+
+    // The content type of path, from its extension.
+    [[nodiscard]] std::string_view lookup(std::string_view path) const noexcept {
+        auto const pos = path.rfind('.');
+        if (pos == std::string_view::npos)
+            return DEFAULT;
+        auto const key = mime_detail::pack(path.substr(pos + 1));
+        if (key == 0)
+            return DEFAULT;
+        if (!registered.empty())
+            if (auto const it = registered.find(key); it != registered.end())
+                return it->second;
+        auto const& slot = mime_detail::TABLE[mime_detail::hash(key, mime_detail::MULTIPLIER)];
+        return slot.key == key ? slot.type : DEFAULT;
+    }
+};
+
+// The types the server answers with; extend it from main() before serving.
+inline MimeTypes& mime_types() {
+    static MimeTypes types;
+    return types;
+}
+} // namespace swp
+
+#endif // SECUREWEBPASS_MIME_TYPES_HPP
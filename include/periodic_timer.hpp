@@ -0,0 +1,38 @@
+#ifndef SECUREWEBPASS_PERIODIC_TIMER_HPP
+#define SECUREWEBPASS_PERIODIC_TIMER_HPP
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+namespace swp {
+
+// Runs a task on the io_context every `interval`, for as long as the
+// io_context runs. Like the listener, it keeps itself alive through the
+// pending wait.
+class PeriodicTimer : public std::enable_shared_from_this<PeriodicTimer> {
+    boost::asio::steady_timer timer;
+    std::chrono::steady_clock::duration interval;
+    std::function<void()> task;
+
+    void schedule() {
+        timer.expires_after(interval);
+        timer.async_wait([self = shared_from_this()](boost::system::error_code ec) {
+            if (ec)
+                return;
+            self->task();
+            self->schedule();
+        });
+    }
+
+  public:
+    PeriodicTimer(boost::asio::io_context& ioc, std::chrono::steady_clock::duration interval, std::function<void()> task)
+        : timer(ioc), interval(interval), task(std::move(task)) {}
+
+    void run() { schedule(); }
+};
+} // namespace swp
+
+#endif // SECUREWEBPASS_PERIODIC_TIMER_HPP
@@ -0,0 +1,46 @@
+#ifndef SECUREWEBPASS_REQUEST_ARENA_HPP
+#define SECUREWEBPASS_REQUEST_ARENA_HPP
+
+#include <cstddef>
+#include <memory_resource>
+#include <string>
+#include <boost/beast/http/fields.hpp>
+#include <boost/beast/http/string_body.hpp>
+
+namespace swp {
+
+using ArenaAllocator = std::pmr::polymorphic_allocator<char>;
+using ArenaString = std::basic_string<char, std::char_traits<char>, ArenaAllocator>;
+using ArenaFields = boost::beast::http::basic_fields<ArenaAllocator>;
+using ArenaStringBody = boost::beast::http::basic_string_body<char, std::char_traits<char>, ArenaAllocator>;
+
+// Monotonic storage for one request at a time: its fields, its body and the
+// handler's scratch strings. Allocating bumps a pointer and freeing is a
+// no-op; reset() frees everything at once, before the next request is read.
+// The first INITIAL bytes live in the arena itself, so a request fitting in
+// them never reaches the heap; beyond that, blocks are borrowed from the heap
+// until the next reset.
+class RequestArena {
+  public:
+    // A header at its 8 KiB limit, a 16 KiB API body, and room for the rest
+    static constexpr std::size_t INITIAL = 32 * 1024;
+
+  private:
+    alignas(std::max_align_t) std::byte initial[INITIAL];
+    std::pmr::monotonic_buffer_resource resource{initial, INITIAL};
+
+  public:
+    RequestArena() = default;
+
+    RequestArena(const RequestArena&) = delete;
+
+    RequestArena& operator=(const RequestArena&) = delete;
+
+    [[nodiscard]] ArenaAllocator allocator() noexcept { return &resource; }
+
+    // Everything allocated from the arena must be destroyed first.
+    void reset() noexcept { resource.release(); }
+};
+} // namespace swp
+
+#endif // SECUREWEBPASS_REQUEST_ARENA_HPP
@@ -5,13 +5,24 @@
 #ifndef SECUREWEBPASS_REQUEST_HANDLER_HPP
 #define SECUREWEBPASS_REQUEST_HANDLER_HPP
 
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <memory>
+#include <optional>
 #include <argon2.h>
 #include <boost/beast/core.hpp>
 #include <boost/beast/http.hpp>
 #include <boost/beast/version.hpp>
 #include <boost/config.hpp>
+#include "kdf_executor.hpp"
+#include "mime_types.hpp"
+#include "request_arena.hpp"
+#include "response_pool.hpp"
+#include "router.hpp"
 #include "server_db.hpp"
 #include "session_id.hpp"
+#include "static_cache.hpp"
 
 namespace beast = boost::beast; // from <boost/beast.hpp>
 namespace http = beast::http;   // from <boost/beast/http.hpp>
@@ -20,12 +31,12 @@ std::string_view bsv2sv(boost::string_view bsv) { return std::string_view(bsv.da
 
 boost::string_view sv2bsv(std::string_view sv) { return boost::string_view(sv.data(), sv.size()); }
 
-// Append an HTTP rel-path to a local filesystem path.
+// Append an HTTP rel-path to a local filesystem path, into result.
 // The returned path is normalized for the platform.
-std::string path_cat(beast::string_view base, beast::string_view path) {
+template <class String> String& path_cat(String& result, beast::string_view base, beast::string_view path) {
     if (base.empty())
-        return std::string(path);
-    std::string result(base);
+        return result.assign(path.data(), path.size());
+    result.assign(base.data(), base.size());
 #ifdef BOOST_MSVC
     char constexpr path_separator = '\\';
     if (result.back() == path_separator)
@@ -44,324 +55,914 @@ std::string path_cat(beast::string_view base, beast::string_view path) {
 }
 
 // Return a reasonable mime type based on the extension of a file.
-beast::string_view mime_type(beast::string_view path) {
-    using beast::iequals;
-    auto const ext = [&path] {
-        auto const pos = path.rfind(".");
-        if (pos == beast::string_view::npos)
-            return beast::string_view{};
-        return path.substr(pos);
-    }();
-    if (iequals(ext, ".htm"))
-        return "text/html";
-    if (iequals(ext, ".html"))
-        return "text/html";
-    if (iequals(ext, ".php"))
-        return "text/html";
-    if (iequals(ext, ".css"))
-        return "text/css";
-    if (iequals(ext, ".txt"))
-        return "text/plain";
-    if (iequals(ext, ".js"))
-        return "application/javascript";
-    if (iequals(ext, ".json"))
-        return "application/json";
-    if (iequals(ext, ".xml"))
-        return "application/xml";
-    if (iequals(ext, ".swf"))
-        return "application/x-shockwave-flash";
-    if (iequals(ext, ".flv"))
-        return "video/x-flv";
-    if (iequals(ext, ".png"))
-        return "image/png";
-    if (iequals(ext, ".jpe"))
-        return "image/jpeg";
-    if (iequals(ext, ".jpeg"))
-        return "image/jpeg";
-    if (iequals(ext, ".jpg"))
-        return "image/jpeg";
-    if (iequals(ext, ".gif"))
-        return "image/gif";
-    if (iequals(ext, ".bmp"))
-        return "image/bmp";
-    if (iequals(ext, ".ico"))
-        return "image/vnd.microsoft.icon";
-    if (iequals(ext, ".tiff"))
-        return "image/tiff";
-    if (iequals(ext, ".tif"))
-        return "image/tiff";
-    if (iequals(ext, ".svg"))
-        return "image/svg+xml";
-    if (iequals(ext, ".svgz"))
-        return "image/svg+xml";
-    return "application/text";
+beast::string_view mime_type(beast::string_view path) { return sv2bsv(swp::mime_types().lookup(bsv2sv(path))); }
+
+// The raw value of the first `key` parameter of the target's query; empty when absent.
+inline std::string_view query_param(std::string_view target, std::string_view key) {
+    auto const start = target.find('?');
+    if (start == std::string_view::npos)
+        return {};
+    for (auto query = target.substr(start + 1); !query.empty();) {
+        auto const end = std::min(query.find('&'), query.size());
+        auto const param = query.substr(0, end);
+        if (param.size() > key.size() && param.substr(0, key.size()) == key && param[key.size()] == '=')
+            return param.substr(key.size() + 1);
+        query.remove_prefix(std::min(end + 1, query.size()));
+    }
+    return {};
 }
 
-// This function produces an HTTP response for the given
-// request. The type of the response object depends on the
-// contents of the request, so the interface requires the
-// caller to pass a generic lambda for receiving the response.
-template <class Body, class Allocator, class Send>
-void handle_request(beast::string_view doc_root, http::request<Body, http::basic_fields<Allocator>>&& req, Send&& send, swp::ServerDB& db) {
-    auto const response_builder = [&req](http::status status) {
-        http::response<http::string_body> res{status, req.version()};
-        res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
-        res.set(http::field::content_type, "text/html");
-        res.keep_alive(req.keep_alive());
-        return std::move(res);
+// Decodes a query value into result, '+' standing for a space. False on a malformed escape.
+template <class String> bool percent_decode(String& result, std::string_view value) {
+    constexpr auto hex = [](char c) {
+        return c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
     };
+    result.clear();
+    for (std::size_t i = 0; i < value.size(); ++i) {
+        if (value[i] == '+') {
+            result.push_back(' ');
+        } else if (value[i] != '%') {
+            result.push_back(value[i]);
+        } else {
+            if (i + 2 >= value.size())
+                return false;
+            auto const high = hex(value[i + 1]), low = hex(value[i + 2]);
+            if (high < 0 || low < 0)
+                return false;
+            result.push_back(static_cast<char>(high << 4 | low));
+            i += 2;
+        }
+    }
+    return true;
+}
 
-    auto const error_builder = [&response_builder](http::status status, boost::string_view body) {
-        auto res = response_builder(status);
-        res.body() = std::string(body);
-        res.prepare_payload();
-        return std::move(res);
+// Escapes value for a query, every byte but the unreserved ones percent-encoded.
+template <class String> String& percent_encode(String& result, std::string_view value) {
+    constexpr char digits[] = "0123456789ABCDEF";
+    for (auto c : value) {
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '.' || c == '_' || c == '~') {
+            result.push_back(c);
+        } else {
+            result.push_back('%');
+            result.push_back(digits[static_cast<unsigned char>(c) >> 4]);
+            result.push_back(digits[static_cast<unsigned char>(c) & 15]);
+        }
+    }
+    return result;
+}
+
+// Reads a decimal number from the front of s.
+inline bool consume_number(std::string_view& s, std::uint64_t& value) {
+    auto const [end, ec] = std::from_chars(s.data(), s.data() + s.size(), value);
+    if (ec != std::errc())
+        return false;
+    s.remove_prefix(end - s.data());
+    return true;
+}
+
+// Parses a Range field of a single byte range: bytes=first-last, bytes=first-
+// or bytes=-suffix. False for anything else, which is then served whole.
+inline bool parse_range(std::string_view field, swp::VaultRange& range) {
+    constexpr std::string_view unit = "bytes=";
+    if (field.substr(0, unit.size()) != unit)
+        return false;
+    field.remove_prefix(unit.size());
+    range = swp::VaultRange{};
+    if (!field.empty() && field.front() == '-') {
+        field.remove_prefix(1);
+        return consume_number(field, range.suffix) && field.empty() && range.suffix > 0;
+    }
+    if (!consume_number(field, range.first) || field.empty() || field.front() != '-')
+        return false;
+    field.remove_prefix(1);
+    if (field.empty())
+        return true;
+    return consume_number(field, range.last) && field.empty() && range.last >= range.first;
+}
+
+// Parses the Content-Range of a ranged write: bytes first-last/size, or
+// bytes first-last/* to leave the size to the write.
+inline bool parse_content_range(std::string_view field, std::uint64_t& first, std::uint64_t& last, std::optional<std::uint64_t>& size) {
+    constexpr std::string_view unit = "bytes ";
+    if (field.substr(0, unit.size()) != unit)
+        return false;
+    field.remove_prefix(unit.size());
+    if (!consume_number(field, first) || field.empty() || field.front() != '-')
+        return false;
+    field.remove_prefix(1);
+    if (!consume_number(field, last) || last < first || field.empty() || field.front() != '/')
+        return false;
+    field.remove_prefix(1);
+    if (field == "*") {
+        size.reset();
+        return true;
+    }
+    std::uint64_t value;
+    if (!consume_number(field, value) || !field.empty() || value <= last)
+        return false;
+    size = value;
+    return true;
+}
+
+// Builds an empty response with the headers shared by every API reply.
+swp::ApiResponse make_response(http::status status, unsigned version, bool keep_alive) {
+    swp::ApiResponse res{status, version};
+    res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+    res.set(http::field::content_type, "text/html");
+    res.keep_alive(keep_alive);
+    return std::move(res);
+}
+
+// The body is the concatenation of parts, each convertible to a string_view,
+// written straight into the response.
+template <class... Parts> swp::ApiResponse make_error(http::status status, unsigned version, bool keep_alive, const Parts&... parts) {
+    auto res = make_response(status, version, keep_alive);
+    auto& body = res.body();
+    body.reserve((beast::string_view(parts).size() + ...));
+    (body.append(beast::string_view(parts).data(), beast::string_view(parts).size()), ...);
+    res.prepare_payload();
+    return std::move(res);
+}
+
+namespace swp {
+
+// Size limits applied to a request from its header, before any body byte is
+// read, and the number of requests a connection may pipeline.
+struct RequestLimits {
+    std::uint32_t header = 8 * 1024;
+    std::uint64_t api_body = 16 * 1024;                 // API calls carry their arguments in headers
+    std::uint64_t static_body = 0;                      // file requests have no use for a body
+    std::uint64_t vault_body = std::uint64_t{64} << 20; // streamed uploads, see is_vault_upload
+    std::uint64_t vault_range = 1 << 20;                // ranged vault writes, applied in one transaction
+    std::uint64_t vault_batch = 16 << 20;               // vault batches, applied in one transaction
+    std::size_t pipeline = 8;                           // requests read before their responses are written
+};
+
+// The most vault names a listing returns at once, and its default page size.
+constexpr std::size_t VAULT_PAGE_SIZE = 1000;
+
+// The most operations a vault batch holds, and the most vault bytes its response
+// carries: a read which would go past them is answered 413 alone.
+constexpr std::size_t VAULT_BATCH_SIZE = 1000;
+constexpr std::size_t VAULT_BATCH_BYTES = std::size_t{16} << 20;
+} // namespace swp
+
+template <class Fields> bool is_authenticated(const http::request_header<Fields>& req, swp::ServerDB& db, std::string_view username) {
+    if (username.empty())
+        return false;
+    auto sessionId = bsv2sv(req["Session-Id"]);
+    auto token = bsv2sv(req["X-Auth-Token"]);
+    return db.isSessionIdValid(username, sessionId) || db.isTokenValid(username, token);
+}
+
+// The vault named by a PATCH /api/vault/<name> target.
+template <class Fields> beast::string_view vault_target_name(const http::request_header<Fields>& req) {
+    constexpr beast::string_view prefix = "/api/vault/";
+    return req.target().substr(prefix.size());
+}
+
+// Vault creations (POST /api/vault) and replacements (PATCH /api/vault/<name>)
+// are streamed into the database as their body arrives instead of being buffered.
+// A PATCH with a Content-Range writes a part of the vault instead: it is buffered.
+template <class Fields> bool is_vault_upload(const http::request_header<Fields>& req) {
+    constexpr beast::string_view prefix = "/api/vault";
+    auto target = req.target();
+    if (!target.starts_with(prefix) || target.find("..") != beast::string_view::npos)
+        return false;
+    target.remove_prefix(prefix.size());
+    switch (req.method()) {
+    case http::verb::post:
+        return target.empty() || target == "/";
+    case http::verb::patch:
+        return target.size() > 1 && target.front() == '/' && req.find(http::field::content_range) == req.end();
+    default:
+        return false;
+    }
+}
+
+// API routes which only answer authenticated users. Those are refused from
+// their header so a stranger can't make us read a body.
+template <class Fields> bool requires_authentication(const http::request_header<Fields>& req) {
+    auto const target = req.target();
+    return target.starts_with("/api/vault") || target.starts_with("/api/sync") || target.starts_with("/api/batch") || target.starts_with("/api/user");
+}
+
+// The body limit of a request read whole, set by its route.
+template <class Fields> std::uint64_t body_limit(const http::request_header<Fields>& req, const swp::RequestLimits& limits) {
+    if (req.method() == http::verb::patch && req.target().starts_with("/api/vault/") && req.find(http::field::content_range) != req.end())
+        return limits.vault_range;
+    if (req.method() == http::verb::post && req.target().starts_with("/api/batch"))
+        return limits.vault_batch;
+    return req.target().starts_with("/api") ? limits.api_body : limits.static_body;
+}
+
+// Screens a request which is read whole from its header: authenticates it when
+// its route requires so, and checks its announced length against the route's
+// body limit. Returns the response to send instead when the request is refused.
+template <class Body, class Fields>
+std::optional<swp::ApiResponse> screen_request(const http::request<Body, Fields>& req, std::optional<std::uint64_t> content_length, bool body_read,
+                                               swp::ServerDB& db, const swp::RequestLimits& limits) {
+    // An unread body leaves the connection in an unknown state: close it
+    auto const error = [&req, body_read](http::status status, const auto&... parts) {
+        return make_error(status, req.version(), req.keep_alive() && body_read, parts...);
     };
+    if (requires_authentication(req) && !is_authenticated(req, db, bsv2sv(req["Username"])))
+        return error(http::status::unauthorized, "The resource '", req.target(), "' requires authorization.");
+    auto const limit = body_limit(req, limits);
+    if (content_length && *content_length > limit)
+        return error(http::status::payload_too_large, "The request body exceeds ", std::to_string(limit), " bytes.");
+    return std::nullopt;
+}
+
+// The same, for a request about to be read by parser, whose body limit it sets.
+template <class Body, class Allocator>
+std::optional<swp::ApiResponse> screen_request(http::request_parser<Body, Allocator>& parser, swp::ServerDB& db, const swp::RequestLimits& limits) {
+    auto const length = parser.content_length();
+    auto refusal = screen_request(parser.get(), length ? std::optional(*length) : std::nullopt, parser.is_done(), db, limits);
+    if (!refusal)
+        parser.body_limit(body_limit(parser.get(), limits));
+    return refusal;
+}
+
+// Whether the entity-tag list of an If-Match or If-None-Match field holds the
+// tag of the vault with this hash; "*" holds any tag. The weak comparison of
+// If-None-Match takes W/"x" for "x", the strong one of If-Match never does.
+inline bool etag_listed(std::string_view field, std::string_view hash, bool weak) {
+    while (!field.empty()) {
+        auto const end = std::min(field.find(','), field.size());
+        auto tag = field.substr(0, end);
+        field.remove_prefix(std::min(end + 1, field.size()));
+        while (!tag.empty() && (tag.front() == ' ' || tag.front() == '\t'))
+            tag.remove_prefix(1);
+        while (!tag.empty() && (tag.back() == ' ' || tag.back() == '\t'))
+            tag.remove_suffix(1);
+        if (tag == "*")
+            return true;
+        if (tag.substr(0, 2) == "W/") {
+            if (!weak)
+                continue;
+            tag.remove_prefix(2);
+        }
+        if (tag.size() == hash.size() + 2 && tag.front() == '"' && tag.back() == '"' && tag.substr(1, hash.size()) == hash)
+            return true;
+    }
+    return false;
+}
+
+// The ETag and Vault-Version of a vault response; no ETag while the hash is unknown.
+template <class Message> void set_vault_tag(Message& res, const swp::VaultTag& tag) {
+    res.set("Vault-Version", std::to_string(tag.version));
+    if (tag.hash.empty())
+        return;
+    char etag[swp::ContentHash::HEX_SIZE + 2];
+    auto const size = std::min(tag.hash.size(), swp::ContentHash::HEX_SIZE);
+    etag[0] = '"';
+    tag.hash.copy(etag + 1, size);
+    etag[size + 1] = '"';
+    res.set(http::field::etag, beast::string_view(etag, size + 2));
+}
+
+// Resolves the If-Match of a vault replacement into the hash the vault must still
+// have when the new content takes its place, left empty for an unconditional one.
+// Returns the status to refuse the request with when the precondition already fails.
+template <class Fields>
+std::optional<http::status> resolve_if_match(const http::request_header<Fields>& req, swp::ServerDB& db, std::string_view username,
+                                             std::string_view vault_name, std::string& expected) {
+    auto const field = bsv2sv(req[http::field::if_match]);
+    if (field.empty())
+        return std::nullopt;
+    auto [tag, rc] = db.getVaultTag(username, vault_name);
+    if (rc == SQLITE_DONE)
+        return http::status::precondition_failed;
+    if (rc != SQLITE_OK)
+        return http::status::internal_server_error;
+    if (field == "*")
+        return std::nullopt;
+    if (tag.hash.empty() || !etag_listed(field, tag.hash, false))
+        return http::status::precondition_failed;
+    expected = std::move(tag.hash);
+    return std::nullopt;
+}
+
+// Checks an upload from its header alone and reserves its space. Returns the
+// response to send instead when the upload is refused; since its body is left
+// unread, that response closes the connection.
+template <class Fields>
+std::optional<swp::ApiResponse> open_vault_upload(const http::request_header<Fields>& req, std::optional<std::uint64_t> length, swp::ServerDB& db,
+                                                  const swp::RequestLimits& limits, std::unique_ptr<swp::ServerDB::VaultUpload>& upload) {
+    auto const error = [&req](http::status status, const auto&... parts) { return make_error(status, req.version(), false, parts...); };
+    auto username = bsv2sv(req["Username"]);
+    if (!is_authenticated(req, db, username))
+        return error(http::status::unauthorized, "The resource '", req.target(), "' requires authorization.");
+    if (!length)
+        return error(http::status::length_required, "A vault upload requires a Content-Length.");
+    if (*length > limits.vault_body)
+        return error(http::status::payload_too_large, "The vault exceeds ", std::to_string(limits.vault_body), " bytes.");
+
+    auto const mode = req.method() == http::verb::post ? swp::ServerDB::UploadMode::create : swp::ServerDB::UploadMode::replace;
+    auto const vault_name = mode == swp::ServerDB::UploadMode::create ? bsv2sv(req["Vault-Name"]) : bsv2sv(vault_target_name(req));
+    if (vault_name.empty())
+        return error(http::status::bad_request, "Vault name cannot be empty.");
+    // A replacement whose precondition fails is refused before any of its body is sent
+    std::string expected;
+    if (mode == swp::ServerDB::UploadMode::replace) {
+        if (auto const status = resolve_if_match(req, db, username, vault_name, expected); status == http::status::precondition_failed)
+            return error(*status, "The vault '", sv2bsv(vault_name), "' has changed.");
+        else if (status)
+            return error(*status, "An error occurred: 'Cannot read the vault tag.'");
+    }
+    auto [handle, rc] = db.beginVaultUpload(username, vault_name, *length, mode, expected);
+    switch (rc) {
+    case SQLITE_OK:
+        upload = std::move(handle);
+        return std::nullopt;
+    case SQLITE_CONSTRAINT:
+        return error(http::status::bad_request, "The vault '", sv2bsv(vault_name), "' already exists.");
+    case SQLITE_DONE:
+        return error(http::status::bad_request, "The vault '", sv2bsv(vault_name), "' doesn't exist.");
+    case SQLITE_BUSY:
+        return error(http::status::conflict, "The vault '", sv2bsv(vault_name), "' is already being uploaded.");
+    default:
+        return error(http::status::internal_server_error, "An error occurred: 'Cannot store vault data.'");
+    }
+}
+
+template <class Body, class Allocator>
+std::optional<swp::ApiResponse> open_vault_upload(const http::request_parser<Body, Allocator>& parser, swp::ServerDB& db,
+                                                  const swp::RequestLimits& limits, std::unique_ptr<swp::ServerDB::VaultUpload>& upload) {
+    auto const length = parser.content_length();
+    return open_vault_upload(parser.get(), length ? std::optional(*length) : std::nullopt, db, limits, upload);
+}
 
-    auto const ok_response = [&response_builder] {
-        auto res = response_builder(http::status::ok);
+// Publishes a fully received upload and builds its response.
+template <class Body, class Fields>
+swp::ApiResponse close_vault_upload(const http::request<Body, Fields>& req, swp::ServerDB::VaultUpload& upload) {
+    auto const error = [&req](http::status status, const auto&... parts) { return make_error(status, req.version(), req.keep_alive(), parts...); };
+    switch (upload.commit()) {
+    case SQLITE_OK: {
+        auto res = make_response(http::status::ok, req.version(), req.keep_alive());
         res.prepare_payload();
         return std::move(res);
-    };
+    }
+    case SQLITE_CONSTRAINT:
+        return error(http::status::bad_request, "The vault '", req["Vault-Name"], "' already exists.");
+    case SQLITE_DONE:
+        return error(http::status::bad_request, "The vault '", vault_target_name(req), "' doesn't exist.");
+    case SQLITE_MISMATCH:
+        return error(http::status::precondition_failed, "The vault '", vault_target_name(req), "' has changed.");
+    default:
+        return error(http::status::internal_server_error, "An error occurred: 'Cannot store vault data.'");
+    }
+}
 
-    // Returns a bad request response
-    auto const bad_request = [&error_builder](beast::string_view why) { return error_builder(http::status::bad_request, why); };
+// Responses shared by the handlers.
+template <class Request> swp::ApiResponse ok_response(const Request& req) {
+    auto res = make_response(http::status::ok, req.version(), req.keep_alive());
+    res.prepare_payload();
+    return std::move(res);
+}
 
-    auto const method_not_allowed = [&error_builder](beast::string_view target) {
-        return error_builder(http::status::method_not_allowed, "The resource '" + std::string(target) + "' doesn't support the requested method.");
-    };
+// Returns a bad request response
+template <class Request, class... Parts> swp::ApiResponse bad_request(const Request& req, const Parts&... why) {
+    return make_error(http::status::bad_request, req.version(), req.keep_alive(), why...);
+}
 
-    // Returns a not found response
-    auto const not_found = [&error_builder](beast::string_view target) {
-        return error_builder(http::status::not_found, "The resource '" + std::string(target) + "' was not found.");
-    };
+template <class Request> swp::ApiResponse method_not_allowed(const Request& req) {
+    return make_error(http::status::method_not_allowed, req.version(), req.keep_alive(),
+                      "The resource '", req.target(), "' doesn't support the requested method.");
+}
 
-    auto const unauthorized = [&error_builder](boost::string_view target) {
-        return error_builder(http::status::unauthorized, "The resource '" + std::string(target) + "' requires authorization.");
-    };
+// Returns a not found response
+template <class Request> swp::ApiResponse not_found(const Request& req) {
+    return make_error(http::status::not_found, req.version(), req.keep_alive(), "The resource '", req.target(), "' was not found.");
+}
 
-    // Returns a server error response
-    auto const server_error = [&error_builder](beast::string_view what) {
-        return error_builder(http::status::internal_server_error, "An error occurred: '" + std::string(what) + "'");
-    };
+template <class Request> swp::ApiResponse unauthorized(const Request& req) {
+    return make_error(http::status::unauthorized, req.version(), req.keep_alive(),
+                      "The resource '", req.target(), "' requires authorization.");
+}
 
-    auto const isAuthenticated = [&req, &db](std::string_view username) {
-        if (username.empty())
-            return false;
-        auto sessionId = bsv2sv(req["Session-Id"]);
-        auto token = bsv2sv(req["X-Auth-Token"]);
-        return db.isSessionIdValid(username, sessionId) || db.isTokenValid(username, token);
-    };
+// Returns a server error response
+template <class Request> swp::ApiResponse server_error(const Request& req, beast::string_view what) {
+    return make_error(http::status::internal_server_error, req.version(), req.keep_alive(), "An error occurred: '", what, "'");
+}
 
-    auto const login = [&](beast::string_view target) {
-        if (req.method() != http::verb::get)
-            return method_not_allowed(req.target());
-        if (!target.empty())
-            return not_found(req.target());
-        auto username = bsv2sv(req["Username"]);
-        if (isAuthenticated(username))
-            return not_found(req.target());
-        auto password = bsv2sv(req["Password"]);
-        if (username.empty() || password.empty() ||
-            argon2i_verify(db.getPasswordHash(username).data(), password.data(), password.size()) != ARGON2_OK)
-            return unauthorized(req.target());
+// What an API handler gets to answer its request. Handlers answer through
+// send, possibly later: the session stays alive through send.lifetime().
+template <class Request, class Send> struct ApiContext {
+    Request& req;
+    Send& send;
+    swp::ServerDB& db;
+    swp::KdfExecutor& kdf;
+    swp::RouteParams params;
+    std::string_view username; // authenticated, for the routes which require it
+};
+
+template <class Context> struct ApiRoute {
+    void (*handler)(Context&);
+    bool authenticated;
+};
+
+// The page size asked with ?limit=, VAULT_PAGE_SIZE at most and by default. False when malformed.
+inline bool page_limit(std::string_view target, std::size_t& limit) {
+    limit = swp::VAULT_PAGE_SIZE;
+    auto const value = query_param(target, "limit");
+    if (value.empty())
+        return true;
+    auto const [end, ec] = std::from_chars(value.data(), value.data() + value.size(), limit);
+    if (ec != std::errc() || end != value.data() + value.size() || limit == 0)
+        return false;
+    limit = std::min(limit, swp::VAULT_PAGE_SIZE);
+    return true;
+}
+
+namespace api {
+
+// Answers once the password check completes asynchronously.
+template <class Context> void login(Context& ctx) {
+    auto& [req, send, db, kdf, params, _] = ctx;
+    auto username = bsv2sv(req["Username"]);
+    if (is_authenticated(req, db, username))
+        return send(not_found(req));
+    auto password = bsv2sv(req["Password"]);
+    if (username.empty() || password.empty())
+        return send(unauthorized(req));
+
+    // Argon2 holds a core and 64 MiB for hundreds of milliseconds: verify on the KDF
+    // workers and resume on the session's strand, which send keeps alive.
+    auto verify = [hash = db.getPasswordHash(username), password = std::string(password)] {
+        return argon2i_verify(hash.data(), password.data(), password.size());
+    };
+    auto respond = [send = send, session = send.lifetime(), &db = db, username = std::string(username), target = std::string(req.target()),
+                    version = req.version(), keep_alive = req.keep_alive()](int rc) {
+        if (rc != ARGON2_OK)
+            return send(make_error(http::status::unauthorized, version, keep_alive, "The resource '", target, "' requires authorization."));
         SessionId<swp::SESSIONID_SIZE> sessionId;
         if (db.setSessionID(sessionId, username) != SQLITE_OK)
-            return server_error("Cannot store session id.");
-        auto res = response_builder(http::status::ok);
+            return send(make_error(http::status::internal_server_error, version, keep_alive, "An error occurred: 'Cannot store session id.'"));
+        auto res = make_response(http::status::ok, version, keep_alive);
         res.set(http::field::set_cookie, "Session-Id=" + std::string(sessionId.view()));
         res.prepare_payload();
-        return std::move(res);
+        return send(std::move(res));
     };
+    if (!kdf.submit(send.get_executor(), std::move(verify), std::move(respond))) {
+        auto res = make_error(http::status::service_unavailable, req.version(), req.keep_alive(), "Too many pending logins, retry later.");
+        res.set(http::field::retry_after, "1");
+        return send(std::move(res));
+    }
+}
 
-    auto const register_ = [&](beast::string_view target) { return not_found(req.target()); }; // NOT implemented yet - WIP
-
-    auto const vault = [&](beast::string_view target) {
-        auto username = bsv2sv(req["Username"]);
-        if (!isAuthenticated(username))
-            return unauthorized(req.target());
-        switch (req.method()) {
-        case http::verb::get: {
-            std::string buffer{};
-            if (target.empty() || (target.starts_with('/') && target.substr(1).empty())) {
-                auto vaults = db.listVault(username);
-                if (vaults.second != SQLITE_OK)
-                    return server_error("Cannot load the user vaults.");
-                for (auto& vault : vaults.first) {
-                    buffer += vault + '\n';
-                }
-                auto res = response_builder(http::status::ok);
-                res.body() = buffer;
-                res.prepare_payload();
-                return std::move(res);
-            }
-            if (!target.starts_with('/'))
-                return not_found(req.target());
-            auto vault_name = bsv2sv(target.substr(1));
-            auto vault = db.getVault(username, vault_name);
-            if (vault.second != SQLITE_OK)
-                return not_found(req.target());
-            auto res = response_builder(http::status::ok);
-            res.body() = std::string(vault.first.begin(), vault.first.end());
-            res.prepare_payload();
-            return std::move(res);
-        }
-        case http::verb::post: {
-            if (!(target.empty() || (target.starts_with('/') && target.substr(1).empty())))
-                return method_not_allowed(req.target());
-            auto vault_name = bsv2sv(req["Vault-Name"]);
-            if (vault_name.empty())
-                return bad_request("Vault name cannot be empty.");
-            auto body = req.body();
-            if (int rc = db.storeVault(username, vault_name, swp::BLOB_Data(body.begin(), body.end())); rc != SQLITE_OK) {
-                if (rc == SQLITE_CONSTRAINT)
-                    return bad_request("The vault '" + std::string(vault_name) + "' already exists.");
-                return server_error("Cannot store vault data.");
-            }
-            return ok_response();
-        }
-        case http::verb::delete_: {
-            if (target.empty())
-                return method_not_allowed(req.target());
-            if (!target.starts_with('/'))
-                return not_found(req.target());
-            target = target.substr(1);
-            if (target.empty())
-                return method_not_allowed(req.target());
-            if (int rc = db.deleteVault(bsv2sv(target), username); rc != SQLITE_OK)
-                return server_error("Cannot delete the requested vault.");
-            return ok_response();
-        }
-        case http::verb::patch: {
-            if (target.empty())
-                return method_not_allowed(req.target());
-            if (!target.starts_with('/'))
-                return not_found(req.target());
-            target = target.substr(1);
-            if (target.empty())
-                return method_not_allowed(req.target());
-            auto body = req.body();
-            if (int rc = db.updateVault(bsv2sv(target), username, swp::BLOB_Data(body.begin(), body.end())); rc != SQLITE_OK) {
-                if (rc == SQLITE_DONE)
-                    return bad_request("The vault '" + std::string(target) + "' doesn't exist.");
-                return server_error("Cannot update the requested vault.");
-            }
-            return ok_response();
-        }
-        default:
-            return method_not_allowed(req.target());
-        }
-    };
+template <class Context> void logout(Context& ctx) {
+    auto& [req, send, db, kdf, params, _] = ctx;
+    auto username = bsv2sv(req["Username"]);
+    auto sessionId = bsv2sv(req["Session-Id"]);
+    if (username.empty() || !db.isSessionIdValid(username, sessionId))
+        return send(unauthorized(req));
+    if (db.deleteSessionID(username, sessionId) != SQLITE_OK)
+        return send(server_error(req, "Cannot delete session id."));
+    return send(ok_response(req));
+}
 
-    auto const token = [&](beast::string_view target) {
-        auto username = bsv2sv(req["Username"]);
-        if (!isAuthenticated(username))
-            return unauthorized(req.target());
-        switch (req.method()) {
-        case http::verb::get: {
-            if (!target.empty()) {
-                if (!target.starts_with('/'))
-                    return not_found(req.target());
-                if (!target.substr(1).empty())
-                    return method_not_allowed(req.target());
-            }
-            auto tokens = db.listToken(username);
-            if (tokens.sqlite_code != SQLITE_OK)
-                return server_error("Cannot load the username tokens.");
-            auto res = response_builder(http::status::ok);
-            std::string buffer{};
-            for (const auto& row : tokens.value) {
-                buffer += "Name: " + row[0] + '\n' + "Token: " + row[1] + '\n' + "Creation-Date: " + row[2] + '\n' + "Last-Usage: " + [&row] {
-                    if (row.size() >= 4) {
-                        if (const auto v = row[3]; !v.empty())
-                            return row[3];
-                    }
-                    return std::string("N/A");
-                }() + "\n\n";
-            }
-            res.body() = buffer;
-            res.prepare_payload();
-            return std::move(res);
+// Lists the vault names a page at a time, in name order: ?limit= names (at most
+// VAULT_PAGE_SIZE) which sort after ?after=. When more follow, Vault-Next-After
+// holds the after value of the next page, already escaped.
+template <class Context> void list_vaults(Context& ctx) {
+    auto& [req, send, db, kdf, params, username] = ctx;
+    auto const target = bsv2sv(req.target());
+    std::size_t limit;
+    if (!page_limit(target, limit))
+        return send(bad_request(req, "The limit must be a positive number."));
+    swp::PooledString after;
+    if (!percent_decode(after, query_param(target, "after")))
+        return send(bad_request(req, "Malformed after parameter."));
+
+    // One more name than the page tells whether another page follows
+    auto res = make_response(http::status::ok, req.version(), req.keep_alive());
+    auto& body = res.body();
+    auto const [count, rc] = db.appendVaultNames(username, after, limit + 1, body);
+    if (rc != SQLITE_OK)
+        return send(server_error(req, "Cannot load the user vaults."));
+    if (count > limit) {
+        body.pop_back();
+        body.resize(body.rfind('\n') + 1);
+        auto const last = std::string_view(body).substr(0, body.size() - 1);
+        after.clear();
+        res.set("Vault-Next-After", sv2bsv(percent_encode(after, last.substr(last.rfind('\n') + 1))));
+    }
+    res.prepare_payload();
+    return send(std::move(res));
+}
+
+// Lists the last change of each vault changed after ?since= (0 by default), in
+// sequence order, ?limit= of them at most, see ServerDB::appendVaultChanges.
+// Vault-Sequence holds the since value of the next call; Vault-Next-Since is
+// only set, to the same value, when more changes follow.
+template <class Context> void list_changes(Context& ctx) {
+    auto& [req, send, db, kdf, params, username] = ctx;
+    auto const target = bsv2sv(req.target());
+    std::size_t limit;
+    if (!page_limit(target, limit))
+        return send(bad_request(req, "The limit must be a positive number."));
+    sqlite3_int64 since = 0;
+    if (auto const value = query_param(target, "since"); !value.empty()) {
+        auto const [end, ec] = std::from_chars(value.data(), value.data() + value.size(), since);
+        if (ec != std::errc() || end != value.data() + value.size() || since < 0)
+            return send(bad_request(req, "The since parameter must be a sequence."));
+    }
+
+    // One more change than the page tells whether another page follows
+    auto res = make_response(http::status::ok, req.version(), req.keep_alive());
+    auto& body = res.body();
+    auto const [count, rc] = db.appendVaultChanges(username, since, limit + 1, body);
+    if (rc != SQLITE_OK)
+        return send(server_error(req, "Cannot load the vault changes."));
+    if (count > limit) {
+        body.pop_back();
+        body.resize(body.rfind('\n') + 1);
+    }
+    auto sequence = since;
+    if (!body.empty()) {
+        auto const last = body.rfind('\n', body.size() - 2) + 1;
+        std::from_chars(body.data() + last, body.data() + body.size(), sequence);
+    }
+    auto const cursor = std::to_string(sequence);
+    res.set("Vault-Sequence", cursor);
+    if (count > limit)
+        res.set("Vault-Next-Since", cursor);
+    res.prepare_payload();
+    return send(std::move(res));
+}
+
+// Answers 304 to a client whose copy is current, its tag looked up without
+// reading the vault; the content is only read for the others.
+template <class Context> void get_vault(Context& ctx) {
+    auto& [req, send, db, kdf, params, username] = ctx;
+    if (auto const known = bsv2sv(req[http::field::if_none_match]); !known.empty()) {
+        auto const [tag, rc] = db.getVaultTag(username, params["name"]);
+        if (rc == SQLITE_DONE)
+            return send(not_found(req));
+        if (rc != SQLITE_OK)
+            return send(server_error(req, "Cannot read the vault tag."));
+        if (!tag.hash.empty() && etag_listed(known, tag.hash, true)) {
+            auto res = make_response(http::status::not_modified, req.version(), req.keep_alive());
+            // No Content-Length either: it would have to be the vault's
+            res.erase(http::field::content_type);
+            set_vault_tag(res, tag);
+            return send(std::move(res));
         }
-        case http::verb::post: {
-            if (!target.empty()) {
-                if (!target.starts_with('/'))
-                    return not_found(req.target());
-                if (!target.substr(1).empty())
-                    return method_not_allowed(req.target());
-            }
-            const auto token_name = bsv2sv(req["Token-Name"]);
-            if (token_name.empty())
-                return bad_request("Token name cannot be empty.");
-            swp::Token<swp::TOKEN_SIZE> token;
-            if (db.setToken(token, username, token_name) != SQLITE_OK)
-                return server_error("Cannot set a token.");
-            return ok_response();
+    }
+    // Read straight into the body's string, then only moved into the response.
+    // A single byte range is read alone, unless If-Range names another content:
+    // that is checked against the tag first, so the whole vault is read only once.
+    swp::VaultTag tag;
+    swp::VaultRange range;
+    auto ranged = parse_range(bsv2sv(req[http::field::range]), range);
+    auto const if_range = bsv2sv(req[http::field::if_range]);
+    if (ranged && !if_range.empty()) {
+        auto const [current, rc] = db.getVaultTag(username, params["name"]);
+        if (rc == SQLITE_DONE)
+            return send(not_found(req));
+        if (rc != SQLITE_OK)
+            return send(server_error(req, "Cannot read the vault tag."));
+        ranged = !current.hash.empty() && etag_listed(if_range, current.hash, false);
+    }
+    auto vault = db.template getVault<swp::PooledString>(username, params["name"], &tag, ranged ? &range : nullptr);
+    // Written between the two reads: the range is of another content
+    if (ranged && !if_range.empty() && vault.second == SQLITE_OK && !etag_listed(if_range, tag.hash, false)) {
+        ranged = false;
+        vault = db.template getVault<swp::PooledString>(username, params["name"], &tag);
+    }
+    if (vault.second == SQLITE_RANGE) {
+        auto res = make_error(http::status::range_not_satisfiable, req.version(), req.keep_alive(), "The range isn't in the vault.");
+        res.set(http::field::content_range, "bytes */" + std::to_string(range.size));
+        return send(std::move(res));
+    }
+    if (vault.second != SQLITE_OK)
+        return send(not_found(req));
+    auto res = make_response(ranged ? http::status::partial_content : http::status::ok, req.version(), req.keep_alive());
+    set_vault_tag(res, tag);
+    res.set(http::field::accept_ranges, "bytes");
+    if (ranged)
+        res.set(http::field::content_range,
+                "bytes " + std::to_string(range.first) + "-" + std::to_string(range.last) + "/" + std::to_string(range.size));
+    res.body() = std::move(vault.first);
+    res.prepare_payload();
+    return send(std::move(res));
+}
+
+// Buffered uploads: the session streams them instead, see is_vault_upload.
+template <class Context> void store_vault(Context& ctx) {
+    auto& [req, send, db, kdf, params, username] = ctx;
+    auto vault_name = bsv2sv(req["Vault-Name"]);
+    if (vault_name.empty())
+        return send(bad_request(req, "Vault name cannot be empty."));
+    auto const& body = req.body();
+    if (int rc = db.storeVault(username, vault_name, swp::BLOB_Data(body.begin(), body.end())); rc != SQLITE_OK) {
+        if (rc == SQLITE_CONSTRAINT)
+            return send(bad_request(req, "The vault '", sv2bsv(vault_name), "' already exists."));
+        return send(server_error(req, "Cannot store vault data."));
+    }
+    return send(ok_response(req));
+}
+
+// A PATCH with a Content-Range: writes its body at that place of the vault.
+template <class Context> void write_vault_range(Context& ctx, std::string_view content_range, std::string_view expected) {
+    auto& [req, send, db, kdf, params, username] = ctx;
+    auto const vault_name = params["name"];
+    auto const& body = req.body();
+    std::uint64_t first, last;
+    std::optional<std::uint64_t> size;
+    if (!parse_content_range(content_range, first, last, size) || last - first + 1 != body.size())
+        return send(bad_request(req, "Malformed Content-Range."));
+    swp::VaultTag tag;
+    switch (db.writeVaultRange(username, vault_name, first, body.data(), body.size(), size, expected, &tag)) {
+    case SQLITE_OK: {
+        auto res = make_response(http::status::ok, req.version(), req.keep_alive());
+        set_vault_tag(res, tag);
+        res.prepare_payload();
+        return send(std::move(res));
+    }
+    case SQLITE_DONE:
+        return send(bad_request(req, "The vault '", sv2bsv(vault_name), "' doesn't exist."));
+    case SQLITE_MISMATCH:
+        return send(make_error(http::status::precondition_failed, req.version(), req.keep_alive(), "The vault '", sv2bsv(vault_name),
+                               "' has changed."));
+    case SQLITE_RANGE:
+        return send(make_error(http::status::range_not_satisfiable, req.version(), req.keep_alive(), "The range would leave a gap in the vault."));
+    default:
+        return send(server_error(req, "Cannot update the requested vault."));
+    }
+}
+
+template <class Context> void update_vault(Context& ctx) {
+    auto& [req, send, db, kdf, params, username] = ctx;
+    auto const vault_name = params["name"];
+    std::string expected;
+    if (auto const status = resolve_if_match(req, db, username, vault_name, expected); status == http::status::precondition_failed)
+        return send(make_error(*status, req.version(), req.keep_alive(), "The vault '", sv2bsv(vault_name), "' has changed."));
+    else if (status)
+        return send(server_error(req, "Cannot read the vault tag."));
+    auto const& body = req.body();
+    if (auto const content_range = bsv2sv(req[http::field::content_range]); !content_range.empty())
+        return write_vault_range(ctx, content_range, expected);
+    if (int rc = db.updateVault(vault_name, username, swp::BLOB_Data(body.begin(), body.end()), expected); rc != SQLITE_OK) {
+        if (rc == SQLITE_DONE)
+            return send(bad_request(req, "The vault '", sv2bsv(vault_name), "' doesn't exist."));
+        if (rc == SQLITE_MISMATCH)
+            return send(make_error(http::status::precondition_failed, req.version(), req.keep_alive(), "The vault '", sv2bsv(vault_name),
+                                   "' has changed."));
+        return send(server_error(req, "Cannot update the requested vault."));
+    }
+    return send(ok_response(req));
+}
+
+// Runs a list of vault operations in a single transaction, then answers all of
+// them in one response. Each operation is a line, PUT followed by its content:
+//   GET <name>\n   PUT <length> <name>\n<content>   DELETE <name>\n
+// and each result a line followed by the content read, when it is a GET's:
+//   <status> <length> <ETag> <name>\n<content>
+// The whole list is checked before the first operation runs; a database error
+// rolls every operation back.
+template <class Context> void batch_vaults(Context& ctx) {
+    auto& [req, send, db, kdf, params, username] = ctx;
+    struct Operation {
+        http::verb method;
+        std::string_view name;
+        std::string_view content;
+    };
+    std::vector<Operation> operations;
+    for (std::string_view body(req.body().data(), req.body().size()); !body.empty();) {
+        auto const end = body.find('\n');
+        auto const space = body.substr(0, end).find(' ');
+        if (end == std::string_view::npos || space == std::string_view::npos)
+            return send(bad_request(req, "Malformed batch operation."));
+        auto const verb = body.substr(0, space);
+        auto line = body.substr(space + 1, end - space - 1);
+        body.remove_prefix(end + 1);
+        Operation operation{http::string_to_verb(sv2bsv(verb)), {}, {}};
+        if (operation.method == http::verb::put) {
+            std::uint64_t length;
+            if (!consume_number(line, length) || line.empty() || line.front() != ' ' || length > body.size())
+                return send(bad_request(req, "Malformed batch operation."));
+            line.remove_prefix(1);
+            operation.content = body.substr(0, length);
+            body.remove_prefix(length);
+        } else if (operation.method != http::verb::get && operation.method != http::verb::delete_) {
+            return send(bad_request(req, "Malformed batch operation."));
         }
-        case http::verb::delete_: {
-            if (!target.starts_with('/'))
-                return not_found(req.target());
-            target = target.substr(1);
-            if (target.empty())
-                return method_not_allowed(req.target());
-            if (db.deleteToken(username, bsv2sv(target)) != SQLITE_OK)
-                return server_error("Cannot delete the token.");
-            return ok_response();
+        if (line.empty())
+            return send(bad_request(req, "Vault name cannot be empty."));
+        if (operations.size() == swp::VAULT_BATCH_SIZE)
+            return send(bad_request(req, "A batch holds at most ", std::to_string(swp::VAULT_BATCH_SIZE), " operations."));
+        operation.name = line;
+        operations.push_back(operation);
+    }
+
+    auto const writes = std::any_of(operations.begin(), operations.end(), [](const Operation& op) { return op.method != http::verb::get; });
+    auto [batch, rc] = db.beginBatch(username, writes);
+    if (rc != SQLITE_OK)
+        return send(server_error(req, "Cannot start the batch."));
+    auto res = make_response(http::status::ok, req.version(), req.keep_alive());
+    auto& out = res.body();
+    for (auto const& [method, name, content] : operations) {
+        swp::VaultTag tag;
+        auto const start = out.size();
+        if (method == http::verb::get) {
+            rc = batch->get(name, out, swp::VAULT_BATCH_BYTES, &tag);
+        } else if (method == http::verb::put) {
+            rc = batch->put(name, content.data(), content.size(), &tag);
+        } else {
+            rc = batch->remove(name);
         }
+        unsigned status;
+        switch (rc) {
+        case SQLITE_OK:
+            status = 200;
+            break;
+        case SQLITE_DONE:
+            status = 404;
+            break;
+        case SQLITE_TOOBIG:
+            status = 413;
+            break;
         default:
-            return method_not_allowed(req.target());
+            return send(server_error(req, "Cannot apply the batch."));
         }
-    };
 
-    auto const user = [&](beast::string_view target) {
-        if (constexpr beast::string_view key = "/token"; target.starts_with(key))
-            return token(target.substr(key.size()));
-        return not_found(req.target());
-    };
+        // The content read is already in place: its result line goes before it
+        char head[64];
+        auto const length = out.size() - start;
+        auto p = std::to_chars(head, head + sizeof(head), status).ptr;
+        *p++ = ' ';
+        p = std::to_chars(p, head + sizeof(head), length).ptr;
+        swp::PooledString line(head, p);
+        line.push_back(' ');
+        if (status != 200 || method == http::verb::delete_)
+            line.push_back('-');
+        else if (tag.hash.empty())
+            line.push_back('*');
+        else
+            line.append(1, '"').append(tag.hash).push_back('"');
+        line.append(1, ' ').append(name).push_back('\n');
+        out.insert(start, line);
+    }
+    if (batch->commit() != SQLITE_OK)
+        return send(server_error(req, "Cannot apply the batch."));
+    res.prepare_payload();
+    return send(std::move(res));
+}
 
-    auto const api = [&](beast::string_view target) {
-        if (constexpr beast::string_view key = "/login"; target.starts_with(key))
-            return login(target.substr(key.size()));
-        if (constexpr beast::string_view key = "/register"; target.starts_with(key))
-            return register_(target.substr(key.size()));
-        if (constexpr beast::string_view key = "/vault"; target.starts_with(key))
-            return vault(target.substr(key.size()));
-        if (constexpr beast::string_view key = "/user"; target.starts_with(key))
-            return user(target.substr(key.size()));
-        return not_found(req.target());
-    };
+template <class Context> void delete_vault(Context& ctx) {
+    auto& [req, send, db, kdf, params, username] = ctx;
+    if (int rc = db.deleteVault(params["name"], username); rc != SQLITE_OK)
+        return send(server_error(req, "Cannot delete the requested vault."));
+    return send(ok_response(req));
+}
+
+template <class Context> void list_tokens(Context& ctx) {
+    auto& [req, send, db, kdf, params, username] = ctx;
+    auto tokens = db.listToken(username);
+    if (tokens.sqlite_code != SQLITE_OK)
+        return send(server_error(req, "Cannot load the username tokens."));
+    auto res = make_response(http::status::ok, req.version(), req.keep_alive());
+    auto& body = res.body();
+    for (const auto& row : tokens.value) {
+        body.append("Name: ").append(row[0]).append("\nToken: ").append(row[1]).append("\nCreation-Date: ").append(row[2]).append("\nLast-Usage: ");
+        body.append(row.size() >= 4 && !row[3].empty() ? std::string_view(row[3]) : std::string_view("N/A")).append("\n\n");
+    }
+    res.prepare_payload();
+    return send(std::move(res));
+}
+
+template <class Context> void create_token(Context& ctx) {
+    auto& [req, send, db, kdf, params, username] = ctx;
+    const auto token_name = bsv2sv(req["Token-Name"]);
+    if (token_name.empty())
+        return send(bad_request(req, "Token name cannot be empty."));
+    swp::Token<swp::TOKEN_SIZE> token;
+    if (db.setToken(token, username, token_name) != SQLITE_OK)
+        return send(server_error(req, "Cannot set a token."));
+    return send(ok_response(req));
+}
+
+template <class Context> void delete_token(Context& ctx) {
+    auto& [req, send, db, kdf, params, username] = ctx;
+    if (db.deleteToken(username, params["name"]) != SQLITE_OK)
+        return send(server_error(req, "Cannot delete the token."));
+    return send(ok_response(req));
+}
+} // namespace api
+
+// The API routes, built on first use. /api/register is NOT implemented yet - WIP.
+template <class Context> const swp::Router<ApiRoute<Context>>& api_router() {
+    static const auto router = [] {
+        swp::Router<ApiRoute<Context>> router;
+        router.add(http::verb::get, "/api/login", {&api::login<Context>, false})
+            .add(http::verb::post, "/api/logout", {&api::logout<Context>, false})
+            .add(http::verb::get, "/api/vault", {&api::list_vaults<Context>, true})
+            .add(http::verb::post, "/api/vault", {&api::store_vault<Context>, true})
+            .add(http::verb::get, "/api/sync/changes", {&api::list_changes<Context>, true})
+            .add(http::verb::post, "/api/batch", {&api::batch_vaults<Context>, true})
+            .add(http::verb::get, "/api/vault/:name", {&api::get_vault<Context>, true})
+            .add(http::verb::patch, "/api/vault/:name", {&api::update_vault<Context>, true})
+            .add(http::verb::delete_, "/api/vault/:name", {&api::delete_vault<Context>, true})
+            .add(http::verb::get, "/api/user/token", {&api::list_tokens<Context>, true})
+            .add(http::verb::post, "/api/user/token", {&api::create_token<Context>, true})
+            .add(http::verb::delete_, "/api/user/token/:name", {&api::delete_token<Context>, true});
+        return router;
+    }();
+    return router;
+}
 
+// This function produces an HTTP response for the given
+// request. The type of the response object depends on the
+// contents of the request, so the interface requires the
+// caller to pass a generic lambda for receiving the response.
+template <class Body, class Allocator, class Send>
+void handle_request(beast::string_view doc_root, http::request<Body, http::basic_fields<Allocator>>&& req, Send&& send, swp::ServerDB& db,
+                    swp::KdfExecutor& kdf, swp::StaticCache& assets) {
     // Request path must be absolute and not contain "..".
     if (req.target().empty() || req.target()[0] != '/' || req.target().find("..") != beast::string_view::npos)
-        return send(bad_request("Illegal request-target"));
-
-    if (constexpr beast::string_view key = "/api"; req.target().starts_with(key))
-        return send(api(req.target().substr(key.size())));
+        return send(bad_request(req, "Illegal request-target"));
+
+    if (constexpr beast::string_view key = "/api"; req.target().starts_with(key)) {
+        using Context = ApiContext<http::request<Body, http::basic_fields<Allocator>>, std::remove_reference_t<Send>>;
+        auto const path = req.target().substr(0, req.target().find('?'));
+        auto const match = api_router<Context>().match(req.method(), bsv2sv(path));
+        if (match.status == swp::Router<ApiRoute<Context>>::Status::not_found)
+            return send(not_found(req));
+        if (match.status == swp::Router<ApiRoute<Context>>::Status::method_not_allowed)
+            return send(method_not_allowed(req));
+        Context ctx{req, send, db, kdf, match.params, {}};
+        if (match.value->authenticated) {
+            ctx.username = bsv2sv(req["Username"]);
+            if (!is_authenticated(req, db, ctx.username))
+                return send(unauthorized(req));
+        }
+        return match.value->handler(ctx);
+    }
 
-    // Build the path to the requested file
-    std::string path = path_cat(doc_root, req.target());
+    // Build the path to the requested file, along with the request
+    std::basic_string<char, std::char_traits<char>, Allocator> path{req.get_allocator()};
+    path_cat(path, doc_root, req.target());
     if (req.target().back() == '/')
         path.append("index.html");
 
-    // Attempt to open the file
+    // Serve the file from memory when it is small enough to be cached
     beast::error_code ec;
+    if (auto const asset = assets.get(path, ec)) {
+        auto [content, encoding] = asset->select(req[http::field::accept_encoding]);
+        auto const set_headers = [&](auto& res) {
+            res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+            res.set(http::field::content_type, asset->mime);
+            if (!encoding.empty())
+                res.set(http::field::content_encoding, encoding);
+            if (asset->has_variants())
+                res.set(http::field::vary, "Accept-Encoding");
+            res.content_length(content->size());
+            res.keep_alive(req.keep_alive());
+        };
+
+        // Respond to HEAD request
+        if (req.method() == http::verb::head) {
+            http::response<http::empty_body, swp::PooledFields> res{http::status::ok, req.version()};
+            set_headers(res);
+            return send(std::move(res));
+        }
+
+        // Respond to GET request
+        http::response<swp::SharedBufferBody, swp::PooledFields> res{http::status::ok, req.version()};
+        set_headers(res);
+        res.body() = std::move(content);
+        return send(std::move(res));
+    }
+
+    // Handle the case where the file doesn't exist
+    if (ec == beast::errc::no_such_file_or_directory)
+        return send(not_found(req));
+
+    // Handle an unknown error
+    if (ec)
+        return send(server_error(req, ec.message()));
+
+    // Too large to be cached: stream it from the disk
     http::file_body::value_type body;
     body.open(path.c_str(), beast::file_mode::scan, ec);
 
     // Handle the case where the file doesn't exist
     if (ec == beast::errc::no_such_file_or_directory)
-        return send(not_found(req.target()));
+        return send(not_found(req));
 
     // Handle an unknown error
     if (ec)
-        return send(server_error(ec.message()));
+        return send(server_error(req, ec.message()));
 
     // Cache the size since we need it after the move
     auto const size = body.size();
 
     // Respond to HEAD request
     if (req.method() == http::verb::head) {
-        http::response<http::empty_body> res{http::status::ok, req.version()};
+        http::response<http::empty_body, swp::PooledFields> res{http::status::ok, req.version()};
         res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
         res.set(http::field::content_type, mime_type(path));
         res.content_length(size);
@@ -370,7 +971,7 @@ void handle_request(beast::string_view doc_root, http::request<Body, http::basic
     }
 
     // Respond to GET request
-    http::response<http::file_body> res{std::piecewise_construct, std::make_tuple(std::move(body)), std::make_tuple(http::status::ok, req.version())};
+    http::response<http::file_body, swp::PooledFields> res{std::piecewise_construct, std::make_tuple(std::move(body)), std::make_tuple(http::status::ok, req.version())};
     res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
     res.set(http::field::content_type, mime_type(path));
     res.content_length(size);
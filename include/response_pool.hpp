@@ -0,0 +1,151 @@
+#ifndef SECUREWEBPASS_RESPONSE_POOL_HPP
+#define SECUREWEBPASS_RESPONSE_POOL_HPP
+
+#include <array>
+#include <cstddef>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <boost/beast/http/fields.hpp>
+#include <boost/beast/http/string_body.hpp>
+
+namespace swp {
+
+// Free lists of one thread, one per power-of-two size class from 64 bytes to
+// 4 KiB. Blocks freed by responses are kept for the next ones instead of being
+// returned to the heap, up to KEEP per class; larger requests go to the heap.
+// A block freed on another thread than the one which allocated it simply
+// joins that thread's lists.
+class RecyclingPool {
+    static constexpr std::size_t MIN = 64;
+    static constexpr std::size_t CLASSES = 7;
+    static constexpr std::size_t KEEP = 256;
+
+    struct Block {
+        Block* next;
+    };
+
+    std::array<Block*, CLASSES> heads{};
+    std::array<std::size_t, CLASSES> counts{};
+
+    static constexpr std::size_t size_class(std::size_t bytes) noexcept {
+        std::size_t c = 0;
+        while (c < CLASSES && (MIN << c) < bytes)
+            ++c;
+        return c;
+    }
+
+  public:
+    RecyclingPool() = default;
+
+    RecyclingPool(const RecyclingPool&) = delete;
+
+    RecyclingPool& operator=(const RecyclingPool&) = delete;
+
+    ~RecyclingPool() {
+        for (auto head : heads)
+            while (head)
+                ::operator delete(std::exchange(head, head->next));
+    }
+
+    static RecyclingPool& local() noexcept {
+        thread_local RecyclingPool pool;
+        return pool;
+    }
+
+    void* allocate(std::size_t bytes) {
+        auto const c = size_class(bytes);
+        if (c == CLASSES)
+            return ::operator new(bytes);
+        if (auto block = heads[c]) {
+            heads[c] = block->next;
+            --counts[c];
+            return block;
+        }
+        return ::operator new(MIN << c);
+    }
+
+    void deallocate(void* p, std::size_t bytes) noexcept {
+        auto const c = size_class(bytes);
+        if (c == CLASSES || counts[c] == KEEP)
+            return ::operator delete(p);
+        heads[c] = ::new (p) Block{heads[c]};
+        ++counts[c];
+    }
+};
+
+// A stateless allocator drawing from the calling thread's RecyclingPool.
+template <class T> struct RecyclingAllocator {
+    using value_type = T;
+
+    RecyclingAllocator() noexcept = default;
+
+    template <class U> RecyclingAllocator(const RecyclingAllocator<U>&) noexcept {}
+
+    T* allocate(std::size_t n) {
+        static_assert(alignof(T) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__, "over-aligned types aren't supported");
+        return static_cast<T*>(RecyclingPool::local().allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, std::size_t n) noexcept { RecyclingPool::local().deallocate(p, n * sizeof(T)); }
+
+    template <class U> bool operator==(const RecyclingAllocator<U>&) const noexcept { return true; }
+
+    template <class U> bool operator!=(const RecyclingAllocator<U>&) const noexcept { return false; }
+};
+
+// Responses are built with these, so a server in its steady state builds them
+// from recycled blocks.
+using PooledString = std::basic_string<char, std::char_traits<char>, RecyclingAllocator<char>>;
+using PooledFields = boost::beast::http::basic_fields<RecyclingAllocator<char>>;
+using PooledStringBody = boost::beast::http::basic_string_body<char, std::char_traits<char>, RecyclingAllocator<char>>;
+using ApiResponse = boost::beast::http::response<PooledStringBody, PooledFields>;
+
+// Holds the message a session is writing. Messages up to SIZE bytes, which
+// covers every response of the server, are built in place, so queueing one
+// for writing allocates nothing; larger ones are kept on the heap.
+class ResponseSlot {
+  public:
+    static constexpr std::size_t SIZE = 256;
+
+  private:
+    alignas(std::max_align_t) unsigned char storage[SIZE];
+    void* message = nullptr;
+    void (*destroy)(void*) = nullptr;
+
+  public:
+    ResponseSlot() = default;
+
+    ResponseSlot(const ResponseSlot&) = delete;
+
+    ResponseSlot& operator=(const ResponseSlot&) = delete;
+
+    ~ResponseSlot() { reset(); }
+
+    template <class Message> Message& emplace(Message&& msg) {
+        static_assert(!std::is_lvalue_reference_v<Message>, "the message is moved into the slot");
+        reset();
+        Message* p;
+        if constexpr (sizeof(Message) <= SIZE && alignof(Message) <= alignof(std::max_align_t)) {
+            p = ::new (storage) Message(std::move(msg));
+            destroy = [](void* m) { static_cast<Message*>(m)->~Message(); };
+        } else {
+            p = new Message(std::move(msg));
+            destroy = [](void* m) { delete static_cast<Message*>(m); };
+        }
+        message = p;
+        return *p;
+    }
+
+    // The message last emplaced, nullptr once reset.
+    [[nodiscard]] void* get() const noexcept { return message; }
+
+    void reset() noexcept {
+        if (message)
+            destroy(std::exchange(message, nullptr));
+    }
+};
+} // namespace swp
+
+#endif // SECUREWEBPASS_RESPONSE_POOL_HPP
@@ -0,0 +1,188 @@
+#ifndef SECUREWEBPASS_ROUTER_HPP
+#define SECUREWEBPASS_ROUTER_HPP
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include <boost/beast/http/verb.hpp>
+
+namespace swp {
+
+// The path parameters captured by a match, e.g. name = "v1" for "/api/vault/:name".
+class RouteParams {
+    static constexpr std::size_t MAX = 4;
+
+    // Trivial, so a match doesn't pay for clearing slots it never fills
+    struct Param {
+        const char* name;
+        std::size_t name_size;
+        const char* value;
+        std::size_t value_size;
+    };
+
+    std::array<Param, MAX> items;
+    std::size_t count = 0;
+
+  public:
+    bool push(std::string_view name, std::string_view value) noexcept {
+        if (count == MAX)
+            return false;
+        items[count++] = {name.data(), name.size(), value.data(), value.size()};
+        return true;
+    }
+
+    // The value captured for name; empty if the route has no such parameter.
+    [[nodiscard]] std::string_view operator[](std::string_view name) const noexcept {
+        for (std::size_t i = 0; i < count; ++i)
+            if (std::string_view(items[i].name, items[i].name_size) == name)
+                return {items[i].value, items[i].value_size};
+        return {};
+    }
+};
+
+// Dispatches (method, path) pairs to values, built once then only read.
+// Routes are stored in a tree of path segments: a match walks one node per
+// segment of the request, whatever the number of routes, and captures the
+// ":name" segments of the pattern without copying them. Segments are compared
+// through their first 8 bytes packed in an integer, so a match is a single
+// scan of the path. At each node a literal segment wins over a parameter;
+// there is no backtracking. Empty segments are skipped, so "/api/vault" and
+// "/api/vault/" are the same path.
+template <class Value> class Router {
+    static constexpr std::uint32_t NONE = UINT32_MAX;
+
+    struct Edge {
+        std::uint64_t key;
+        std::size_t length;
+        std::uint32_t node;
+        std::string literal;
+    };
+
+    struct Node {
+        std::vector<Edge> edges;
+        std::uint32_t param = NONE;
+        std::string param_name;
+        std::vector<std::pair<boost::beast::http::verb, Value>> methods;
+    };
+
+    std::vector<Node> nodes{1}; // the root first
+
+    // Pops the next non-empty segment off path[pos...]; returns its first 8
+    // bytes packed with byte i at bits 8i. Paths of 8 bytes or more are read a
+    // word at a time, the '/' being searched within the word (SWAR); a segment
+    // near the end of the path is read from the path's last 8 bytes.
+    static std::uint64_t next_segment(std::string_view path, std::size_t& pos, std::string_view& segment) noexcept {
+        while (pos < path.size() && path[pos] == '/')
+            ++pos;
+        auto const start = pos;
+        auto const remaining = path.size() - pos;
+        std::uint64_t key = 0;
+        if (remaining == 0) {
+            segment = {};
+            return key;
+        }
+        if (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ && path.size() >= sizeof(key)) {
+            if (remaining >= sizeof(key)) {
+                std::memcpy(&key, path.data() + pos, sizeof(key));
+            } else {
+                std::memcpy(&key, path.data() + path.size() - sizeof(key), sizeof(key));
+                key >>= 8 * (sizeof(key) - remaining);
+            }
+            auto const x = key ^ 0x2f2f2f2f2f2f2f2full; // '/' bytes become 0
+            auto const slashes = (x - 0x0101010101010101ull) & ~x & 0x8080808080808080ull;
+            if (slashes) {
+                auto const size = static_cast<std::size_t>(__builtin_ctzll(slashes) / 8);
+                key &= (std::uint64_t{1} << (8 * size)) - 1;
+                pos += size;
+            } else {
+                pos += std::min(remaining, sizeof(key));
+                while (pos < path.size() && path[pos] != '/')
+                    ++pos;
+            }
+        } else {
+            for (; pos < path.size() && path[pos] != '/'; ++pos)
+                if (pos - start < sizeof(key))
+                    key |= std::uint64_t{static_cast<unsigned char>(path[pos])} << (8 * (pos - start));
+        }
+        segment = {path.data() + start, pos - start};
+        return key;
+    }
+
+  public:
+    enum class Status { found, method_not_allowed, not_found };
+
+    struct Match {
+        Status status = Status::not_found;
+        const Value* value = nullptr;
+        RouteParams params;
+    };
+
+    // Registers value for method on pattern, e.g. "/api/vault/:name".
+    Router& add(boost::beast::http::verb method, std::string_view pattern, Value value) {
+        std::uint32_t node = 0;
+        std::size_t pos = 0;
+        std::string_view segment;
+        for (auto key = next_segment(pattern, pos, segment); !segment.empty(); key = next_segment(pattern, pos, segment)) {
+            if (segment.front() == ':') {
+                if (nodes[node].param == NONE) {
+                    nodes[node].param = static_cast<std::uint32_t>(nodes.size());
+                    nodes.emplace_back().param_name = std::string(segment.substr(1));
+                }
+                node = nodes[node].param;
+                continue;
+            }
+            auto& edges = nodes[node].edges;
+            auto it = std::find_if(edges.begin(), edges.end(), [segment](const Edge& edge) { return edge.literal == segment; });
+            if (it == edges.end()) {
+                it = edges.insert(edges.end(), {key, segment.size(), static_cast<std::uint32_t>(nodes.size()), std::string(segment)});
+                nodes.emplace_back();
+            }
+            node = it->node;
+        }
+        nodes[node].methods.emplace_back(method, std::move(value));
+        return *this;
+    }
+
+    // Resolves path, which must not hold the query string.
+    [[nodiscard]] Match match(boost::beast::http::verb method, std::string_view path) const noexcept {
+        Match result;
+        const Node* node = &nodes.front();
+        std::size_t pos = 0;
+        std::string_view segment;
+        for (auto key = next_segment(path, pos, segment); !segment.empty(); key = next_segment(path, pos, segment)) {
+            const Node* next = nullptr;
+            for (const auto& edge : node->edges) {
+                if (edge.key == key && edge.length == segment.size() &&
+                    (segment.size() <= sizeof(key) || std::memcmp(edge.literal.data(), segment.data(), segment.size()) == 0)) {
+                    next = &nodes[edge.node];
+                    break;
+                }
+            }
+            if (!next && node->param != NONE && result.params.push(nodes[node->param].param_name, segment))
+                next = &nodes[node->param];
+            if (!next)
+                return result;
+            node = next;
+        }
+        if (node->methods.empty())
+            return result;
+        for (const auto& [verb, value] : node->methods) {
+            if (verb == method) {
+                result.status = Status::found;
+                result.value = &value;
+                return result;
+            }
+        }
+        result.status = Status::method_not_allowed;
+        return result;
+    }
+};
+} // namespace swp
+
+#endif // SECUREWEBPASS_ROUTER_HPP
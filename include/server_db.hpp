@@ -3,12 +3,19 @@
 #include <array>
 #include <cstring>
 #include <iostream>
+#include <limits>
+#include <memory>
+#include <optional>
 #include <string>
 #include <vector>
 #include <argon2.h>
 #include <boost/asio/deadline_timer.hpp>
 #include <sqlite3.h>
+#include "auth_cache.hpp"
+#include "connection_pool.hpp"
+#include "content_hash.hpp"
 #include "session_id.hpp"
+#include "token_usage.hpp"
 
 namespace swp {
 constexpr auto HASHLEN = 32;
@@ -16,24 +23,52 @@ constexpr auto SALTLEN = 16;
 constexpr auto ENCLEN = 4 * HASHLEN;
 constexpr auto SESSIONID_SIZE = 128;
 constexpr auto TOKEN_SIZE = 128;
+constexpr auto TOKEN_CACHE_TTL = 300; // seconds a validated token is trusted without asking SQLite
+constexpr uint32_t ARGON2_T_COST = 3;
+constexpr uint32_t ARGON2_M_COST = (1 << 16);                      // in KiB
+constexpr std::size_t ARGON2_MEMORY = std::size_t{ARGON2_M_COST} << 10; // bytes committed by one hash
 template <std::size_t N, class = std::enable_if_t<(N % 8) == 0>> using Token = SessionId<N>;
 
 using BLOB_Data = std::vector<uint8_t>;
 
+// What a vault's ETag is made of: the hex SHA-256 of its content, and how many
+// times it was written, counting its creation.
+struct VaultTag {
+    std::string hash;
+    sqlite3_int64 version = 0;
+};
+
+// Selects part of a vault in getVault, as a Range header does: the bytes from
+// first to last, or the last suffix bytes when suffix isn't 0. getVault clamps
+// it to the vault, sets first and last to the bytes read, and size to the whole.
+struct VaultRange {
+    std::uint64_t first = 0;
+    std::uint64_t last = std::numeric_limits<std::uint64_t>::max();
+    std::uint64_t suffix = 0;
+    std::uint64_t size = 0;
+};
+
 template <class T> struct SecValue {
     std::vector<std::vector<T>> value;
     int sqlite_code;
 };
 
+// Every public method checks a connection out of the pool for the duration of
+// the call, so all of them are safe to call concurrently from any number of
+// threads once open() has succeeded. Up to `connections` calls run in
+// parallel (reads alongside the single writer thanks to WAL); further callers
+// block until a connection is released. No isolation is guaranteed across two
+// separate calls. open() and the destructor must not race with anything else.
 class ServerDB {
   public:
     ServerDB() = default;
 
-    explicit ServerDB(const char* filename);
+    explicit ServerDB(const char* filename, std::size_t connections = 1);
 
+    // Writes back the pending token usages.
     ~ServerDB();
 
-    int open(const char* filename);
+    int open(const char* filename, std::size_t connections = 1);
 
     [[nodiscard]] SecValue<std::string> listToken(std::string_view owner);
 
@@ -45,44 +80,193 @@ class ServerDB {
 
     [[nodiscard]] bool isTokenValid(std::string_view owner, std::string_view token);
 
+    // Token last usages are recorded at most once per `resolution` seconds per token,
+    // and written in one transaction when flush_threshold of them are pending.
+    void configureTokenUsage(std::time_t resolution, std::size_t flush_threshold);
+
+    // Writes the pending token last usages in a single transaction. Meant to be
+    // called periodically; also called on the size threshold and on destruction.
+    int flushTokenUsage();
+
     int setSessionID(SessionId<SESSIONID_SIZE> sessionId, std::string_view username);
 
     [[nodiscard]] bool isSessionIdValid(std::string_view username, std::string_view session_id);
 
+    int deleteSessionID(std::string_view username, std::string_view session_id);
+
     int cleanSessionID();
 
+    // Deletes at most batch_size expired sessions, so the write lock is only held
+    // briefly; returns how many rows were removed. Call again while it returns batch_size.
+    [[nodiscard]] std::pair<std::size_t, int> reapExpiredSessions(std::size_t batch_size);
+
     int setPassword(std::string_view username, std::string_view password);
 
     int registerUser(std::string_view username, std::string_view password);
 
     [[nodiscard]] std::string getPasswordHash(std::string_view username);
 
-    [[nodiscard]] std::pair<std::vector<std::string>, int> listVault(std::string_view owner);
-
-    [[nodiscard]] std::pair<BLOB_Data, int> getVault(std::string_view owner, std::string_view vault_name);
+    // Appends the names of owner's vaults which sort after `after`, in order, one per
+    // line, up to limit of them, to a String (std::string or PooledString) as they are
+    // stepped. Returns how many were appended.
+    template <class String>
+    [[nodiscard]] std::pair<std::size_t, int> appendVaultNames(std::string_view owner, std::string_view after, std::size_t limit, String& out);
+
+    // Appends the last change of each of owner's vaults whose sequence is above since, in
+    // sequence order, up to limit of them, to a String (std::string or PooledString), one per
+    // line: "<sequence> <ETag> <name>", the ETag being "-" for a deleted vault and "*" for
+    // one whose hash isn't known yet. Returns how many were appended.
+    template <class String>
+    [[nodiscard]] std::pair<std::size_t, int> appendVaultChanges(std::string_view owner, sqlite3_int64 since, std::size_t limit, String& out);
+
+    // The vault's tag, read from the (owner, name) index alone: the row and its
+    // blob are left alone. SQLITE_DONE: the vault doesn't exist. The hash is only
+    // empty for a vault stored before content hashes until open() fills it in.
+    [[nodiscard]] std::pair<VaultTag, int> getVaultTag(std::string_view owner, std::string_view vault_name);
+
+    // Reads the vault straight into a Container (BLOB_Data, std::string or PooledString), the only copy made,
+    // and its tag into tag when given. Given a range, only reads those bytes: SQLITE_RANGE when none of them exist.
+    template <class Container = BLOB_Data>
+    [[nodiscard]] std::pair<Container, int> getVault(std::string_view owner, std::string_view vault_name, VaultTag* tag = nullptr,
+                                                     VaultRange* range = nullptr);
 
     int storeVault(std::string_view username, std::string_view vault_name, const BLOB_Data& data);
 
-    int updateVault(std::string_view vault_name, std::string_view owner, const BLOB_Data& data);
+    // Only replaces a vault whose hash is still if_match, when given: SQLITE_MISMATCH otherwise.
+    int updateVault(std::string_view vault_name, std::string_view owner, const BLOB_Data& data, std::string_view if_match = {});
+
+    // Writes n bytes at offset into the vault in place with incremental BLOB I/O, in one
+    // transaction, after resizing it to new_size when given; without it, a write past the
+    // end extends the vault. The new tag goes to tag when given. SQLITE_DONE: the vault
+    // doesn't exist; SQLITE_MISMATCH: its hash isn't if_match, when given; SQLITE_RANGE:
+    // the write would start past the end, or end past new_size.
+    int writeVaultRange(std::string_view owner, std::string_view vault_name, std::uint64_t offset, const void* data, std::size_t n,
+                        std::optional<std::uint64_t> new_size, std::string_view if_match = {}, VaultTag* tag = nullptr);
 
     int deleteVault(std::string_view vault_name, std::string_view owner);
 
+    enum class UploadMode { create, replace };
+
+    // A vault body being written in chunks, see beginVaultUpload. It lives in a
+    // staging row owned by "\n" + owner, which no request can name, and only
+    // takes the vault's place in commit(). An upload destroyed before a
+    // successful commit() deletes its staging row.
+    class VaultUpload {
+        friend class ServerDB;
+
+        ServerDB& db;
+        std::string owner;
+        std::string name;
+        UploadMode mode;
+        std::string if_match;
+        sqlite3_int64 rowid;
+        std::size_t size;
+        std::size_t offset = 0;
+        ContentHash content;
+        bool committed = false;
+
+        VaultUpload(ServerDB& db, std::string_view owner, std::string_view name, UploadMode mode, std::string_view if_match, sqlite3_int64 rowid,
+                    std::size_t size)
+            : db(db), owner(owner), name(name), mode(mode), if_match(if_match), rowid(rowid), size(size) {}
+
+      public:
+        VaultUpload(const VaultUpload&) = delete;
+
+        VaultUpload& operator=(const VaultUpload&) = delete;
+
+        ~VaultUpload();
+
+        // Appends the next chunk with incremental BLOB I/O. Each chunk checks a
+        // connection out only for its own write, never across network reads.
+        int write(const void* data, std::size_t n);
+
+        // Publishes the vault once every byte was written, with the hash of those bytes;
+        // call it once. SQLITE_CONSTRAINT: (create) the vault was created meanwhile;
+        // SQLITE_DONE: (replace) it was deleted meanwhile; SQLITE_MISMATCH: (replace) its
+        // hash is no longer the upload's if_match.
+        int commit();
+    };
+
+    // Reserves size bytes for the vault's new content with zeroblob(), so the body can
+    // be streamed in instead of buffered. SQLITE_CONSTRAINT: (create) the vault already
+    // exists; SQLITE_DONE: (replace) it doesn't; SQLITE_BUSY: it is already being uploaded.
+    // A replacement given if_match only takes place if the vault's hash is still that one.
+    [[nodiscard]] std::pair<std::unique_ptr<VaultUpload>, int> beginVaultUpload(std::string_view owner, std::string_view vault_name, std::size_t size,
+                                                                               UploadMode mode, std::string_view if_match = {});
+
+    // Vault operations of one owner applied in a single transaction, on one
+    // connection and its cached statements, see beginBatch. They only become
+    // visible to other connections in commit(); a batch destroyed before a
+    // successful commit() rolls them back.
+    class VaultBatch {
+        friend class ServerDB;
+
+        ConnectionPool::Lease conn;
+        std::string owner;
+        bool finished = false;
+
+        VaultBatch(ConnectionPool::Lease conn, std::string_view owner) : conn(std::move(conn)), owner(owner) {}
+
+      public:
+        VaultBatch(const VaultBatch&) = delete;
+
+        VaultBatch& operator=(const VaultBatch&) = delete;
+
+        ~VaultBatch();
+
+        // Appends the vault to a String (std::string or PooledString), read straight into it,
+        // and its tag to tag when given. SQLITE_DONE: the vault doesn't exist; SQLITE_TOOBIG:
+        // it would make out longer than max_size, and nothing was appended.
+        template <class String> int get(std::string_view vault_name, String& out, std::size_t max_size, VaultTag* tag = nullptr);
+
+        // Creates the vault, or replaces its content.
+        int put(std::string_view vault_name, const void* data, std::size_t n, VaultTag* tag = nullptr);
+
+        // SQLITE_DONE: the vault doesn't exist.
+        int remove(std::string_view vault_name);
+
+        int commit();
+    };
+
+    // Starts a batch of owner's vault operations. A batch which writes takes the write
+    // lock from the start, so it can't fail on it halfway through.
+    [[nodiscard]] std::pair<std::unique_ptr<VaultBatch>, int> beginBatch(std::string_view owner, bool writes);
+
+    // Prepared statement reuse across every pooled connection.
+    [[nodiscard]] StatementCacheStats statementCacheStats() const noexcept;
+
   private:
-    sqlite3* db{};
+    ConnectionPool pool;
+    // Serves isSessionIdValid/isTokenValid hits without touching SQLite.
+    AuthCache authCache;
+    TokenUsageBuffer tokenUsage;
+
+    static int error(sqlite3* db, int rc);
+
+    // Brings the schema up to the latest version, one transaction per step.
+    static int migrate(sqlite3* db);
+
+    static int exec_request(sqlite3* db, std::string_view sql);
 
-    int error(int rc);
+    // Feeds the first size bytes of an open blob to content, a chunk at a time.
+    static int hashBlob(sqlite3_blob* blob, std::uint64_t size, ContentHash& content);
 
-    int exec_request(std::string_view sql);
+    // Records the hash of the vaults stored before content hashes, batch_size of
+    // them per transaction, so reads never have to write.
+    int backfillVaultHashes(std::size_t batch_size);
 
-    SecValue<std::string> request(std::string_view sql, const std::vector<std::string_view>& args);
+    // The helpers below run sql through the connection's statement cache:
+    // sql must be a string literal.
+    static SecValue<std::string> request(Connection& conn, std::string_view sql, const std::vector<std::string_view>& args);
 
-    std::pair<std::string, int> firstRowColumn(std::string_view sql, int iCol, const std::vector<std::string_view>& args);
+    static std::pair<std::string, int> firstRowColumn(Connection& conn, std::string_view sql, int iCol, const std::vector<std::string_view>& args);
 
-    template <class T> std::pair<std::vector<T>, int> singleColumnList(std::string_view sql, int iCol, const std::vector<std::string_view>& args);
+    template <class T>
+    static std::pair<std::vector<T>, int> singleColumnList(Connection& conn, std::string_view sql, int iCol, const std::vector<std::string_view>& args);
 
-    template <class T> std::pair<std::vector<T>, int> firstRow(std::string_view sql, const std::vector<std::string_view>& args);
+    template <class T> static std::pair<std::vector<T>, int> firstRow(Connection& conn, std::string_view sql, const std::vector<std::string_view>& args);
 
-    int setTokenLastUsage(std::string_view owner, std::string_view token);
+    static int setTokenLastUsage(Connection& conn, std::string_view owner, std::string_view token, std::time_t last_usage);
 
     [[nodiscard]] static std::pair<std::string, int> getEncodedPassword(std::string_view password);
 };
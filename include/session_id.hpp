@@ -6,39 +6,54 @@
 #define SECUREWEBPASS_SESSION_ID_HPP
 
 #include <array>
-#include <ctime>
+#include <cstdint>
+#include <cstdlib>
 #include <iostream>
-#include <random>
 #include <string_view>
+#include <openssl/rand.h>
 
+// Maps 6 random bits to the URL and cookie safe base64 alphabet
+// "A-Za-z0-9-_" without a table lookup, so the compiler can map a
+// whole id with vector instructions.
 constexpr auto mk_printable(uint8_t bits) -> char {
-    constexpr std::string_view table = "0123465789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz=-";
-    static_assert(table.size() == 64);
-    return table[+bits];
+    int c = bits + 'A';
+    c += (bits >= 26) * ('a' - 'A' - 26);
+    c -= (bits >= 52) * ('a' - '0' + 26);
+    c += (bits >= 62) * ('-' - '0' - 10);
+    c += (bits >= 63) * ('_' - '-' - 1);
+    return static_cast<char>(c);
 }
 
+static_assert(mk_printable(0) == 'A' && mk_printable(25) == 'Z' && mk_printable(26) == 'a' && mk_printable(51) == 'z');
+static_assert(mk_printable(52) == '0' && mk_printable(61) == '9' && mk_printable(62) == '-' && mk_printable(63) == '_');
+
+// A random identifier of N printable characters, 6 bits of entropy each.
+// The bytes come from OpenSSL's DRBG, which keeps one generator per thread
+// and reseeds after a fork, so ids can be drawn from any thread at once.
 template <std::size_t N, class = std::enable_if_t<(N % 8) == 0>> class SessionId {
-    inline static std::ranlux48 eng;
-    inline static bool eng_init = false;
+    static constexpr std::size_t RANDOM_BYTES = N / 4 * 3;
 
     std::array<char, N> storage{};
 
   public:
     SessionId() {
-        if (!eng_init) {
-            eng_init = true;
-            std::random_device rd;
-            std::seed_seq sseq({(int)rd(), (int)std::time(nullptr)});
-            eng = std::ranlux48{sseq};
+        // Draw the random bytes into the tail of the storage, then spread
+        // each 3 bytes over 4 sextets from the front: a group's output never
+        // overtakes the bytes it still has to read.
+        auto* const bytes = reinterpret_cast<unsigned char*>(storage.data() + N - RANDOM_BYTES);
+        if (RAND_bytes(bytes, RANDOM_BYTES) != 1) {
+            std::cerr << "Cannot draw random bytes for an identifier" << std::endl;
+            std::abort();
         }
-
-        for (int i = 0; i < (N / 8); ++i) {
-            auto bits = eng();
-            for (int j = 0; j < 8; ++j) {
-                storage[i * 8 + j] = mk_printable(static_cast<uint8_t>(bits & 0x3f));
-                bits >>= 6;
-            }
+        for (std::size_t i = 0, j = 0; i < RANDOM_BYTES; i += 3, j += 4) {
+            const std::uint32_t group = bytes[i] << 16 | bytes[i + 1] << 8 | bytes[i + 2];
+            storage[j] = static_cast<char>(group >> 18 & 0x3f);
+            storage[j + 1] = static_cast<char>(group >> 12 & 0x3f);
+            storage[j + 2] = static_cast<char>(group >> 6 & 0x3f);
+            storage[j + 3] = static_cast<char>(group & 0x3f);
         }
+        for (auto& c : storage)
+            c = mk_printable(static_cast<uint8_t>(c));
     }
 
     [[nodiscard]] constexpr std::string_view view() const noexcept { return {storage.data(), storage.size()}; }
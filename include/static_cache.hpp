@@ -0,0 +1,239 @@
+#ifndef SECUREWEBPASS_STATIC_CACHE_HPP
+#define SECUREWEBPASS_STATIC_CACHE_HPP
+
+#include <chrono>
+#include <filesystem>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+
+namespace swp {
+
+// A response body sharing an immutable buffer, so cached content is sent
+// without being copied.
+struct SharedBufferBody {
+    using value_type = std::shared_ptr<const std::string>;
+
+    static std::uint64_t size(const value_type& body) { return body ? body->size() : 0; }
+
+    class writer {
+        const value_type& body_;
+
+      public:
+        using const_buffers_type = boost::asio::const_buffer;
+
+        template <bool isRequest, class Fields>
+        explicit writer(const boost::beast::http::header<isRequest, Fields>&, const value_type& body) : body_(body) {}
+
+        void init(boost::beast::error_code& ec) { ec = {}; }
+
+        boost::optional<std::pair<const_buffers_type, bool>> get(boost::beast::error_code& ec) {
+            ec = {};
+            if (!body_)
+                return boost::none;
+            return {{const_buffers_type(body_->data(), body_->size()), false}};
+        }
+    };
+};
+
+// A cached file, along with the precompressed variants found next to it.
+struct StaticAsset {
+    std::string mime;
+    SharedBufferBody::value_type identity;
+    SharedBufferBody::value_type gzip; // from "<path>.gz", if any
+    SharedBufferBody::value_type br;   // from "<path>.br", if any
+
+    [[nodiscard]] bool has_variants() const noexcept { return gzip || br; }
+
+    // Picks the smallest variant the client accepts, br on a tie; returns it with its Content-Encoding.
+    [[nodiscard]] std::pair<SharedBufferBody::value_type, boost::beast::string_view> select(boost::beast::string_view accept_encoding) const {
+        std::pair<SharedBufferBody::value_type, boost::beast::string_view> best{identity, {}};
+        if (br && br->size() < best.first->size() && accepts(accept_encoding, "br"))
+            best = {br, "br"};
+        if (gzip && gzip->size() < best.first->size() && accepts(accept_encoding, "gzip"))
+            best = {gzip, "gzip"};
+        return best;
+    }
+
+  private:
+    // True when the Accept-Encoding list names coding without a zero quality.
+    static bool accepts(boost::beast::string_view accept_encoding, boost::beast::string_view coding) {
+        for (const auto& [name, params] : boost::beast::http::ext_list{accept_encoding}) {
+            if (!boost::beast::iequals(name, coding))
+                continue;
+            for (const auto& [key, value] : params)
+                if (boost::beast::iequals(key, "q"))
+                    return value.find_first_not_of("0.") != boost::beast::string_view::npos;
+            return true;
+        }
+        return false;
+    }
+};
+
+// Keeps the files served from the doc root in memory, least recently used
+// first out once `capacity` bytes are held. A cached file is checked against
+// its modification time, and its siblings', at most once per `revalidate`,
+// so a warm hit costs no system call at all.
+class StaticCache {
+    using clock = std::chrono::steady_clock;
+    using file_time = std::filesystem::file_time_type;
+
+    struct Stamp {
+        file_time identity;
+        file_time gzip;
+        file_time br;
+
+        bool operator==(const Stamp& other) const { return identity == other.identity && gzip == other.gzip && br == other.br; }
+    };
+
+    struct Slot {
+        std::string path;
+        std::shared_ptr<const StaticAsset> asset;
+        Stamp stamp;
+        std::size_t bytes;
+        clock::time_point checked;
+    };
+
+    std::size_t capacity;
+    std::size_t max_file_size;
+    clock::duration revalidate;
+    boost::beast::string_view (*mime_type)(boost::beast::string_view);
+
+    std::mutex mutex;
+    std::list<Slot> lru; // most recently used first
+    std::unordered_map<std::string_view, std::list<Slot>::iterator> index; // keys view the slots' paths
+    std::size_t bytes = 0;
+
+    static file_time mtime(const std::string& path, std::error_code& ec) {
+        auto const time = std::filesystem::last_write_time(path, ec);
+        return ec ? file_time::min() : time;
+    }
+
+    static Stamp stamp(const std::string& path, boost::beast::error_code& ec) {
+        std::error_code fs_ec, ignored;
+        Stamp stamp{mtime(path, fs_ec), mtime(path + ".gz", ignored), mtime(path + ".br", ignored)};
+        if (fs_ec)
+            ec = fs_ec == std::errc::no_such_file_or_directory ? boost::beast::errc::make_error_code(boost::beast::errc::no_such_file_or_directory)
+                                                               : boost::beast::errc::make_error_code(boost::beast::errc::io_error);
+        return stamp;
+    }
+
+    // Reads a whole file; a missing or oversized file yields nullptr.
+    SharedBufferBody::value_type read(const std::string& path, boost::beast::error_code& ec) const {
+        boost::beast::file file;
+        file.open(path.c_str(), boost::beast::file_mode::scan, ec);
+        if (ec)
+            return nullptr;
+        auto const size = file.size(ec);
+        if (ec || size > max_file_size)
+            return nullptr;
+        auto content = std::make_shared<std::string>(size, '\0');
+        for (std::size_t offset = 0; offset < size && !ec;) {
+            auto const n = file.read(content->data() + offset, size - offset, ec);
+            if (n == 0)
+                break;
+            offset += n;
+        }
+        return ec ? nullptr : std::move(content);
+    }
+
+    // With the mutex held.
+    void drop(decltype(index)::iterator it) {
+        bytes -= it->second->bytes;
+        auto const stale = it->second;
+        index.erase(it);
+        lru.erase(stale);
+    }
+
+    // Forgets a file which can't be served any more, so it doesn't hold its bytes
+    // until it ages out.
+    void erase(std::string_view path) {
+        std::lock_guard lock{mutex};
+        if (auto it = index.find(path); it != index.end())
+            drop(it);
+    }
+
+    void insert(Slot slot) {
+        std::lock_guard lock{mutex};
+        if (auto it = index.find(slot.path); it != index.end())
+            drop(it);
+        bytes += slot.bytes;
+        lru.push_front(std::move(slot));
+        index.emplace(lru.front().path, lru.begin());
+        while (bytes > capacity && !lru.empty()) {
+            bytes -= lru.back().bytes;
+            index.erase(lru.back().path);
+            lru.pop_back();
+        }
+    }
+
+  public:
+    StaticCache(std::size_t capacity, std::size_t max_file_size, clock::duration revalidate, boost::beast::string_view (*mime_type)(boost::beast::string_view))
+        : capacity(capacity), max_file_size(max_file_size), revalidate(revalidate), mime_type(mime_type) {}
+
+    StaticCache(const StaticCache&) = delete;
+
+    StaticCache& operator=(const StaticCache&) = delete;
+
+    // Returns the file at path, loading it on a miss. Returns nullptr with ec set
+    // when it can't be read, and nullptr alone when it is too large to be cached.
+    // A warm hit doesn't copy path.
+    std::shared_ptr<const StaticAsset> get(std::string_view path, boost::beast::error_code& ec) {
+        ec = {};
+        auto const now = clock::now();
+        std::shared_ptr<const StaticAsset> cached;
+        Stamp cached_stamp{};
+        {
+            std::lock_guard lock{mutex};
+            if (auto it = index.find(path); it != index.end()) {
+                lru.splice(lru.begin(), lru, it->second);
+                auto& slot = *it->second;
+                if (now - slot.checked < revalidate)
+                    return slot.asset;
+                cached = slot.asset;
+                cached_stamp = slot.stamp;
+            }
+        }
+
+        std::string file(path);
+        auto const current = stamp(file, ec);
+        if (ec) {
+            if (cached)
+                erase(path);
+            return nullptr;
+        }
+        if (cached && current == cached_stamp) {
+            std::lock_guard lock{mutex};
+            if (auto it = index.find(path); it != index.end())
+                it->second->checked = now;
+            return cached;
+        }
+
+        auto asset = std::make_shared<StaticAsset>();
+        asset->identity = read(file, ec);
+        if (!asset->identity) {
+            if (cached)
+                erase(path);
+            return nullptr;
+        }
+        boost::beast::error_code ignored;
+        if (current.gzip != file_time::min())
+            asset->gzip = read(file + ".gz", ignored);
+        if (current.br != file_time::min())
+            asset->br = read(file + ".br", ignored);
+        asset->mime = std::string(mime_type(file));
+
+        auto const size = SharedBufferBody::size(asset->identity) + SharedBufferBody::size(asset->gzip) + SharedBufferBody::size(asset->br);
+        insert({std::move(file), asset, current, size, now});
+        return asset;
+    }
+};
+} // namespace swp
+
+#endif // SECUREWEBPASS_STATIC_CACHE_HPP
@@ -0,0 +1,137 @@
+#ifndef SECUREWEBPASS_TLS_RESUMPTION_HPP
+#define SECUREWEBPASS_TLS_RESUMPTION_HPP
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <shared_mutex>
+#include <boost/asio/ssl/context.hpp>
+#include <openssl/core_names.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+
+namespace swp {
+
+struct TlsStats {
+    std::uint64_t full;    // handshakes which negotiated a new session
+    std::uint64_t resumed; // handshakes which resumed one, from the cache or a ticket
+};
+
+// Lets returning clients skip the full handshake. TLS 1.2 clients resume from
+// the server's session cache, and both TLS 1.2 and 1.3 clients from session
+// tickets. Tickets are sealed with keys held in memory only: rotate() makes a
+// new key current and keeps the previous one to accept the tickets it sealed,
+// so a ticket lives for at most two rotation intervals.
+class TlsResumption {
+    struct TicketKey {
+        std::array<unsigned char, 16> name;
+        std::array<unsigned char, 32> aes;
+        std::array<unsigned char, 32> hmac;
+    };
+
+    static constexpr std::size_t TICKET_KEYS = 2;
+
+    mutable std::shared_mutex mutex;
+    std::deque<TicketKey> keys; // current key first
+    std::atomic<std::uint64_t> full{0};
+    std::atomic<std::uint64_t> resumed{0};
+
+    static int index() {
+        static const int idx = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+        return idx;
+    }
+
+    static TlsResumption* from(SSL_CTX* ctx) { return static_cast<TlsResumption*>(SSL_CTX_get_ex_data(ctx, index())); }
+
+    // Seals new tickets with the current key (enc = 1) and opens presented ones
+    // with whichever key sealed them. Returns 0 for an unknown key, which makes
+    // the client do a full handshake, and 2 to have an old ticket renewed.
+    static int ticket_key_cb(SSL* ssl, unsigned char key_name[16], unsigned char iv[EVP_MAX_IV_LENGTH], EVP_CIPHER_CTX* cipher, EVP_MAC_CTX* mac,
+                             int enc) {
+        auto* self = from(SSL_get_SSL_CTX(ssl));
+        std::shared_lock lock{self->mutex};
+        const auto init_mac = [mac](const TicketKey& key) {
+            OSSL_PARAM params[] = {OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, const_cast<unsigned char*>(key.hmac.data()), key.hmac.size()),
+                                   OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, const_cast<char*>("SHA256"), 0),
+                                   OSSL_PARAM_construct_end()};
+            return EVP_MAC_CTX_set_params(mac, params) == 1;
+        };
+
+        if (enc) {
+            const auto& key = self->keys.front();
+            const auto iv_len = EVP_CIPHER_get_iv_length(EVP_aes_256_cbc());
+            if (RAND_bytes(iv, iv_len) != 1)
+                return -1;
+            std::memcpy(key_name, key.name.data(), key.name.size());
+            if (EVP_EncryptInit_ex(cipher, EVP_aes_256_cbc(), nullptr, key.aes.data(), iv) != 1 || !init_mac(key))
+                return -1;
+            return 1;
+        }
+
+        const auto key = std::find_if(self->keys.begin(), self->keys.end(),
+                                      [key_name](const TicketKey& key) { return std::memcmp(key.name.data(), key_name, key.name.size()) == 0; });
+        if (key == self->keys.end())
+            return 0;
+        if (EVP_DecryptInit_ex(cipher, EVP_aes_256_cbc(), nullptr, key->aes.data(), iv) != 1 || !init_mac(*key))
+            return -1;
+        return key == self->keys.begin() ? 1 : 2;
+    }
+
+  public:
+    TlsResumption() { rotate(); }
+
+    TlsResumption(const TlsResumption&) = delete;
+
+    TlsResumption& operator=(const TlsResumption&) = delete;
+
+    // Enables the session cache and the tickets on ctx, which must not outlive this object.
+    void attach(boost::asio::ssl::context& ctx, std::size_t cache_size, std::chrono::seconds lifetime) {
+        SSL_CTX* handle = ctx.native_handle();
+        SSL_CTX_set_ex_data(handle, index(), this);
+        SSL_CTX_set_session_cache_mode(handle, SSL_SESS_CACHE_SERVER);
+        SSL_CTX_sess_set_cache_size(handle, static_cast<long>(cache_size));
+        SSL_CTX_set_timeout(handle, static_cast<long>(lifetime.count()));
+        constexpr unsigned char id_context[] = "swp";
+        SSL_CTX_set_session_id_context(handle, id_context, sizeof(id_context) - 1);
+        SSL_CTX_set_tlsext_ticket_key_evp_cb(handle, &TlsResumption::ticket_key_cb);
+    }
+
+    // Makes a fresh ticket key current.
+    void rotate() {
+        TicketKey key{};
+        if (RAND_bytes(key.name.data(), key.name.size()) != 1 || RAND_bytes(key.aes.data(), key.aes.size()) != 1 ||
+            RAND_bytes(key.hmac.data(), key.hmac.size()) != 1) {
+            std::cerr << "Cannot draw a new session ticket key, keeping the current one" << std::endl;
+            return;
+        }
+        std::unique_lock lock{mutex};
+        keys.push_front(key);
+        if (keys.size() > TICKET_KEYS)
+            keys.pop_back();
+    }
+
+    // Counts a completed handshake of ssl.
+    void record(SSL* ssl) noexcept {
+        if (SSL_session_reused(ssl))
+            resumed.fetch_add(1, std::memory_order_relaxed);
+        else
+            full.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Counts a completed handshake, for the context ssl was created from.
+    static void record_handshake(SSL* ssl) noexcept {
+        if (auto* self = from(SSL_get_SSL_CTX(ssl)))
+            self->record(ssl);
+    }
+
+    [[nodiscard]] TlsStats stats() const noexcept { return {full.load(std::memory_order_relaxed), resumed.load(std::memory_order_relaxed)}; }
+};
+} // namespace swp
+
+#endif // SECUREWEBPASS_TLS_RESUMPTION_HPP
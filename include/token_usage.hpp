@@ -0,0 +1,96 @@
+#ifndef SECUREWEBPASS_TOKEN_USAGE_HPP
+#define SECUREWEBPASS_TOKEN_USAGE_HPP
+
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace swp {
+
+// Collects token last-usage timestamps in memory so they can be written back
+// in one batched transaction instead of one UPDATE per request. A token is
+// recorded at most once per `resolution` seconds; later uses within that
+// window are dropped, which bounds both the memory and the write volume.
+class TokenUsageBuffer {
+  public:
+    struct Usage {
+        std::string owner;
+        std::string token;
+        std::time_t last_usage;
+    };
+
+  private:
+    struct Entry {
+        std::time_t recorded;
+        bool pending;
+    };
+
+    std::mutex mutex;
+    std::unordered_map<std::string, Entry> entries; // "owner\0token" -> last recorded use
+    std::size_t pending = 0;
+    std::time_t resolution;
+    std::size_t flush_threshold;
+
+    static const std::string& key(std::string_view owner, std::string_view token) {
+        thread_local std::string buffer;
+        buffer.clear();
+        buffer.append(owner);
+        buffer += '\0';
+        buffer.append(token);
+        return buffer;
+    }
+
+  public:
+    explicit TokenUsageBuffer(std::time_t resolution = 60, std::size_t flush_threshold = 256)
+        : resolution(resolution), flush_threshold(flush_threshold) {}
+
+    void configure(std::time_t resolution_, std::size_t flush_threshold_) {
+        std::lock_guard lock{mutex};
+        resolution = resolution_;
+        flush_threshold = flush_threshold_;
+    }
+
+    // Returns true once enough usages are pending that the caller should flush.
+    bool record(std::string_view owner, std::string_view token, std::time_t now = std::time(nullptr)) {
+        const auto& k = key(owner, token);
+        std::lock_guard lock{mutex};
+        auto [it, inserted] = entries.try_emplace(k, Entry{now, true});
+        if (!inserted) {
+            if (now - it->second.recorded < resolution)
+                return false;
+            it->second.recorded = now;
+            if (it->second.pending)
+                return false;
+            it->second.pending = true;
+        }
+        return ++pending >= flush_threshold;
+    }
+
+    // Hands out the pending usages and forgets tokens idle for a whole resolution window.
+    std::vector<Usage> take(std::time_t now = std::time(nullptr)) {
+        std::vector<Usage> usages;
+        std::lock_guard lock{mutex};
+        usages.reserve(pending);
+        for (auto it = entries.begin(); it != entries.end();) {
+            auto& [k, entry] = *it;
+            if (entry.pending) {
+                const auto sep = k.find('\0');
+                usages.push_back({k.substr(0, sep), k.substr(sep + 1), entry.recorded});
+                entry.pending = false;
+                ++it;
+            } else if (now - entry.recorded >= resolution) {
+                it = entries.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        pending = 0;
+        return usages;
+    }
+};
+} // namespace swp
+
+#endif // SECUREWEBPASS_TOKEN_USAGE_HPP
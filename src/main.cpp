@@ -1,16 +1,83 @@
+#include <cstring>
 #include <iostream>
+#include <optional>
+#include <boost/asio/signal_set.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/filesystem/path.hpp>
 #include "http_server_async_ssl.hpp"
+#include "periodic_timer.hpp"
 #include "server_db.hpp"
 
 constexpr auto DATABASE_FILENAME = "server.db";
+constexpr auto KDF_WORKERS = 4;
+constexpr auto KDF_MEMORY_BUDGET = std::size_t{256} << 20; // at most 4 concurrent argon2 hashes
+constexpr auto KDF_QUEUE_LIMIT = 64;
+constexpr auto KDF_STATS_INTERVAL = std::chrono::minutes(5);
+constexpr auto TOKEN_USAGE_RESOLUTION = 60; // seconds between two recorded uses of the same token
+constexpr auto TOKEN_USAGE_FLUSH_THRESHOLD = 256;
+constexpr auto TOKEN_USAGE_FLUSH_INTERVAL = std::chrono::seconds(10);
+constexpr auto SESSION_REAPER_INTERVAL = std::chrono::minutes(1);
+constexpr std::size_t SESSION_REAPER_BATCH = 500;
+constexpr auto TLS_GROUPS = "X25519:P-256";
+constexpr auto TLS12_CIPHERS = "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384:"
+                               "ECDHE-ECDSA-CHACHA20-POLY1305:ECDHE-RSA-CHACHA20-POLY1305";
+constexpr std::size_t TLS_SESSION_CACHE_SIZE = 20480;
+constexpr auto TLS_SESSION_LIFETIME = std::chrono::hours(2);
+constexpr auto TLS_TICKET_KEY_ROTATION = std::chrono::hours(1); // a ticket stays valid for up to two rotations
+constexpr auto TLS_STATS_INTERVAL = std::chrono::minutes(5);
+constexpr std::size_t STATIC_CACHE_CAPACITY = std::size_t{64} << 20;
+constexpr std::size_t STATIC_CACHE_MAX_FILE = std::size_t{4} << 20; // larger files are streamed from the disk
+constexpr auto STATIC_CACHE_REVALIDATE = std::chrono::seconds(2);
+constexpr std::pair<std::string_view, std::string_view> EXTRA_MIME_TYPES[] = {
+    {".wasm", "application/wasm"},
+    {".webp", "image/webp"},
+    {".woff2", "font/woff2"},
+};
+constexpr swp::RequestLimits REQUEST_LIMITS{
+    8 * 1024,                // header
+    16 * 1024,               // API request body
+    0,                       // static file request body
+    std::uint64_t{64} << 20, // vault upload
+    1 << 20,                 // ranged vault write
+    16 << 20,                // vault batch
+    8                        // pipelined requests
+};
 
 namespace bfs = boost::filesystem;
 
+// How the I/O threads share the connections: all of them run one io_context
+// fed by one acceptor, or each runs an io_context of its own with its own
+// SO_REUSEPORT acceptor, so a connection stays on the thread which accepted it
+// for its lifetime. Pinned, each of those threads also stays on one core.
+enum class IoMode { shared, reuseport, reuseport_pinned };
+
+std::optional<IoMode> parse_io_mode(std::string_view name) {
+    if (name == "shared")
+        return IoMode::shared;
+    if (name == "reuseport")
+        return IoMode::reuseport;
+    if (name == "reuseport-pinned")
+        return IoMode::reuseport_pinned;
+    return std::nullopt;
+}
+
+// Keeps the calling thread on one core, best effort: a thread which cannot be
+// pinned still runs, wherever the scheduler puts it.
+void pin_to_core(unsigned index) {
+#ifdef __linux__
+    cpu_set_t cores;
+    CPU_ZERO(&cores);
+    CPU_SET(index % std::max(1u, std::thread::hardware_concurrency()), &cores);
+    if (int const rc = pthread_setaffinity_np(pthread_self(), sizeof(cores), &cores); rc != 0)
+        std::cerr << "Cannot pin I/O thread " << index << ": " << std::strerror(rc) << std::endl;
+#else
+    boost::ignore_unused(index);
+#endif
+}
+
 using namespace std::literals;
 
-inline void load_server_certificate(boost::asio::ssl::context& ctx, std::string_view cert_path, std::string_view key_path, std::string_view dh_path) {
+inline void load_server_certificate(boost::asio::ssl::context& ctx, std::string_view cert_path, std::string_view key_path) {
     constexpr auto getFileData = [](std::string_view path) {
         bfs::path p{path.data()};
         bfs::ifstream ifs{p};
@@ -22,56 +89,146 @@ inline void load_server_certificate(boost::asio::ssl::context& ctx, std::string_
     };
     auto const cert = getFileData(cert_path);
     auto const key = getFileData(key_path);
-    auto const dh = getFileData(dh_path);
 
-    if (cert.empty() || key.empty() || dh.empty()) {
+    if (cert.empty() || key.empty()) {
         std::cerr << "One or more certificate files cannot be found" << std::endl;
         exit(124);
     }
 
     ctx.set_password_callback([](std::size_t, boost::asio::ssl::context_base::password_purpose) { return "test"; });
 
-    ctx.set_options(boost::asio::ssl::context::default_workarounds | boost::asio::ssl::context::no_sslv2 | boost::asio::ssl::context::single_dh_use);
+    ctx.set_options(boost::asio::ssl::context::default_workarounds | boost::asio::ssl::context::no_sslv2 | boost::asio::ssl::context::no_sslv3 |
+                    boost::asio::ssl::context::no_tlsv1 | boost::asio::ssl::context::no_tlsv1_1);
+
+    // TLS 1.2 and 1.3 only, with elliptic curve key exchange: far cheaper than finite-field DH
+    SSL_CTX_set_min_proto_version(ctx.native_handle(), TLS1_2_VERSION);
+    SSL_CTX_set1_groups_list(ctx.native_handle(), TLS_GROUPS);
+    SSL_CTX_set_cipher_list(ctx.native_handle(), TLS12_CIPHERS);
 
     ctx.use_certificate_chain(boost::asio::buffer(cert.data(), cert.size()));
 
     ctx.use_private_key(boost::asio::buffer(key.data(), key.size()), boost::asio::ssl::context::file_format::pem);
+}
 
-    ctx.use_tmp_dh(boost::asio::buffer(dh.data(), dh.size()));
+// Deletes the expired sessions one bounded batch at a time. Each further batch
+// is posted back to the io_context so requests get served in between.
+void reap_sessions(net::io_context& ioc, swp::ServerDB& db, std::size_t removed = 0) {
+    auto const [count, rc] = db.reapExpiredSessions(SESSION_REAPER_BATCH);
+    if (rc != SQLITE_OK) {
+        std::cerr << "Session reaper failed after removing " << removed << " expired sessions" << std::endl;
+        return;
+    }
+    removed += count;
+    if (count == SESSION_REAPER_BATCH)
+        return net::post(ioc, [&ioc, &db, removed] { reap_sessions(ioc, db, removed); });
+    std::cout << "Session reaper removed " << removed << " expired sessions" << std::endl;
 }
 
 int main(int argc, char* argv[]) {
-    swp::ServerDB db(DATABASE_FILENAME);
     auto const address = net::ip::make_address("0.0.0.0");
     auto const port = static_cast<unsigned short>(8080);
     auto const doc_root = std::make_shared<std::string>(".");
     auto const threads = std::max<int>(1, atoi(argv[4])); // NOLINT(cert-err34-c)
-    auto constexpr cert_path = "cert.pem"sv, key_path = "key.pem"sv, dh_path = "dh.pem"sv;
+    auto const io_mode = argc > 5 ? parse_io_mode(argv[5]) : IoMode::shared;
+    if (!io_mode) {
+        std::cerr << "Unknown I/O mode '" << argv[5] << "': expected shared, reuseport or reuseport-pinned" << std::endl;
+        return EXIT_FAILURE;
+    }
+    auto const per_thread = *io_mode != IoMode::shared;
+    auto constexpr cert_path = "cert.pem"sv, key_path = "key.pem"sv;
 
-    // The io_context is required for all I/O
-    net::io_context ioc{threads};
+    // One connection per I/O thread so database calls never wait on each other's connection
+    swp::ServerDB db(DATABASE_FILENAME, threads);
+    db.configureTokenUsage(TOKEN_USAGE_RESOLUTION, TOKEN_USAGE_FLUSH_THRESHOLD);
+
+    // The io_context is required for all I/O: one shared by the threads, or one for each
+    std::vector<std::unique_ptr<net::io_context>> contexts;
+    for (auto i = per_thread ? threads : 1; i > 0; --i)
+        contexts.push_back(std::make_unique<net::io_context>(per_thread ? 1 : threads));
+    // Runs the background tasks below
+    auto& ioc = *contexts.front();
+
+    // Password hashing runs on its own bounded pool, away from the I/O threads
+    swp::KdfExecutor kdf{KDF_WORKERS, KDF_MEMORY_BUDGET, swp::ARGON2_MEMORY, KDF_QUEUE_LIMIT};
+
+    // Content types served on top of the built-in ones
+    for (auto const& [ext, type] : EXTRA_MIME_TYPES)
+        swp::mime_types().add(ext, std::string(type));
+
+    // Files of the doc root, kept in memory
+    swp::StaticCache assets{STATIC_CACHE_CAPACITY, STATIC_CACHE_MAX_FILE, STATIC_CACHE_REVALIDATE, &mime_type};
+
+    // Session cache and ticket keys, shared by every connection of the context below
+    swp::TlsResumption tls;
 
     // The SSL context is required, and holds certificates
-    ssl::context ctx{ssl::context::tlsv12};
+    ssl::context ctx{ssl::context::tls_server};
 
     // This holds the self-signed certificate used by the server
-    load_server_certificate(ctx, cert_path, key_path, dh_path);
-
-    // Create and launch a listening port
-    std::make_shared<listener>(ioc, ctx, tcp::endpoint{address, port}, doc_root, db)->run();
+    load_server_certificate(ctx, cert_path, key_path);
+
+    // HTTP/2 for the clients which offer it, HTTP/1.1 for the others
+    swp::http2::enable_alpn(ctx);
+    tls.attach(ctx, TLS_SESSION_CACHE_SIZE, TLS_SESSION_LIFETIME);
+
+    // Create and launch a listening port, for each io_context
+    for (auto& context : contexts)
+        std::make_shared<listener>(*context, ctx, tcp::endpoint{address, port}, doc_root, db, kdf, assets, REQUEST_LIMITS, per_thread)->run();
+
+    // Write token last usages behind the requests
+    std::make_shared<swp::PeriodicTimer>(ioc, TOKEN_USAGE_FLUSH_INTERVAL, [&db] { db.flushTokenUsage(); })->run();
+
+    // Expired sessions are never read again: delete them in the background
+    std::make_shared<swp::PeriodicTimer>(ioc, SESSION_REAPER_INTERVAL, [&ioc, &db] { reap_sessions(ioc, db); })->run();
+
+    // Tickets sealed with a key older than the previous one are refused
+    std::make_shared<swp::PeriodicTimer>(ioc, TLS_TICKET_KEY_ROTATION, [&tls] { tls.rotate(); })->run();
+
+    std::make_shared<swp::PeriodicTimer>(ioc, TLS_STATS_INTERVAL, [&tls] {
+        const auto stats = tls.stats();
+        std::cout << "TLS handshakes: " << stats.full << " full, " << stats.resumed << " resumed" << std::endl;
+    })->run();
+
+    std::make_shared<swp::PeriodicTimer>(ioc, KDF_STATS_INTERVAL, [&kdf] {
+        using std::chrono::duration_cast, std::chrono::milliseconds;
+        const auto stats = kdf.stats();
+        std::cout << "Password hashing: " << stats.queued << " queued, " << stats.running << " running, " << stats.completed << " completed, "
+                  << stats.rejected << " rejected, " << duration_cast<milliseconds>(stats.average_wait()).count() << " ms average wait (max "
+                  << duration_cast<milliseconds>(stats.max_wait).count() << " ms), " << duration_cast<milliseconds>(stats.average_run()).count()
+                  << " ms average run" << std::endl;
+    })->run();
+
+    // Stop cleanly on SIGINT/SIGTERM so pending writes reach the database
+    net::signal_set signals{ioc, SIGINT, SIGTERM};
+    signals.async_wait([&contexts](beast::error_code, int) {
+        for (auto& context : contexts)
+            context->stop();
+    });
 
     // Run the I/O service on the requested number of threads
+    auto const pinned = *io_mode == IoMode::reuseport_pinned;
     std::vector<std::thread> v;
     v.reserve(threads - 1);
     for (auto i = threads - 1; i > 0; --i)
-        v.emplace_back([&ioc] { ioc.run(); });
+        v.emplace_back([&context = per_thread ? *contexts[i] : ioc, pinned, i] {
+            if (pinned)
+                pin_to_core(i);
+            context.run();
+        });
 
     std::cout << "Server listening on " << address.to_string() << ":" << port << " with " << threads << " thread";
     if (threads > 1)
-        std::cout << "s" << std::endl;
+        std::cout << "s";
+    if (per_thread)
+        std::cout << ", an io_context and an acceptor each" << (pinned ? ", pinned" : "");
     std::cout << std::endl << "Serving " << doc_root->c_str() << std::endl;
 
+    if (pinned)
+        pin_to_core(0);
     ioc.run();
 
+    for (auto& t : v)
+        t.join();
+
     return EXIT_SUCCESS;
 }
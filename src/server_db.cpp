@@ -2,115 +2,373 @@
 // Created by hugo on 13.12.19.
 //
 #include "server_db.hpp"
+#include <charconv>
+#include "response_pool.hpp"
 
 using namespace std::literals;
 
 namespace swp {
 
-int ServerDB::error(int rc) {
+// Migration i upgrades the schema from `PRAGMA user_version` i to i + 1.
+// Shipped migrations must never change: append a new one instead.
+constexpr std::array<std::string_view, 5> MIGRATIONS = {
+    // 1: initial schema; a no-op on databases created before versioning
+    "CREATE TABLE IF NOT EXISTS users ("
+    "`username` TEXT NOT NULL UNIQUE,"
+    "`password` TEXT NOT NULL);"
+    "CREATE TABLE IF NOT EXISTS vaults ("
+    "`name` TEXT NOT NULL,"
+    "`owner` TEXT NOT NULL,"
+    "`group` TEXT,"
+    "`data` BLOB,"
+    "UNIQUE ( `name`, `owner` ) ON CONFLICT FAIL);"
+    "CREATE TABLE IF NOT EXISTS session_ids ("
+    "`owner` TEXT NOT NULL,"
+    "`value` TEXT NOT NULL,"
+    "`creation_date` TEXT NOT NULL,"
+    "`expiration_date` TEXT NOT NULL);"
+    "CREATE TABLE IF NOT EXISTS tokens ("
+    "`owner` TEXT NOT NULL,"
+    "`name` TEXT NOT NULL,"
+    "`token` TEXT NOT NULL,"
+    "`creation_date` TEXT NOT NULL,"
+    "`last_usage` TEXT);"sv,
+    // 2: session expirations as integer epochs, and indexes for the authentication lookups
+    "CREATE TABLE session_ids_v2 ("
+    "`owner` TEXT NOT NULL,"
+    "`value` TEXT NOT NULL,"
+    "`creation_date` TEXT NOT NULL,"
+    "`expiration_date` INTEGER NOT NULL);"
+    "INSERT INTO session_ids_v2 SELECT `owner`,`value`,`creation_date`,CAST(strftime('%s', `expiration_date`) AS INTEGER) FROM session_ids;"
+    "DROP TABLE session_ids;"
+    "ALTER TABLE session_ids_v2 RENAME TO session_ids;"
+    "CREATE INDEX session_ids_owner_value ON session_ids (`owner`, `value`, `expiration_date`);"
+    "CREATE INDEX session_ids_expiration ON session_ids (`expiration_date`);"
+    "CREATE INDEX tokens_owner_token ON tokens (`owner`, `token`);"
+    "CREATE INDEX tokens_owner_name ON tokens (`owner`, `name`);"sv,
+    // 3: vault listings page through the names of one owner in order
+    "CREATE INDEX vaults_owner_name ON vaults (`owner`, `name`);"sv,
+    // 4: content hashes and versions, which the (owner, name) index now covers so a
+    // conditional request reads them without reaching the row and its blob. Vaults
+    // stored before get their hash when the database is opened, see backfillVaultHashes
+    "ALTER TABLE vaults ADD COLUMN `hash` TEXT;"
+    "ALTER TABLE vaults ADD COLUMN `version` INTEGER NOT NULL DEFAULT 1;"
+    "DROP INDEX vaults_owner_name;"
+    "CREATE INDEX vaults_owner_name ON vaults (`owner`, `name`, `hash`, `version`);"sv,
+    // 5: the last change of each vault, deletions included, numbered by a sequence of
+    // its owner. Triggers keep it up to date from every write to vaults, staging rows
+    // aside; the index covers a listing of the changes since a sequence
+    "CREATE TABLE vault_changes ("
+    "`owner` TEXT NOT NULL,"
+    "`name` TEXT NOT NULL,"
+    "`seq` INTEGER NOT NULL,"
+    "`hash` TEXT,"
+    "`deleted` INTEGER NOT NULL DEFAULT 0,"
+    "PRIMARY KEY (`owner`, `name`)) WITHOUT ROWID;"
+    "CREATE INDEX vault_changes_owner_seq ON vault_changes (`owner`, `seq`, `deleted`, `hash`);"
+    "INSERT INTO vault_changes (`owner`, `name`, `seq`, `hash`) "
+    "SELECT `owner`, `name`, row_number() OVER (PARTITION BY `owner` ORDER BY rowid), `hash` FROM vaults WHERE substr(`owner`, 1, 1) <> char(10);"
+    "CREATE TRIGGER vaults_insert_change AFTER INSERT ON vaults WHEN substr(NEW.`owner`, 1, 1) <> char(10) BEGIN "
+    "INSERT INTO vault_changes (`owner`, `name`, `seq`, `hash`, `deleted`) "
+    "VALUES (NEW.`owner`, NEW.`name`, (SELECT ifnull(max(`seq`), 0) + 1 FROM vault_changes WHERE `owner` = NEW.`owner`), NEW.`hash`, 0) "
+    "ON CONFLICT (`owner`, `name`) DO UPDATE SET `seq` = excluded.`seq`, `hash` = excluded.`hash`, `deleted` = 0; END;"
+    "CREATE TRIGGER vaults_update_change AFTER UPDATE OF `owner`, `data`, `version` ON vaults WHEN substr(NEW.`owner`, 1, 1) <> char(10) BEGIN "
+    "INSERT INTO vault_changes (`owner`, `name`, `seq`, `hash`, `deleted`) "
+    "VALUES (NEW.`owner`, NEW.`name`, (SELECT ifnull(max(`seq`), 0) + 1 FROM vault_changes WHERE `owner` = NEW.`owner`), NEW.`hash`, 0) "
+    "ON CONFLICT (`owner`, `name`) DO UPDATE SET `seq` = excluded.`seq`, `hash` = excluded.`hash`, `deleted` = 0; END;"
+    "CREATE TRIGGER vaults_delete_change AFTER DELETE ON vaults WHEN substr(OLD.`owner`, 1, 1) <> char(10) BEGIN "
+    "INSERT INTO vault_changes (`owner`, `name`, `seq`, `hash`, `deleted`) "
+    "VALUES (OLD.`owner`, OLD.`name`, (SELECT ifnull(max(`seq`), 0) + 1 FROM vault_changes WHERE `owner` = OLD.`owner`), NULL, 1) "
+    "ON CONFLICT (`owner`, `name`) DO UPDATE SET `seq` = excluded.`seq`, `hash` = NULL, `deleted` = 1; END;"sv,
+};
+
+// The row of a vault, without its content, which is read through incremental BLOB I/O.
+// Shared by getVault and batches, so they share the cached statement.
+constexpr auto VAULT_ROW_SQL = "SELECT rowid, length(`data`), ifnull(`hash`, ''), `version` FROM vaults WHERE `owner` = ? AND `name` = ?;"sv;
+
+int ServerDB::error(sqlite3* db, int rc) {
     std::cerr << "Code: " << rc << std::endl << "Message: " << sqlite3_errmsg(db) << std::endl;
     return rc;
 }
 
-ServerDB::ServerDB(const char* filename) {
-    int rc = open(filename);
+ServerDB::ServerDB(const char* filename, std::size_t connections) {
+    int rc = open(filename, connections);
     if (rc != SQLITE_OK)
-        std::cerr << "Can't initialize tables: " << sqlite3_errmsg(db) << std::endl;
+        std::cerr << "Can't initialize tables" << std::endl;
 }
 
 ServerDB::~ServerDB() {
-    int rc;
-    rc = sqlite3_close_v2(db);
-    if (rc != SQLITE_OK)
-        std::cerr << "Can't close database: " << sqlite3_errmsg(db) << std::endl;
+    if (int rc = flushTokenUsage(); rc != SQLITE_OK)
+        std::cerr << "Can't write back token usages" << std::endl;
 }
 
-int ServerDB::open(const char* filename) {
+int ServerDB::open(const char* filename, std::size_t connections) {
     int rc;
-    if (rc = sqlite3_open(filename, &db); rc != SQLITE_OK) {
-        std::cerr << "Can't open database: " << sqlite3_errmsg(db) << std::endl;
+    // The first connection creates the schema and switches the file to WAL
+    // before any other connection can observe it.
+    if (rc = pool.add(filename); rc != SQLITE_OK)
         return rc;
+
+    {
+        auto conn = pool.acquire();
+        if (rc = migrate(conn->handle()); rc != SQLITE_OK) {
+            std::cerr << "Can't migrate the database schema: " << sqlite3_errmsg(conn->handle()) << std::endl;
+            return rc;
+        }
     }
 
-    constexpr auto sql = "CREATE TABLE IF NOT EXISTS users ("
-                         "`username` TEXT NOT NULL UNIQUE,"
-                         "`password` TEXT NOT NULL);"
-                         "CREATE TABLE IF NOT EXISTS vaults ("
-                         "`name` TEXT NOT NULL,"
-                         "`owner` TEXT NOT NULL,"
-                         "`group` TEXT,"
-                         "`data` BLOB,"
-                         "UNIQUE ( `name`, `owner` ) ON CONFLICT FAIL);"
-                         "CREATE TABLE IF NOT EXISTS session_ids ("
-                         "`owner` TEXT NOT NULL,"
-                         "`value` TEXT NOT NULL,"
-                         "`creation_date` TEXT NOT NULL,"
-                         "`expiration_date` TEXT NOT NULL);"
-                         "CREATE TABLE IF NOT EXISTS tokens ("
-                         "`owner` TEXT NOT NULL,"
-                         "`name` TEXT NOT NULL,"
-                         "`token` TEXT NOT NULL,"
-                         "`creation_date` TEXT NOT NULL,"
-                         "`last_usage` TEXT);"sv;
-    rc = exec_request(sql);
-    if (rc != SQLITE_OK)
-        std::cerr << "Can't create tables: " << sqlite3_errmsg(db) << std::endl;
+    {
+        // Leftovers of uploads interrupted by a shutdown
+        constexpr auto sql = "DELETE FROM vaults WHERE substr(`owner`, 1, 1) = char(10);"sv;
+        auto conn = pool.acquire();
+        if (rc = exec_request(conn->handle(), sql); rc != SQLITE_OK)
+            return rc;
+    }
+
+    if (rc = backfillVaultHashes(64); rc != SQLITE_OK) {
+        std::cerr << "Can't hash the vaults stored before content hashes" << std::endl;
+        return rc;
+    }
+
+    while (pool.size() < connections) {
+        if (rc = pool.add(filename); rc != SQLITE_OK)
+            return rc;
+    }
     return rc;
 }
 
+int ServerDB::hashBlob(sqlite3_blob* blob, std::uint64_t size, ContentHash& content) {
+    std::vector<unsigned char> buffer(std::min<std::uint64_t>(size, 64 * 1024));
+    for (std::uint64_t read = 0; read < size; read += buffer.size()) {
+        const auto chunk = static_cast<int>(std::min<std::uint64_t>(buffer.size(), size - read));
+        if (int rc = sqlite3_blob_read(blob, buffer.data(), chunk, static_cast<int>(read)); rc != SQLITE_OK)
+            return rc;
+        content.update(buffer.data(), chunk);
+    }
+    return SQLITE_OK;
+}
+
+int ServerDB::backfillVaultHashes(std::size_t batch_size) {
+    // Walks the (owner, name) index, which holds the hash: only the vaults without
+    // one are reached. The cursor is the last vault hashed, which no longer matches
+    constexpr auto missing_sql = "SELECT rowid, length(`data`), `owner`, `name` FROM vaults INDEXED BY vaults_owner_name "
+                                 "WHERE (`owner`, `name`) >= (?, ?) AND `hash` IS NULL ORDER BY `owner`, `name` LIMIT ?;"sv;
+    constexpr auto hash_sql = "UPDATE vaults SET `hash` = ? WHERE rowid = ?;"sv;
+    // The change feed copied the missing hashes: fill them in, the vault keeps its sequence number
+    constexpr auto change_sql = "UPDATE vault_changes SET `hash` = ? WHERE `owner` = ? AND `name` = ? AND `hash` IS NULL AND NOT `deleted`;"sv;
+    struct Missing {
+        sqlite3_int64 rowid;
+        std::uint64_t size;
+        std::string owner;
+        std::string name;
+    };
+    auto conn = pool.acquire();
+    sqlite3* db = conn->handle();
+    std::string owner, name;
+    for (;;) {
+        int rc;
+        if (rc = exec_request(db, "BEGIN IMMEDIATE;"); rc != SQLITE_OK)
+            return rc;
+        const auto rollback = [&](int rc) {
+            exec_request(db, "ROLLBACK;");
+            return rc;
+        };
+
+        std::vector<Missing> batch;
+        {
+            auto [stmt, rc] = conn->prepare(missing_sql);
+            if (rc != SQLITE_OK)
+                return rollback(error(db, rc));
+            if ((rc = sqlite3_bind_text(stmt, 1, owner.data(), owner.size(), SQLITE_STATIC)) != SQLITE_OK ||
+                (rc = sqlite3_bind_text(stmt, 2, name.data(), name.size(), SQLITE_STATIC)) != SQLITE_OK ||
+                (rc = sqlite3_bind_int64(stmt, 3, static_cast<sqlite3_int64>(batch_size))) != SQLITE_OK)
+                return rollback(error(db, rc));
+            while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+                batch.push_back({sqlite3_column_int64(stmt, 0), static_cast<std::uint64_t>(sqlite3_column_int64(stmt, 1)),
+                                 std::string(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2)), sqlite3_column_bytes(stmt, 2)),
+                                 std::string(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3)), sqlite3_column_bytes(stmt, 3))});
+            if (rc != SQLITE_DONE)
+                return rollback(error(db, rc));
+        }
+
+        for (const auto& vault : batch) {
+            ContentHash content;
+            if (vault.size > 0) {
+                sqlite3_blob* blob = nullptr;
+                if (rc = sqlite3_blob_open(db, "main", "vaults", "data", vault.rowid, 0, &blob); rc == SQLITE_OK)
+                    rc = hashBlob(blob, vault.size, content);
+                sqlite3_blob_close(blob);
+                if (rc != SQLITE_OK)
+                    return rollback(error(db, rc));
+            }
+            const auto hash = content.hex();
+            const auto id = std::to_string(vault.rowid);
+            if ((rc = firstRowColumn(*conn, hash_sql, 0, std::vector<std::string_view>{hash, id}).second) != SQLITE_OK ||
+                (rc = firstRowColumn(*conn, change_sql, 0, std::vector<std::string_view>{hash, vault.owner, vault.name}).second) != SQLITE_OK)
+                return rollback(rc);
+        }
+        if (rc = exec_request(db, "COMMIT;"); rc != SQLITE_OK)
+            return rollback(rc);
+        if (batch.size() < batch_size)
+            return SQLITE_OK;
+        owner = batch.back().owner;
+        name = batch.back().name;
+    }
+}
+
+int ServerDB::migrate(sqlite3* db) {
+    int version;
+    {
+        sqlite3_stmt* stmt = nullptr;
+        int rc = sqlite3_prepare_v2(db, "PRAGMA user_version;", -1, &stmt, nullptr);
+        if (rc != SQLITE_OK)
+            return error(db, rc);
+        rc = sqlite3_step(stmt);
+        version = sqlite3_column_int(stmt, 0);
+        sqlite3_finalize(stmt);
+        if (rc != SQLITE_ROW)
+            return error(db, rc);
+    }
+
+    for (auto i = static_cast<std::size_t>(version); i < MIGRATIONS.size(); ++i) {
+        std::cout << "Migrating database schema to version " << i + 1 << std::endl;
+        const auto bump = "PRAGMA user_version = " + std::to_string(i + 1) + ";";
+        int rc;
+        if (rc = exec_request(db, "BEGIN IMMEDIATE;"); rc != SQLITE_OK)
+            return rc;
+        if ((rc = exec_request(db, MIGRATIONS[i])) != SQLITE_OK || (rc = exec_request(db, bump)) != SQLITE_OK) {
+            exec_request(db, "ROLLBACK;");
+            return rc;
+        }
+        if (rc = exec_request(db, "COMMIT;"); rc != SQLITE_OK)
+            return rc;
+    }
+    return SQLITE_OK;
+}
+
 SecValue<std::string> ServerDB::listToken(std::string_view owner) {
     constexpr auto sql = "SELECT `name`,`token`,`creation_date`,`last_usage` FROM tokens WHERE owner = ?"sv;
-    return request(sql, std::vector<std::string_view>{owner});
+    auto conn = pool.acquire();
+    return request(*conn, sql, std::vector<std::string_view>{owner});
 }
 
 std::pair<std::string, int> ServerDB::getToken(std::string_view owner, std::string_view token_name) {
     constexpr auto sql = "SELECT `token` FROM tokens WHERE owner = ? AND name = ?"sv;
-    return firstRowColumn(sql, 0, std::vector<std::string_view>{owner, token_name});
+    auto conn = pool.acquire();
+    return firstRowColumn(*conn, sql, 0, std::vector<std::string_view>{owner, token_name});
 }
 
 int ServerDB::setToken(Token<TOKEN_SIZE> token, std::string_view owner, std::string_view name) {
     constexpr auto sql = "INSERT INTO tokens (`owner`,`name`,`token`,`creation_date`) "
                          "VALUES (?, ?, ?, DATETIME('now'));"sv;
-    return firstRowColumn(sql, 0, std::vector<std::string_view>{owner, name, token.view()}).second;
+    auto conn = pool.acquire();
+    return firstRowColumn(*conn, sql, 0, std::vector<std::string_view>{owner, name, token.view()}).second;
 }
 
 int ServerDB::deleteToken(std::string_view owner, std::string_view token_name) {
     constexpr auto sql = "DELETE FROM tokens WHERE `owner` = ? AND `name` = ?"sv;
-    return firstRowColumn(sql, 0, std::vector<std::string_view>{owner, token_name}).second;
+    const auto token = getToken(owner, token_name);
+    auto conn = pool.acquire();
+    const int rc = firstRowColumn(*conn, sql, 0, std::vector<std::string_view>{owner, token_name}).second;
+    if (rc == SQLITE_OK && !token.first.empty())
+        authCache.erase(AuthCache::Kind::token, owner, token.first);
+    return rc;
 }
 
 bool ServerDB::isTokenValid(std::string_view owner, std::string_view token) {
-    constexpr auto sql = "SELECT `token` FROM tokens WHERE `owner` = ? AND `token` = ?;"sv;
-    const auto value = firstRowColumn(sql, 0, std::vector<std::string_view>{owner, token});
-    if (value.second != SQLITE_OK)
-        return false;
-    if (value.first.empty())
+    if (token.empty())
         return false;
-    return setTokenLastUsage(owner, token) == SQLITE_OK;
+    if (!authCache.contains(AuthCache::Kind::token, owner, token)) {
+        constexpr auto sql = "SELECT `token` FROM tokens WHERE `owner` = ? AND `token` = ?;"sv;
+        auto conn = pool.acquire();
+        const auto value = firstRowColumn(*conn, sql, 0, std::vector<std::string_view>{owner, token});
+        if (value.second != SQLITE_OK)
+            return false;
+        if (value.first.empty())
+            return false;
+        authCache.insert(AuthCache::Kind::token, owner, token, std::time(nullptr) + TOKEN_CACHE_TTL);
+    }
+    // The last usage is written behind, in batches: see flushTokenUsage
+    if (tokenUsage.record(owner, token))
+        flushTokenUsage();
+    return true;
 }
 
-int ServerDB::setTokenLastUsage(std::string_view owner, std::string_view token) {
-    constexpr auto sql = "UPDATE tokens SET `last_usage` = DATETIME('now') WHERE `owner` = ? AND `token` = ?;"sv;
-    return firstRowColumn(sql, 0, std::vector<std::string_view>{owner, token}).second;
+void ServerDB::configureTokenUsage(std::time_t resolution, std::size_t flush_threshold) { tokenUsage.configure(resolution, flush_threshold); }
+
+int ServerDB::flushTokenUsage() {
+    const auto usages = tokenUsage.take();
+    if (usages.empty())
+        return SQLITE_OK;
+    auto conn = pool.acquire();
+    int rc;
+    if (rc = exec_request(conn->handle(), "BEGIN IMMEDIATE;"); rc != SQLITE_OK)
+        return rc;
+    for (const auto& usage : usages) {
+        if (rc = setTokenLastUsage(*conn, usage.owner, usage.token, usage.last_usage); rc != SQLITE_OK) {
+            exec_request(conn->handle(), "ROLLBACK;");
+            return rc;
+        }
+    }
+    return exec_request(conn->handle(), "COMMIT;");
+}
+
+int ServerDB::setTokenLastUsage(Connection& conn, std::string_view owner, std::string_view token, std::time_t last_usage) {
+    constexpr auto sql = "UPDATE tokens SET `last_usage` = DATETIME(?, 'unixepoch') WHERE `owner` = ? AND `token` = ?;"sv;
+    const auto timestamp = std::to_string(last_usage);
+    return firstRowColumn(conn, sql, 0, std::vector<std::string_view>{timestamp, owner, token}).second;
 }
 
 int ServerDB::setSessionID(SessionId<SESSIONID_SIZE> sessionId, std::string_view username) {
     constexpr auto sql = "INSERT INTO session_ids (`owner`,`value`,`creation_date`,`expiration_date`) "
-                         "VALUES (?,?,datetime('now'),datetime('now','+1 hour'));"sv;
-    return firstRowColumn(sql, 0, std::vector<std::string_view>{username, sessionId.view()}).second;
+                         "VALUES (?,?,datetime('now'),CAST(strftime('%s','now') AS INTEGER) + 3600);"sv;
+    auto conn = pool.acquire();
+    return firstRowColumn(*conn, sql, 0, std::vector<std::string_view>{username, sessionId.view()}).second;
 }
 
 bool ServerDB::isSessionIdValid(std::string_view username, std::string_view session_id) {
-    constexpr auto sql = "SELECT `value` FROM session_ids WHERE `owner` = ? AND `value` = ? AND DATETIME(`expiration_date`) >= DATETIME('now')"sv;
-    const auto value = firstRowColumn(sql, 0, std::vector<std::string_view>{username, session_id});
+    if (session_id.empty())
+        return false;
+    if (authCache.contains(AuthCache::Kind::session, username, session_id))
+        return true;
+    constexpr auto sql = "SELECT `expiration_date` FROM session_ids "
+                         "WHERE `owner` = ? AND `value` = ? AND `expiration_date` >= CAST(strftime('%s','now') AS INTEGER)"sv;
+    auto conn = pool.acquire();
+    const auto value = firstRowColumn(*conn, sql, 0, std::vector<std::string_view>{username, session_id});
     if (value.second != SQLITE_OK)
         return false;
-    return !value.first.empty();
+    if (value.first.empty())
+        return false;
+    authCache.insert(AuthCache::Kind::session, username, session_id, std::stoll(value.first));
+    return true;
+}
+
+int ServerDB::deleteSessionID(std::string_view username, std::string_view session_id) {
+    constexpr auto sql = "DELETE FROM session_ids WHERE `owner` = ? AND `value` = ?"sv;
+    auto conn = pool.acquire();
+    const int rc = firstRowColumn(*conn, sql, 0, std::vector<std::string_view>{username, session_id}).second;
+    if (rc == SQLITE_OK)
+        authCache.erase(AuthCache::Kind::session, username, session_id);
+    return rc;
 }
 
 int ServerDB::cleanSessionID() {
-    constexpr auto sql = "DELETE FROM session_ids WHERE DATETIME(`expiration_date`) < DATETIME('now');"sv;
-    return exec_request(sql);
+    constexpr auto sql = "DELETE FROM session_ids WHERE `expiration_date` < CAST(strftime('%s','now') AS INTEGER);"sv;
+    authCache.purgeExpired();
+    auto conn = pool.acquire();
+    return firstRowColumn(*conn, sql, 0, std::vector<std::string_view>{}).second;
+}
+
+std::pair<std::size_t, int> ServerDB::reapExpiredSessions(std::size_t batch_size) {
+    constexpr auto sql = "DELETE FROM session_ids WHERE rowid IN ("
+                         "SELECT rowid FROM session_ids WHERE `expiration_date` < CAST(strftime('%s','now') AS INTEGER) LIMIT ?);"sv;
+    authCache.purgeExpired();
+    const auto limit = std::to_string(batch_size);
+    auto conn = pool.acquire();
+    const int rc = firstRowColumn(*conn, sql, 0, std::vector<std::string_view>{limit}).second;
+    if (rc != SQLITE_OK)
+        return std::make_pair(0, rc);
+    return std::make_pair(static_cast<std::size_t>(sqlite3_changes(conn->handle())), rc);
 }
 
 int ServerDB::setPassword(std::string_view username, std::string_view password) {
@@ -118,7 +376,8 @@ int ServerDB::setPassword(std::string_view username, std::string_view password)
     auto value = getEncodedPassword(password);
     if (value.second != 0)
         return value.second;
-    return firstRowColumn(sql, 0, std::vector<std::string_view>{value.first, username}).second;
+    auto conn = pool.acquire();
+    return firstRowColumn(*conn, sql, 0, std::vector<std::string_view>{value.first, username}).second;
 }
 
 int ServerDB::registerUser(std::string_view username, std::string_view password) {
@@ -126,28 +385,116 @@ int ServerDB::registerUser(std::string_view username, std::string_view password)
     auto value = getEncodedPassword(password);
     if (value.second != 0)
         return value.second;
-    return firstRowColumn(sql, 0, std::vector<std::string_view>{username, value.first}).second;
+    auto conn = pool.acquire();
+    return firstRowColumn(*conn, sql, 0, std::vector<std::string_view>{username, value.first}).second;
 }
 
 std::string ServerDB::getPasswordHash(std::string_view username) {
     constexpr auto sql = "SELECT `password` FROM users WHERE `username` = ?;"sv;
-    auto value = firstRowColumn(sql, 0, std::vector<std::string_view>{username});
+    auto conn = pool.acquire();
+    auto value = firstRowColumn(*conn, sql, 0, std::vector<std::string_view>{username});
     if (value.second != 0)
         return std::string{};
     return value.first;
 }
 
-std::pair<std::vector<std::string>, int> ServerDB::listVault(std::string_view owner) {
-    constexpr auto sql = "SELECT `name` FROM vaults WHERE `owner` = ?"sv;
-    return singleColumnList<std::string>(sql, 0, std::vector<std::string_view>{owner});
+template <class String>
+std::pair<std::size_t, int> ServerDB::appendVaultNames(std::string_view owner, std::string_view after, std::size_t limit, String& out) {
+    // Walks the (owner, name) index from the cursor on, so a page costs its own
+    // rows whatever its position, and each name goes from the row to out
+    constexpr auto sql = "SELECT `name` FROM vaults WHERE `owner` = ? AND `name` > ? ORDER BY `name` LIMIT ?;"sv;
+    auto conn = pool.acquire();
+    sqlite3* db = conn->handle();
+    auto [stmt, rc] = conn->prepare(sql);
+    if (rc != SQLITE_OK)
+        return {0, error(db, rc)};
+    if ((rc = sqlite3_bind_text(stmt, 1, owner.data(), owner.size(), SQLITE_STATIC)) != SQLITE_OK ||
+        (rc = sqlite3_bind_text(stmt, 2, after.data(), after.size(), SQLITE_STATIC)) != SQLITE_OK ||
+        (rc = sqlite3_bind_int64(stmt, 3, static_cast<sqlite3_int64>(limit))) != SQLITE_OK)
+        return {0, error(db, rc)};
+    std::size_t count = 0;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        auto const name = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+        out.append(name, sqlite3_column_bytes(stmt, 0)).push_back('\n');
+        ++count;
+    }
+    if (rc != SQLITE_DONE)
+        return {count, error(db, rc)};
+    return {count, SQLITE_OK};
 }
 
-std::pair<BLOB_Data, int> ServerDB::getVault(std::string_view owner, std::string_view vault_name) {
-    const auto err = [&](int rc) { return std::make_pair(BLOB_Data{}, error(rc)); };
-    constexpr auto sql = "SELECT `data` FROM vaults WHERE `owner` = ? AND `name` = ?;"sv;
-    int rc;
-    sqlite3_stmt* stmt = nullptr;
-    rc = sqlite3_prepare_v2(db, sql.data(), -1, &stmt, nullptr);
+template std::pair<std::size_t, int> ServerDB::appendVaultNames<std::string>(std::string_view owner, std::string_view after, std::size_t limit,
+                                                                            std::string& out);
+template std::pair<std::size_t, int> ServerDB::appendVaultNames<PooledString>(std::string_view owner, std::string_view after, std::size_t limit,
+                                                                             PooledString& out);
+
+std::pair<VaultTag, int> ServerDB::getVaultTag(std::string_view owner, std::string_view vault_name) {
+    // The unique (name, owner) index looks as cheap to the planner, but it leads to the row
+    constexpr auto sql = "SELECT ifnull(`hash`, ''), `version` FROM vaults INDEXED BY vaults_owner_name WHERE `owner` = ? AND `name` = ?;"sv;
+    auto conn = pool.acquire();
+    sqlite3* db = conn->handle();
+    auto [stmt, rc] = conn->prepare(sql);
+    if (rc != SQLITE_OK)
+        return {VaultTag{}, error(db, rc)};
+    if ((rc = sqlite3_bind_text(stmt, 1, owner.data(), owner.size(), SQLITE_STATIC)) != SQLITE_OK ||
+        (rc = sqlite3_bind_text(stmt, 2, vault_name.data(), vault_name.size(), SQLITE_STATIC)) != SQLITE_OK)
+        return {VaultTag{}, error(db, rc)};
+    rc = sqlite3_step(stmt);
+    if (rc == SQLITE_DONE)
+        return {VaultTag{}, rc};
+    if (rc != SQLITE_ROW)
+        return {VaultTag{}, error(db, rc)};
+    VaultTag tag{std::string(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0)), sqlite3_column_bytes(stmt, 0)),
+                 sqlite3_column_int64(stmt, 1)};
+    return {std::move(tag), SQLITE_OK};
+}
+
+template <class String>
+std::pair<std::size_t, int> ServerDB::appendVaultChanges(std::string_view owner, sqlite3_int64 since, std::size_t limit, String& out) {
+    constexpr auto sql = "SELECT `seq`, `deleted`, `hash`, `name` FROM vault_changes WHERE `owner` = ? AND `seq` > ? ORDER BY `seq` LIMIT ?;"sv;
+    auto conn = pool.acquire();
+    sqlite3* db = conn->handle();
+    auto [stmt, rc] = conn->prepare(sql);
+    if (rc != SQLITE_OK)
+        return {0, error(db, rc)};
+    if ((rc = sqlite3_bind_text(stmt, 1, owner.data(), owner.size(), SQLITE_STATIC)) != SQLITE_OK ||
+        (rc = sqlite3_bind_int64(stmt, 2, since)) != SQLITE_OK ||
+        (rc = sqlite3_bind_int64(stmt, 3, static_cast<sqlite3_int64>(limit))) != SQLITE_OK)
+        return {0, error(db, rc)};
+    std::size_t count = 0;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        char seq[24];
+        out.append(seq, std::to_chars(seq, seq + sizeof(seq), sqlite3_column_int64(stmt, 0)).ptr).push_back(' ');
+        if (sqlite3_column_int(stmt, 1))
+            out.push_back('-');
+        else if (auto const hash = sqlite3_column_text(stmt, 2))
+            out.append(1, '"').append(reinterpret_cast<const char*>(hash), sqlite3_column_bytes(stmt, 2)).push_back('"');
+        else
+            out.push_back('*');
+        auto const name = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3));
+        out.append(1, ' ').append(name, sqlite3_column_bytes(stmt, 3)).push_back('\n');
+        ++count;
+    }
+    if (rc != SQLITE_DONE)
+        return {count, error(db, rc)};
+    return {count, SQLITE_OK};
+}
+
+template std::pair<std::size_t, int> ServerDB::appendVaultChanges<std::string>(std::string_view owner, sqlite3_int64 since, std::size_t limit,
+                                                                              std::string& out);
+template std::pair<std::size_t, int> ServerDB::appendVaultChanges<PooledString>(std::string_view owner, sqlite3_int64 since, std::size_t limit,
+                                                                               PooledString& out);
+
+template <class Container>
+std::pair<Container, int> ServerDB::getVault(std::string_view owner, std::string_view vault_name, VaultTag* tag, VaultRange* range) {
+    auto conn = pool.acquire();
+    sqlite3* db = conn->handle();
+    const auto err = [&](int rc) { return std::make_pair(Container{}, error(db, rc)); };
+    // Only the row id and the size come out of the statement: the bytes are read
+    // straight into the returned container through incremental BLOB I/O, so SQLite
+    // never materializes a copy of the value. The statement stays on its row until
+    // we return, which keeps the read transaction (and so the blob) stable meanwhile.
+    auto [stmt, rc] = conn->prepare(VAULT_ROW_SQL);
     if (rc != SQLITE_OK)
         return err(rc);
     rc = sqlite3_bind_text(stmt, 1, owner.data(), owner.size(), SQLITE_STATIC);
@@ -162,70 +509,393 @@ std::pair<BLOB_Data, int> ServerDB::getVault(std::string_view owner, std::string
         return err(rc);
     }
 
-    const auto size = sqlite3_column_bytes(stmt, 0);
-    const auto* blob = static_cast<const uint8_t*>(sqlite3_column_blob(stmt, 0));
-    BLOB_Data data(blob, blob + size);
+    const auto rowid = sqlite3_column_int64(stmt, 0);
+    const auto size = sqlite3_column_int(stmt, 1);
+    VaultTag current{std::string(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2)), sqlite3_column_bytes(stmt, 2)),
+                     sqlite3_column_int64(stmt, 3)};
+    std::uint64_t first = 0;
+    std::uint64_t length = size;
+    if (range) {
+        range->size = size;
+        if (range->suffix) {
+            length = std::min(range->suffix, length);
+            first = size - length;
+        } else if (range->first < static_cast<std::uint64_t>(size)) {
+            first = range->first;
+            length = std::min(range->last, static_cast<std::uint64_t>(size) - 1) - first + 1;
+        } else {
+            return std::make_pair(Container{}, SQLITE_RANGE);
+        }
+        if (length == 0)
+            return std::make_pair(Container{}, SQLITE_RANGE);
+        range->first = first;
+        range->last = first + length - 1;
+    }
+    // A range only reads the pages which hold its bytes
+    Container data(length, 0);
+    if (length > 0) {
+        sqlite3_blob* blob = nullptr;
+        if (rc = sqlite3_blob_open(db, "main", "vaults", "data", rowid, 0, &blob); rc != SQLITE_OK)
+            return err(rc);
+        rc = sqlite3_blob_read(blob, data.data(), static_cast<int>(length), static_cast<int>(first));
+        sqlite3_blob_close(blob);
+        if (rc != SQLITE_OK)
+            return err(rc);
+    }
+    sqlite3_reset(stmt);
 
-    rc = sqlite3_finalize(stmt);
-    return std::make_pair(data, rc);
+    if (tag)
+        *tag = std::move(current);
+    return std::make_pair(std::move(data), SQLITE_OK);
 }
 
+template std::pair<BLOB_Data, int> ServerDB::getVault<BLOB_Data>(std::string_view owner, std::string_view vault_name, VaultTag* tag,
+                                                                 VaultRange* range);
+template std::pair<std::string, int> ServerDB::getVault<std::string>(std::string_view owner, std::string_view vault_name, VaultTag* tag,
+                                                                     VaultRange* range);
+template std::pair<PooledString, int> ServerDB::getVault<PooledString>(std::string_view owner, std::string_view vault_name, VaultTag* tag,
+                                                                       VaultRange* range);
+
 int ServerDB::storeVault(std::string_view username, std::string_view vault_name, const BLOB_Data& data) {
-    constexpr auto sql = "INSERT INTO vaults (name,owner,data) VALUES (?,?,?);"sv;
-    int rc;
-    sqlite3_stmt* stmt = nullptr;
-    rc = sqlite3_prepare_v2(db, sql.data(), -1, &stmt, nullptr);
+    auto conn = pool.acquire();
+    sqlite3* db = conn->handle();
+    constexpr auto sql = "INSERT INTO vaults (name,owner,data,hash) VALUES (?,?,?,?);"sv;
+    auto [stmt, rc] = conn->prepare(sql);
     if (rc != SQLITE_OK)
-        return error(rc);
+        return error(db, rc);
+    const auto hash = ContentHash::of(data.data(), data.size());
     if ((rc = sqlite3_bind_text(stmt, 1, vault_name.data(), vault_name.size(), SQLITE_STATIC)) != SQLITE_OK ||
         (rc = sqlite3_bind_text(stmt, 2, username.data(), username.size(), SQLITE_STATIC)) != SQLITE_OK ||
-        (rc = sqlite3_bind_blob(stmt, 3, data.data(), data.size(), SQLITE_STATIC)) != SQLITE_OK)
-        return error(rc);
+        (rc = sqlite3_bind_blob(stmt, 3, data.data(), data.size(), SQLITE_STATIC)) != SQLITE_OK ||
+        (rc = sqlite3_bind_text(stmt, 4, hash.data(), hash.size(), SQLITE_STATIC)) != SQLITE_OK)
+        return error(db, rc);
     rc = sqlite3_step(stmt);
     if (!(rc == SQLITE_DONE || rc == SQLITE_ROW))
-        return error(rc);
-    rc = sqlite3_finalize(stmt);
-    return rc;
+        return error(db, rc);
+    return SQLITE_OK;
 }
 
-int ServerDB::updateVault(std::string_view vault_name, std::string_view owner, const BLOB_Data& data) {
-    constexpr auto sql = "UPDATE vaults SET `data` = ? WHERE `name` = ? AND `owner` = ?;"sv;
-    int rc;
-    sqlite3_stmt* stmt = nullptr;
-    rc = sqlite3_prepare_v2(db, sql.data(), -1, &stmt, nullptr);
+int ServerDB::updateVault(std::string_view vault_name, std::string_view owner, const BLOB_Data& data, std::string_view if_match) {
+    auto conn = pool.acquire();
+    sqlite3* db = conn->handle();
+    constexpr auto sql = "UPDATE vaults SET `data` = ?, `hash` = ?, `version` = `version` + 1 "
+                         "WHERE `name` = ? AND `owner` = ? AND (ifnull(?5, '') = '' OR `hash` = ?5);"sv;
+    constexpr auto exists_sql = "SELECT rowid FROM vaults WHERE `owner` = ? AND `name` = ?;"sv;
+    auto [stmt, rc] = conn->prepare(sql);
     if (rc != SQLITE_OK)
-        return error(rc);
-    if ((rc = sqlite3_bind_text(stmt, 2, vault_name.data(), vault_name.size(), SQLITE_STATIC)) != SQLITE_OK ||
-        (rc = sqlite3_bind_text(stmt, 3, owner.data(), owner.size(), SQLITE_STATIC)) != SQLITE_OK ||
-        (rc = sqlite3_bind_blob(stmt, 1, data.data(), data.size(), SQLITE_STATIC)) != SQLITE_OK)
-        return error(rc);
+        return error(db, rc);
+    const auto hash = ContentHash::of(data.data(), data.size());
+    if ((rc = sqlite3_bind_text(stmt, 3, vault_name.data(), vault_name.size(), SQLITE_STATIC)) != SQLITE_OK ||
+        (rc = sqlite3_bind_text(stmt, 4, owner.data(), owner.size(), SQLITE_STATIC)) != SQLITE_OK ||
+        (rc = sqlite3_bind_blob(stmt, 1, data.data(), data.size(), SQLITE_STATIC)) != SQLITE_OK ||
+        (rc = sqlite3_bind_text(stmt, 2, hash.data(), hash.size(), SQLITE_STATIC)) != SQLITE_OK ||
+        (rc = sqlite3_bind_text(stmt, 5, if_match.data(), if_match.size(), SQLITE_STATIC)) != SQLITE_OK)
+        return error(db, rc);
     rc = sqlite3_step(stmt);
     if (rc != SQLITE_DONE)
-        return error(rc);
+        return error(db, rc);
     if (sqlite3_changes(db) <= 0) {
+        if (!if_match.empty() && !firstRowColumn(*conn, exists_sql, 0, std::vector<std::string_view>{owner, vault_name}).first.empty())
+            return SQLITE_MISMATCH;
         std::cerr << "Cannot find the requested vault" << std::endl;
         return rc;
     }
-    return sqlite3_finalize(stmt);
+    return SQLITE_OK;
+}
+
+int ServerDB::writeVaultRange(std::string_view owner, std::string_view vault_name, std::uint64_t offset, const void* data, std::size_t n,
+                              std::optional<std::uint64_t> new_size, std::string_view if_match, VaultTag* tag) {
+    constexpr auto current_sql = "SELECT rowid, length(`data`), ifnull(`hash`, '') FROM vaults WHERE `owner` = ? AND `name` = ?;"sv;
+    // Rewrites the whole value, which only a change of size requires
+    constexpr auto resize_sql = "UPDATE vaults SET `data` = CAST(substr(ifnull(`data`, X''), 1, ?1) || "
+                                "zeroblob(max(?1 - length(ifnull(`data`, X'')), 0)) AS BLOB) WHERE rowid = ?2;"sv;
+    constexpr auto tag_sql = "UPDATE vaults SET `hash` = ?, `version` = `version` + 1 WHERE rowid = ? RETURNING `version`;"sv;
+    auto conn = pool.acquire();
+    sqlite3* db = conn->handle();
+    int rc;
+    if (rc = exec_request(db, "BEGIN IMMEDIATE;"); rc != SQLITE_OK)
+        return rc;
+    const auto rollback = [&](int rc) {
+        exec_request(db, "ROLLBACK;");
+        return rc;
+    };
+
+    sqlite3_int64 rowid;
+    std::uint64_t size;
+    {
+        auto [stmt, rc] = conn->prepare(current_sql);
+        if (rc != SQLITE_OK)
+            return rollback(error(db, rc));
+        if ((rc = sqlite3_bind_text(stmt, 1, owner.data(), owner.size(), SQLITE_STATIC)) != SQLITE_OK ||
+            (rc = sqlite3_bind_text(stmt, 2, vault_name.data(), vault_name.size(), SQLITE_STATIC)) != SQLITE_OK)
+            return rollback(error(db, rc));
+        if (rc = sqlite3_step(stmt); rc == SQLITE_DONE)
+            return rollback(rc);
+        if (rc != SQLITE_ROW)
+            return rollback(error(db, rc));
+        if (!if_match.empty() && if_match != reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2)))
+            return rollback(SQLITE_MISMATCH);
+        rowid = sqlite3_column_int64(stmt, 0);
+        size = sqlite3_column_int64(stmt, 1);
+    }
+    // Writes may overwrite or extend the vault, but never leave a gap in it
+    const auto end = offset + n;
+    if (offset > size || (new_size && end > *new_size))
+        return rollback(SQLITE_RANGE);
+    if (const auto resized = new_size.value_or(std::max(size, end)); resized != size) {
+        auto [stmt, rc] = conn->prepare(resize_sql);
+        if (rc != SQLITE_OK)
+            return rollback(error(db, rc));
+        if ((rc = sqlite3_bind_int64(stmt, 1, static_cast<sqlite3_int64>(resized))) != SQLITE_OK ||
+            (rc = sqlite3_bind_int64(stmt, 2, rowid)) != SQLITE_OK)
+            return rollback(error(db, rc));
+        if (rc = sqlite3_step(stmt); rc != SQLITE_DONE)
+            return rollback(error(db, rc));
+        size = resized;
+    }
+
+    // Only the pages holding the written bytes change; all of them are read again
+    // for the new hash
+    ContentHash content;
+    if (size > 0) {
+        sqlite3_blob* blob = nullptr;
+        if (rc = sqlite3_blob_open(db, "main", "vaults", "data", rowid, 1, &blob); rc != SQLITE_OK)
+            return rollback(error(db, rc));
+        if (n > 0)
+            rc = sqlite3_blob_write(blob, data, static_cast<int>(n), static_cast<int>(offset));
+        if (rc == SQLITE_OK)
+            rc = hashBlob(blob, size, content);
+        if (int close_rc = sqlite3_blob_close(blob); rc == SQLITE_OK)
+            rc = close_rc;
+        if (rc != SQLITE_OK)
+            return rollback(error(db, rc));
+    }
+
+    VaultTag written{content.hex(), 0};
+    {
+        auto [stmt, rc] = conn->prepare(tag_sql);
+        if (rc != SQLITE_OK)
+            return rollback(error(db, rc));
+        if ((rc = sqlite3_bind_text(stmt, 1, written.hash.data(), written.hash.size(), SQLITE_STATIC)) != SQLITE_OK ||
+            (rc = sqlite3_bind_int64(stmt, 2, rowid)) != SQLITE_OK)
+            return rollback(error(db, rc));
+        if (rc = sqlite3_step(stmt); rc != SQLITE_ROW)
+            return rollback(error(db, rc));
+        written.version = sqlite3_column_int64(stmt, 0);
+    }
+    if (rc = exec_request(db, "COMMIT;"); rc != SQLITE_OK)
+        return rollback(rc);
+    if (tag)
+        *tag = std::move(written);
+    return SQLITE_OK;
 }
 
 int ServerDB::deleteVault(std::string_view vault_name, std::string_view owner) {
     constexpr auto sql = "DELETE FROM vaults WHERE `owner` = ? AND `name` = ?"sv;
-    return firstRowColumn(sql, 0, std::vector<std::string_view>{owner, vault_name}).second;
+    auto conn = pool.acquire();
+    return firstRowColumn(*conn, sql, 0, std::vector<std::string_view>{owner, vault_name}).second;
+}
+
+std::pair<std::unique_ptr<ServerDB::VaultUpload>, int> ServerDB::beginVaultUpload(std::string_view owner, std::string_view vault_name,
+                                                                                   std::size_t size, UploadMode mode, std::string_view if_match) {
+    constexpr auto exists_sql = "SELECT rowid FROM vaults WHERE `owner` = ? AND `name` = ?;"sv;
+    constexpr auto stage_sql = "INSERT INTO vaults (`name`,`owner`,`data`) VALUES (?, char(10) || ?, zeroblob(?));"sv;
+    auto conn = pool.acquire();
+    auto [row, rc] = firstRowColumn(*conn, exists_sql, 0, std::vector<std::string_view>{owner, vault_name});
+    if (rc != SQLITE_OK)
+        return std::make_pair(nullptr, rc);
+    if (mode == UploadMode::create && !row.empty())
+        return std::make_pair(nullptr, SQLITE_CONSTRAINT);
+    if (mode == UploadMode::replace && row.empty())
+        return std::make_pair(nullptr, SQLITE_DONE);
+
+    const auto length = std::to_string(size);
+    rc = firstRowColumn(*conn, stage_sql, 0, std::vector<std::string_view>{vault_name, owner, length}).second;
+    if (rc == SQLITE_CONSTRAINT)
+        return std::make_pair(nullptr, SQLITE_BUSY);
+    if (rc != SQLITE_OK)
+        return std::make_pair(nullptr, rc);
+    const auto rowid = sqlite3_last_insert_rowid(conn->handle());
+    return std::make_pair(std::unique_ptr<VaultUpload>(new VaultUpload(*this, owner, vault_name, mode, if_match, rowid, size)), SQLITE_OK);
+}
+
+ServerDB::VaultUpload::~VaultUpload() {
+    if (committed)
+        return;
+    constexpr auto sql = "DELETE FROM vaults WHERE rowid = ? AND substr(`owner`, 1, 1) = char(10);"sv;
+    const auto id = std::to_string(rowid);
+    auto conn = db.pool.acquire();
+    firstRowColumn(*conn, sql, 0, std::vector<std::string_view>{id});
+}
+
+int ServerDB::VaultUpload::write(const void* data, std::size_t n) {
+    if (offset + n > size)
+        return SQLITE_TOOBIG;
+    auto conn = db.pool.acquire();
+    sqlite3_blob* blob = nullptr;
+    int rc = sqlite3_blob_open(conn->handle(), "main", "vaults", "data", rowid, 1, &blob);
+    if (rc != SQLITE_OK)
+        return error(conn->handle(), rc);
+    rc = sqlite3_blob_write(blob, data, static_cast<int>(n), static_cast<int>(offset));
+    // Closing the handle commits the chunk
+    if (int close_rc = sqlite3_blob_close(blob); rc == SQLITE_OK)
+        rc = close_rc;
+    if (rc != SQLITE_OK)
+        return error(conn->handle(), rc);
+    content.update(data, n);
+    offset += n;
+    return SQLITE_OK;
 }
 
-int ServerDB::exec_request(std::string_view sql) {
+int ServerDB::VaultUpload::commit() {
+    constexpr auto publish_sql = "UPDATE vaults SET `owner` = ?, `hash` = ? WHERE rowid = ?;"sv;
+    constexpr auto current_sql = "SELECT ifnull(`hash`, '') FROM vaults WHERE `owner` = ? AND `name` = ?;"sv;
+    constexpr auto carry_sql = "UPDATE vaults SET `group` = (SELECT `group` FROM vaults WHERE `owner` = ?1 AND `name` = ?2),"
+                               "`version` = (SELECT `version` FROM vaults WHERE `owner` = ?1 AND `name` = ?2) + 1 WHERE rowid = ?3;"sv;
+    constexpr auto drop_sql = "DELETE FROM vaults WHERE `owner` = ? AND `name` = ?;"sv;
+    if (offset != size)
+        return SQLITE_MISUSE;
+    const auto id = std::to_string(rowid);
+    const auto hash = content.hex();
+    auto conn = db.pool.acquire();
+    sqlite3* handle = conn->handle();
+    int rc;
+    if (mode == UploadMode::create) {
+        rc = firstRowColumn(*conn, publish_sql, 0, std::vector<std::string_view>{owner, hash, id}).second;
+        committed = rc == SQLITE_OK;
+        return rc;
+    }
+
+    // The staged row takes the place of the current one in a single transaction
+    if (rc = exec_request(handle, "BEGIN IMMEDIATE;"); rc != SQLITE_OK)
+        return rc;
+    const auto rollback = [&](int rc) {
+        exec_request(handle, "ROLLBACK;");
+        return rc;
+    };
+    const auto current = request(*conn, current_sql, std::vector<std::string_view>{owner, name});
+    if (current.sqlite_code != SQLITE_OK)
+        return rollback(current.sqlite_code);
+    if (current.value.empty())
+        return rollback(SQLITE_DONE);
+    if (!if_match.empty() && current.value.front().front() != if_match)
+        return rollback(SQLITE_MISMATCH);
+    if (rc = firstRowColumn(*conn, carry_sql, 0, std::vector<std::string_view>{owner, name, id}).second; rc != SQLITE_OK)
+        return rollback(rc);
+    if (rc = firstRowColumn(*conn, drop_sql, 0, std::vector<std::string_view>{owner, name}).second; rc != SQLITE_OK)
+        return rollback(rc);
+    if (rc = firstRowColumn(*conn, publish_sql, 0, std::vector<std::string_view>{owner, hash, id}).second; rc != SQLITE_OK)
+        return rollback(rc);
+    if (rc = exec_request(handle, "COMMIT;"); rc != SQLITE_OK)
+        return rollback(rc);
+    committed = true;
+    return SQLITE_OK;
+}
+
+std::pair<std::unique_ptr<ServerDB::VaultBatch>, int> ServerDB::beginBatch(std::string_view owner, bool writes) {
+    auto conn = pool.acquire();
+    if (int rc = exec_request(conn->handle(), writes ? "BEGIN IMMEDIATE;" : "BEGIN;"); rc != SQLITE_OK)
+        return std::make_pair(nullptr, rc);
+    return std::make_pair(std::unique_ptr<VaultBatch>(new VaultBatch(std::move(conn), owner)), SQLITE_OK);
+}
+
+ServerDB::VaultBatch::~VaultBatch() {
+    if (!finished)
+        exec_request(conn->handle(), "ROLLBACK;");
+}
+
+template <class String> int ServerDB::VaultBatch::get(std::string_view vault_name, String& out, std::size_t max_size, VaultTag* tag) {
+    sqlite3* db = conn->handle();
+    auto [stmt, rc] = conn->prepare(VAULT_ROW_SQL);
+    if (rc != SQLITE_OK)
+        return error(db, rc);
+    if ((rc = sqlite3_bind_text(stmt, 1, owner.data(), owner.size(), SQLITE_STATIC)) != SQLITE_OK ||
+        (rc = sqlite3_bind_text(stmt, 2, vault_name.data(), vault_name.size(), SQLITE_STATIC)) != SQLITE_OK)
+        return error(db, rc);
+    if (rc = sqlite3_step(stmt); rc == SQLITE_DONE)
+        return rc;
+    if (rc != SQLITE_ROW)
+        return error(db, rc);
+    const auto rowid = sqlite3_column_int64(stmt, 0);
+    const auto size = static_cast<std::size_t>(sqlite3_column_int64(stmt, 1));
+    if (out.size() + size > max_size)
+        return SQLITE_TOOBIG;
+    if (tag)
+        *tag = VaultTag{std::string(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2)), sqlite3_column_bytes(stmt, 2)),
+                        sqlite3_column_int64(stmt, 3)};
+    if (size == 0)
+        return SQLITE_OK;
+    const auto offset = out.size();
+    out.resize(offset + size);
+    sqlite3_blob* blob = nullptr;
+    if (rc = sqlite3_blob_open(db, "main", "vaults", "data", rowid, 0, &blob); rc == SQLITE_OK) {
+        rc = sqlite3_blob_read(blob, out.data() + offset, static_cast<int>(size), 0);
+        sqlite3_blob_close(blob);
+    }
+    if (rc != SQLITE_OK) {
+        out.resize(offset);
+        return error(db, rc);
+    }
+    return SQLITE_OK;
+}
+
+template int ServerDB::VaultBatch::get<std::string>(std::string_view vault_name, std::string& out, std::size_t max_size, VaultTag* tag);
+template int ServerDB::VaultBatch::get<PooledString>(std::string_view vault_name, PooledString& out, std::size_t max_size, VaultTag* tag);
+
+int ServerDB::VaultBatch::put(std::string_view vault_name, const void* data, std::size_t n, VaultTag* tag) {
+    constexpr auto sql = "INSERT INTO vaults (`name`, `owner`, `data`, `hash`) VALUES (?, ?, ?, ?) ON CONFLICT (`name`, `owner`) "
+                         "DO UPDATE SET `data` = excluded.`data`, `hash` = excluded.`hash`, `version` = `version` + 1 RETURNING `version`;"sv;
+    sqlite3* db = conn->handle();
+    auto [stmt, rc] = conn->prepare(sql);
+    if (rc != SQLITE_OK)
+        return error(db, rc);
+    auto hash = ContentHash::of(data, n);
+    if ((rc = sqlite3_bind_text(stmt, 1, vault_name.data(), vault_name.size(), SQLITE_STATIC)) != SQLITE_OK ||
+        (rc = sqlite3_bind_text(stmt, 2, owner.data(), owner.size(), SQLITE_STATIC)) != SQLITE_OK ||
+        (rc = sqlite3_bind_blob(stmt, 3, data, static_cast<int>(n), SQLITE_STATIC)) != SQLITE_OK ||
+        (rc = sqlite3_bind_text(stmt, 4, hash.data(), hash.size(), SQLITE_STATIC)) != SQLITE_OK)
+        return error(db, rc);
+    if (rc = sqlite3_step(stmt); rc != SQLITE_ROW)
+        return error(db, rc);
+    if (tag)
+        *tag = VaultTag{std::move(hash), sqlite3_column_int64(stmt, 0)};
+    return SQLITE_OK;
+}
+
+int ServerDB::VaultBatch::remove(std::string_view vault_name) {
+    constexpr auto sql = "DELETE FROM vaults WHERE `owner` = ? AND `name` = ?;"sv;
+    sqlite3* db = conn->handle();
+    auto [stmt, rc] = conn->prepare(sql);
+    if (rc != SQLITE_OK)
+        return error(db, rc);
+    if ((rc = sqlite3_bind_text(stmt, 1, owner.data(), owner.size(), SQLITE_STATIC)) != SQLITE_OK ||
+        (rc = sqlite3_bind_text(stmt, 2, vault_name.data(), vault_name.size(), SQLITE_STATIC)) != SQLITE_OK)
+        return error(db, rc);
+    if (rc = sqlite3_step(stmt); rc != SQLITE_DONE)
+        return error(db, rc);
+    return sqlite3_changes(db) > 0 ? SQLITE_OK : SQLITE_DONE;
+}
+
+int ServerDB::VaultBatch::commit() {
+    if (int rc = exec_request(conn->handle(), "COMMIT;"); rc != SQLITE_OK)
+        return rc;
+    finished = true;
+    return SQLITE_OK;
+}
+
+StatementCacheStats ServerDB::statementCacheStats() const noexcept { return pool.cacheStats(); }
+
+int ServerDB::exec_request(sqlite3* db, std::string_view sql) {
     char* zErrMsg{};
     const int rc = sqlite3_exec(db, sql.data(), nullptr, nullptr, &zErrMsg);
     if (rc != SQLITE_OK)
-        return error(rc);
+        return error(db, rc);
     return rc;
 }
 
-SecValue<std::string> ServerDB::request(std::string_view sql, const std::vector<std::string_view>& args) {
-    auto const err = [&](int rc) { return SecValue<std::string>{std::vector<std::vector<std::string>>{}, error(rc)}; };
-    sqlite3_stmt* stmt = nullptr;
-    int rc = sqlite3_prepare_v2(db, sql.data(), -1, &stmt, nullptr);
+SecValue<std::string> ServerDB::request(Connection& conn, std::string_view sql, const std::vector<std::string_view>& args) {
+    auto const err = [db = conn.handle()](int rc) { return SecValue<std::string>{std::vector<std::vector<std::string>>{}, error(db, rc)}; };
+    auto [stmt, rc] = conn.prepare(sql);
     if (rc != SQLITE_OK)
         return err(rc);
     {
@@ -250,18 +920,13 @@ SecValue<std::string> ServerDB::request(std::string_view sql, const std::vector<
     }
     if (rc != SQLITE_DONE)
         return err(rc);
-    rc = sqlite3_finalize(stmt);
-    if (rc != SQLITE_OK)
-        return err(rc);
-    SecValue<std::string> value{std::move(rows), rc};
+    SecValue<std::string> value{std::move(rows), SQLITE_OK};
     return std::move(value);
 }
 
-std::pair<std::string, int> ServerDB::firstRowColumn(std::string_view sql, int iCol, const std::vector<std::string_view>& args) {
-    const auto err = [&](int rc) { return std::make_pair(std::string{}, error(rc)); };
-    int rc;
-    sqlite3_stmt* stmt = nullptr;
-    rc = sqlite3_prepare_v2(db, sql.data(), -1, &stmt, nullptr);
+std::pair<std::string, int> ServerDB::firstRowColumn(Connection& conn, std::string_view sql, int iCol, const std::vector<std::string_view>& args) {
+    const auto err = [db = conn.handle()](int rc) { return std::make_pair(std::string{}, error(db, rc)); };
+    auto [stmt, rc] = conn.prepare(sql);
     if (rc != SQLITE_OK)
         return err(rc);
     int i = 1;
@@ -275,19 +940,16 @@ std::pair<std::string, int> ServerDB::firstRowColumn(std::string_view sql, int i
         return err(rc);
     auto tmp = sqlite3_column_text(stmt, iCol);
     std::string row = tmp ? reinterpret_cast<const char*>(tmp) : std::string{};
-    rc = sqlite3_finalize(stmt);
-    return make_pair(move(row), rc);
+    return make_pair(move(row), SQLITE_OK);
 }
 
 template <class T>
-std::pair<std::vector<T>, int> ServerDB::singleColumnList(std::string_view sql, int iCol, const std::vector<std::string_view>& args) {
-    const auto err = [&](int rc) {
-        error(rc);
+std::pair<std::vector<T>, int> ServerDB::singleColumnList(Connection& conn, std::string_view sql, int iCol, const std::vector<std::string_view>& args) {
+    const auto err = [db = conn.handle()](int rc) {
+        error(db, rc);
         return std::make_pair(std::vector<T>{}, rc);
     };
-    int rc;
-    sqlite3_stmt* stmt = nullptr;
-    rc = sqlite3_prepare_v2(db, sql.data(), -1, &stmt, nullptr);
+    auto [stmt, rc] = conn.prepare(sql);
     if (rc != SQLITE_OK)
         return err(rc);
     int i = 1;
@@ -300,14 +962,14 @@ std::pair<std::vector<T>, int> ServerDB::singleColumnList(std::string_view sql,
     while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
         rows.emplace_back(reinterpret_cast<const char*>(sqlite3_column_text(stmt, iCol)));
     }
-    rc = sqlite3_finalize(stmt);
-    return std::make_pair(std::move(rows), rc);
+    if (rc != SQLITE_DONE)
+        return err(rc);
+    return std::make_pair(std::move(rows), SQLITE_OK);
 }
 
-template <class T> std::pair<std::vector<T>, int> ServerDB::firstRow(std::string_view sql, const std::vector<std::string_view>& args) {
-    auto const err = [&](int rc) { return std::make_pair(std::vector<T>{}, error(rc)); };
-    sqlite3_stmt* stmt = nullptr;
-    int rc = sqlite3_prepare_v2(db, sql.data(), -1, &stmt, nullptr);
+template <class T> std::pair<std::vector<T>, int> ServerDB::firstRow(Connection& conn, std::string_view sql, const std::vector<std::string_view>& args) {
+    auto const err = [db = conn.handle()](int rc) { return std::make_pair(std::vector<T>{}, error(db, rc)); };
+    auto [stmt, rc] = conn.prepare(sql);
     if (rc != SQLITE_OK)
         return err(rc);
     {
@@ -325,10 +987,7 @@ template <class T> std::pair<std::vector<T>, int> ServerDB::firstRow(std::string
     for (int i = 0; i < sqlite3_column_count(stmt); i++) {
         row.emplace_back(reinterpret_cast<const char*>(sqlite3_column_text(stmt, i)));
     }
-    rc = sqlite3_finalize(stmt);
-    if (rc != SQLITE_OK)
-        return err(rc);
-    return std::make_pair(std::move(row), rc);
+    return std::make_pair(std::move(row), SQLITE_OK);
 }
 
 std::pair<std::string, int> ServerDB::getEncodedPassword(std::string_view password) {
@@ -336,18 +995,12 @@ std::pair<std::string, int> ServerDB::getEncodedPassword(std::string_view passwo
         std::cerr << "Error occurred while encoding password: " << rc << std::endl;
         return make_pair(std::string{}, rc);
     };
+    // Same source as the session ids: OpenSSL's per-thread DRBG
     auto getSalt = [] {
-        static thread_local auto gen = [] {
-            std::random_device rd;
-            std::seed_seq sseq({(int)rd(), (int)std::time(nullptr)});
-            return std::mt19937_64{sseq};
-        }();
-
         std::array<std::uint8_t, SALTLEN> ret{};
-        static_assert(SALTLEN % 8 == 0);
-        for (int i = 0; i < SALTLEN / 8; ++i) {
-            const auto rval = gen();
-            std::memcpy(ret.data() + i * 8, &rval, sizeof(rval));
+        if (RAND_bytes(ret.data(), SALTLEN) != 1) {
+            std::cerr << "Cannot draw random bytes for a salt" << std::endl;
+            std::abort();
         }
         return ret;
     };
@@ -355,8 +1008,8 @@ std::pair<std::string, int> ServerDB::getEncodedPassword(std::string_view passwo
     std::string encoded;
     encoded.resize(ENCLEN);
 
-    uint32_t t_cost = 3;         // 1-pass computation
-    uint32_t m_cost = (1 << 16); // 64 mebibytes memory usage
+    uint32_t t_cost = ARGON2_T_COST; // 3-pass computation
+    uint32_t m_cost = ARGON2_M_COST; // 64 mebibytes memory usage
     uint32_t parallelism = 1;    // number of threads and lanes
 
     int rc = argon2i_hash_encoded(t_cost, m_cost, parallelism, password.data(), password.size(), getSalt().data(), SALTLEN, HASHLEN, encoded.data(),
@@ -0,0 +1,177 @@
+//
+// Counts the heap allocations made while answering requests, once the
+// server is warm. Exits with a failure if any request allocates.
+//
+
+#include <atomic>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <string>
+#include <tuple>
+#include <boost/asio/io_context.hpp>
+#include "request_handler.hpp"
+
+namespace {
+std::atomic<std::size_t> allocations{0};
+
+void* counted_alloc(std::size_t size, std::size_t alignment = 0) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    size = size ? size : 1;
+    // aligned_alloc wants a size which is a multiple of the alignment
+    if (auto p = alignment ? std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment) : std::malloc(size))
+        return p;
+    throw std::bad_alloc();
+}
+} // namespace
+
+// Every form of new and delete is replaced, so each block is released by the
+// family which allocated it: malloc and aligned_alloc both pair with free.
+void* operator new(std::size_t size) { return counted_alloc(size); }
+
+void* operator new[](std::size_t size) { return counted_alloc(size); }
+
+void* operator new(std::size_t size, std::align_val_t alignment) { return counted_alloc(size, static_cast<std::size_t>(alignment)); }
+
+void* operator new[](std::size_t size, std::align_val_t alignment) { return counted_alloc(size, static_cast<std::size_t>(alignment)); }
+
+// GCC takes whatever operator new returns for a block free() can't release, not
+// knowing these are the replacements above: the pairing is right by construction.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void operator delete(void* p) noexcept { std::free(p); }
+
+void operator delete[](void* p) noexcept { std::free(p); }
+
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+void operator delete[](void* p, std::size_t) noexcept { std::free(p); }
+
+void operator delete(void* p, std::align_val_t) noexcept { std::free(p); }
+
+void operator delete[](void* p, std::align_val_t) noexcept { std::free(p); }
+
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+
+void operator delete[](void* p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+namespace {
+
+// Plays the session's part: moves each response into a ResponseSlot and
+// serializes it, dropping the bytes.
+struct Sink {
+    swp::ResponseSlot& slot;
+    boost::asio::io_context& ioc;
+    unsigned& status;
+
+    template <bool isRequest, class Body, class Fields> void operator()(http::message<isRequest, Body, Fields>&& msg) const {
+        auto& res = slot.emplace(std::move(msg));
+        status = res.result_int();
+        http::serializer<isRequest, Body, Fields> sr{res};
+        beast::error_code ec;
+        while (!ec && !sr.is_done())
+            sr.next(ec, [&sr](beast::error_code&, const auto& buffers) { sr.consume(beast::buffer_bytes(buffers)); });
+        slot.reset();
+    }
+
+    [[nodiscard]] std::shared_ptr<void> lifetime() const { return nullptr; }
+
+    [[nodiscard]] auto get_executor() const { return ioc.get_executor(); }
+};
+
+struct Case {
+    http::verb method;
+    const char* target;
+    unsigned status;
+};
+} // namespace
+
+int main() {
+    auto const root = std::filesystem::temp_directory_path() / "swp-allocations";
+    std::filesystem::create_directories(root);
+    std::ofstream(root / "index.html") << "<!doctype html><title>swp</title>";
+
+    swp::ServerDB db((root / "server.db").c_str());
+    swp::KdfExecutor kdf(1, 64 << 20, 64 << 20, 1);
+    swp::StaticCache assets(1 << 20, 1 << 20, std::chrono::hours(1), &mime_type);
+    boost::asio::io_context ioc;
+    swp::RequestArena arena;
+    swp::ResponseSlot slot;
+    unsigned status = 0;
+    Sink sink{slot, ioc, status};
+
+    // Requests which are answered without querying the database: SQLite
+    // allocates on its own
+    constexpr Case cases[] = {
+        {http::verb::get, "/index.html", 200},
+        {http::verb::head, "/index.html", 200},
+        {http::verb::get, "/api/nope", 404},
+        {http::verb::put, "/api/vault", 405},
+        {http::verb::get, "/../server.db", 400},
+    };
+    auto const doc_root = root.string();
+    int failures = 0;
+    for (int round = 0; round < 1000; ++round) {
+        for (std::size_t i = 0; i < std::size(cases); ++i) {
+            // Built the way the session's parser builds them, in the arena
+            arena.reset();
+            auto const before = allocations.load();
+            http::request<swp::ArenaStringBody, swp::ArenaFields> req{std::piecewise_construct, std::make_tuple(arena.allocator()),
+                                                                      std::make_tuple(arena.allocator())};
+            req.method(cases[i].method);
+            req.target(cases[i].target);
+            req.version(11);
+            req.set(http::field::host, "localhost");
+            req.set(http::field::user_agent, "allocations");
+            req.set(http::field::accept_encoding, "gzip, br");
+            req.keep_alive(true);
+            handle_request(doc_root, std::move(req), sink, db, kdf, assets);
+            auto const made = allocations.load() - before;
+            if (status != cases[i].status) {
+                std::cerr << cases[i].target << ": answered " << status << " instead of " << cases[i].status << std::endl;
+                return EXIT_FAILURE;
+            }
+            // The first rounds fill the caches and the free lists
+            if (round >= 2 && made != 0) {
+                std::cerr << http::to_string(cases[i].method) << " " << cases[i].target << ": " << made << " allocations" << std::endl;
+                ++failures;
+            }
+        }
+    }
+
+    // For comparison: a request and a response built with std::allocator, kept alive the way sessions did
+    auto before = allocations.load();
+    {
+        http::request<http::string_body> req{http::verb::get, "/api/nope", 11};
+        req.set(http::field::host, "localhost");
+        req.set(http::field::user_agent, "allocations");
+        req.set(http::field::accept_encoding, "gzip, br");
+        req.keep_alive(true);
+    }
+    std::cout << "std::allocator request: " << allocations.load() - before << " allocations" << std::endl;
+    before = allocations.load();
+    {
+        auto res = std::make_shared<http::response<http::string_body>>(http::status::not_found, 11);
+        res->set(http::field::server, BOOST_BEAST_VERSION_STRING);
+        res->set(http::field::content_type, "text/html");
+        res->body() = "The resource '" + std::string("/api/nope") + "' was not found.";
+        res->prepare_payload();
+    }
+    std::cout << "std::allocator 404 response: " << allocations.load() - before << " allocations" << std::endl;
+
+    std::filesystem::remove_all(root);
+    if (failures)
+        return EXIT_FAILURE;
+    std::cout << "arena requests, pooled responses: 0 allocations" << std::endl;
+    return EXIT_SUCCESS;
+}
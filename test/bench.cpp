@@ -0,0 +1,283 @@
+//
+// Micro-benchmarks of the server's hot paths, run as `bench [iterations]`.
+//
+
+#include <chrono>
+#include <cstdlib>
+#include <ctime>
+#include <filesystem>
+#include <iostream>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <boost/beast/core/string.hpp>
+#include "mime_types.hpp"
+#include "router.hpp"
+#include "server_db.hpp"
+
+namespace {
+
+// The generator SessionId used before drawing from OpenSSL: one shared
+// ranlux48, lazily seeded, mapped through a lookup table.
+namespace legacy {
+constexpr auto mk_printable(uint8_t bits) -> char {
+    constexpr std::string_view table = "0123465789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz=-";
+    return table[+bits];
+}
+
+template <std::size_t N> class SessionId {
+    inline static std::ranlux48 eng;
+    inline static bool eng_init = false;
+
+    std::array<char, N> storage{};
+
+  public:
+    SessionId() {
+        if (!eng_init) {
+            eng_init = true;
+            std::random_device rd;
+            std::seed_seq sseq({(int)rd(), (int)std::time(nullptr)});
+            eng = std::ranlux48{sseq};
+        }
+
+        for (int i = 0; i < (N / 8); ++i) {
+            auto bits = eng();
+            for (int j = 0; j < 8; ++j) {
+                storage[i * 8 + j] = mk_printable(static_cast<uint8_t>(bits & 0x3f));
+                bits >>= 6;
+            }
+        }
+    }
+
+    [[nodiscard]] std::string_view view() const noexcept { return {storage.data(), storage.size()}; }
+};
+
+// mime_type() before the packed-extension table: a chain of iequals.
+boost::beast::string_view mime_type(boost::beast::string_view path) {
+    using boost::beast::iequals;
+    auto const ext = [&path] {
+        auto const pos = path.rfind(".");
+        if (pos == boost::beast::string_view::npos)
+            return boost::beast::string_view{};
+        return path.substr(pos);
+    }();
+    constexpr std::pair<const char*, const char*> types[] = {
+        {".htm", "text/html"},
+        {".html", "text/html"},
+        {".php", "text/html"},
+        {".css", "text/css"},
+        {".txt", "text/plain"},
+        {".js", "application/javascript"},
+        {".json", "application/json"},
+        {".xml", "application/xml"},
+        {".swf", "application/x-shockwave-flash"},
+        {".flv", "video/x-flv"},
+        {".png", "image/png"},
+        {".jpe", "image/jpeg"},
+        {".jpeg", "image/jpeg"},
+        {".jpg", "image/jpeg"},
+        {".gif", "image/gif"},
+        {".bmp", "image/bmp"},
+        {".ico", "image/vnd.microsoft.icon"},
+        {".tiff", "image/tiff"},
+        {".tif", "image/tiff"},
+        {".svg", "image/svg+xml"},
+        {".svgz", "image/svg+xml"},
+    };
+    for (const auto& [e, type] : types)
+        if (iequals(ext, e))
+            return type;
+    return "application/text";
+}
+
+// handle_request's dispatch before the router: a cascade of starts_with, then
+// a switch on the method. Returns the handler it would run, 0 for 404 and -1 for 405.
+int dispatch(boost::beast::http::verb method, boost::beast::string_view target) {
+    using boost::beast::http::verb;
+    auto const vault = [method](boost::beast::string_view target) {
+        auto const collection = target.empty() || target == "/";
+        switch (method) {
+        case verb::get:
+            if (collection)
+                return 3;
+            return target.starts_with('/') ? 5 : 0;
+        case verb::post:
+            return collection ? 4 : -1;
+        case verb::delete_:
+        case verb::patch:
+            if (target.empty())
+                return -1;
+            if (!target.starts_with('/'))
+                return 0;
+            if (target.substr(1).empty())
+                return -1;
+            return method == verb::patch ? 6 : 7;
+        default:
+            return -1;
+        }
+    };
+    auto const token = [method](boost::beast::string_view target) {
+        switch (method) {
+        case verb::get:
+        case verb::post:
+            if (!target.empty()) {
+                if (!target.starts_with('/'))
+                    return 0;
+                if (!target.substr(1).empty())
+                    return -1;
+            }
+            return method == verb::get ? 8 : 9;
+        case verb::delete_:
+            if (!target.starts_with('/'))
+                return 0;
+            return target.substr(1).empty() ? -1 : 10;
+        default:
+            return -1;
+        }
+    };
+    auto const user = [&](boost::beast::string_view target) {
+        if (constexpr boost::beast::string_view key = "/token"; target.starts_with(key))
+            return token(target.substr(key.size()));
+        return 0;
+    };
+    auto const api = [&](boost::beast::string_view target) {
+        if (constexpr boost::beast::string_view key = "/logout"; target.starts_with(key))
+            return method == verb::post ? 2 : -1;
+        if (constexpr boost::beast::string_view key = "/register"; target.starts_with(key))
+            return 0;
+        if (constexpr boost::beast::string_view key = "/vault"; target.starts_with(key))
+            return vault(target.substr(key.size()));
+        if (constexpr boost::beast::string_view key = "/user"; target.starts_with(key))
+            return user(target.substr(key.size()));
+        return 0;
+    };
+    if (constexpr boost::beast::string_view key = "/api/login"; target.starts_with(key))
+        return method == verb::get ? 1 : -1;
+    if (constexpr boost::beast::string_view key = "/api"; target.starts_with(key))
+        return api(target.substr(key.size()));
+    return 0;
+}
+} // namespace legacy
+
+// Runs body() iterations times on each of threads threads; returns the calls per second.
+template <class Body> double rate(std::size_t iterations, unsigned threads, Body body) {
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; ++t)
+        workers.emplace_back([&] {
+            for (std::size_t i = 0; i < iterations; ++i)
+                body();
+        });
+    for (auto& worker : workers)
+        worker.join();
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return static_cast<double>(iterations) * threads / elapsed.count();
+}
+
+void report(std::string_view name, double per_second) { std::cout << name << ": " << static_cast<std::uint64_t>(per_second) << "/s" << std::endl; }
+
+// The legacy generator isn't thread-safe: it is only measured on one thread.
+void bench_session_id(std::size_t iterations) {
+    volatile char sink;
+    report("session id, ranlux48 (1 thread)", rate(iterations, 1, [&] { sink = legacy::SessionId<swp::SESSIONID_SIZE>{}.view()[0]; }));
+    report("session id, OpenSSL DRBG (1 thread)", rate(iterations, 1, [&] { sink = SessionId<swp::SESSIONID_SIZE>{}.view()[0]; }));
+    const auto threads = std::max(2u, std::thread::hardware_concurrency());
+    report("session id, OpenSSL DRBG (" + std::to_string(threads) + " threads)",
+           rate(iterations, threads, [&] { sink = SessionId<swp::SESSIONID_SIZE>{}.view()[0]; }));
+}
+
+void bench_mime_type(std::size_t iterations) {
+    constexpr const char* paths[] = {"./index.html", "./app.JS", "./img/logo.svg", "./favicon.ico", "./README", "./font.woff2"};
+    std::size_t i = 0;
+    volatile std::size_t sink;
+    report("mime type, iequals chain", rate(iterations * 10, 1, [&] { sink = legacy::mime_type(paths[i++ % std::size(paths)]).size(); }));
+    report("mime type, packed extension table", rate(iterations * 10, 1, [&] { sink = swp::mime_types().lookup(paths[i++ % std::size(paths)]).size(); }));
+}
+
+void bench_router(std::size_t iterations) {
+    using boost::beast::http::verb;
+    constexpr std::pair<verb, const char*> requests[] = {
+        {verb::get, "/api/login"},
+        {verb::get, "/api/vault"},
+        {verb::get, "/api/vault/passwords"},
+        {verb::patch, "/api/vault/passwords"},
+        {verb::get, "/api/user/token"},
+        {verb::delete_, "/api/user/token/ci"},
+        {verb::post, "/api/logout"},
+    };
+    swp::Router<int> router;
+    router.add(verb::get, "/api/login", 1)
+        .add(verb::post, "/api/logout", 2)
+        .add(verb::get, "/api/vault", 3)
+        .add(verb::post, "/api/vault", 4)
+        .add(verb::get, "/api/vault/:name", 5)
+        .add(verb::patch, "/api/vault/:name", 6)
+        .add(verb::delete_, "/api/vault/:name", 7)
+        .add(verb::get, "/api/user/token", 8)
+        .add(verb::post, "/api/user/token", 9)
+        .add(verb::delete_, "/api/user/token/:name", 10);
+    for (const auto& [method, target] : requests) {
+        auto const match = router.match(method, target);
+        if (!match.value || *match.value != legacy::dispatch(method, target)) {
+            std::cerr << "router and cascade disagree on " << target << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+    }
+
+    std::size_t i = 0;
+    volatile int sink;
+    report("dispatch, starts_with cascade", rate(iterations * 10, 1, [&] {
+               auto const& [method, target] = requests[i++ % std::size(requests)];
+               sink = legacy::dispatch(method, target);
+           }));
+    report("dispatch, segment tree", rate(iterations * 10, 1, [&] {
+               auto const& [method, target] = requests[i++ % std::size(requests)];
+               sink = *router.match(method, target).value;
+           }));
+}
+
+// A sync of a client's vaults: each one written then read back, one statement
+// and one transaction per operation as individual requests make them, or in
+// one VaultBatch as a batch request does.
+void bench_vault_batch(std::size_t iterations) {
+    constexpr std::size_t VAULTS = 100;
+    auto const path = std::filesystem::temp_directory_path() / "swp-bench.db";
+    std::filesystem::remove(path);
+    swp::ServerDB db(path.c_str());
+    const swp::BLOB_Data data(4096, 'x');
+    std::vector<std::string> names;
+    for (std::size_t i = 0; i < VAULTS; ++i)
+        db.storeVault("bench", names.emplace_back("vault" + std::to_string(i)), data);
+    const std::size_t rounds = std::max<std::size_t>(1, iterations / 10000);
+    volatile std::size_t sink;
+
+    report("vault writes and reads, one transaction each", VAULTS * 2 * rate(rounds, 1, [&] {
+               for (const auto& name : names)
+                   db.updateVault(name, "bench", data);
+               for (const auto& name : names)
+                   sink = db.getVault("bench", name).first.size();
+           }));
+    report("vault writes and reads, one batch", VAULTS * 2 * rate(rounds, 1, [&] {
+               auto [batch, rc] = db.beginBatch("bench", true);
+               std::string out;
+               for (const auto& name : names)
+                   batch->put(name, data.data(), data.size());
+               for (const auto& name : names)
+                   batch->get(name, out, swp::BLOB_Data().max_size());
+               sink = out.size();
+               batch->commit();
+           }));
+    std::filesystem::remove(path);
+}
+} // namespace
+
+int main(int argc, char* argv[]) {
+    const std::size_t iterations = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 100000;
+    bench_session_id(iterations);
+    bench_mime_type(iterations);
+    bench_router(iterations);
+    bench_vault_batch(iterations);
+    return 0;
+}
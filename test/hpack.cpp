@@ -0,0 +1,119 @@
+//
+// Checks HPACK against the examples of RFC 7541, appendix C: the requests of
+// C.3 (without Huffman coding) and of C.4 (with it) are decoded in sequence on
+// one connection's table, and the encoder reproduces the bytes of C.4. Exits
+// with a failure on the first difference.
+//
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "hpack.hpp"
+
+namespace {
+
+using Fields = std::vector<std::pair<std::string, std::string>>;
+
+struct Example {
+    const char* name;
+    const char* hex;
+    Fields fields;
+};
+
+std::string from_hex(std::string_view hex) {
+    std::string bytes;
+    for (std::size_t i = 0; i + 1 < hex.size(); i += 2)
+        bytes.push_back(static_cast<char>(std::stoi(std::string(hex.substr(i, 2)), nullptr, 16)));
+    return bytes;
+}
+
+std::string to_hex(std::string_view bytes) {
+    constexpr char digits[] = "0123456789abcdef";
+    std::string hex;
+    for (auto c : bytes) {
+        hex.push_back(digits[static_cast<std::uint8_t>(c) >> 4]);
+        hex.push_back(digits[static_cast<std::uint8_t>(c) & 15]);
+    }
+    return hex;
+}
+
+const Fields first = {{":method", "GET"}, {":scheme", "http"}, {":path", "/"}, {":authority", "www.example.com"}};
+const Fields second = {{":method", "GET"}, {":scheme", "http"}, {":path", "/"}, {":authority", "www.example.com"}, {"cache-control", "no-cache"}};
+const Fields third = {{":method", "GET"},
+                      {":scheme", "https"},
+                      {":path", "/index.html"},
+                      {":authority", "www.example.com"},
+                      {"custom-key", "custom-value"}};
+
+const Example WITHOUT_HUFFMAN[] = {
+    {"C.3.1", "828684410f7777772e6578616d706c652e636f6d", first},
+    {"C.3.2", "828684be58086e6f2d6361636865", second},
+    {"C.3.3", "828785bf400a637573746f6d2d6b65790c637573746f6d2d76616c7565", third},
+};
+
+const Example WITH_HUFFMAN[] = {
+    {"C.4.1", "828684418cf1e3c2e5f23a6ba0ab90f4ff", first},
+    {"C.4.2", "828684be5886a8eb10649cbf", second},
+    {"C.4.3", "828785bf408825a849e95ba97d7f8925a849e95bb8e8b4bf", third},
+};
+
+// Decodes the examples in order with one decoder, as the blocks of a connection.
+template <std::size_t N> bool decodes(const Example (&examples)[N]) {
+    swp::hpack::Decoder decoder;
+    for (const auto& [name, hex, fields] : examples) {
+        auto const block = from_hex(hex);
+        Fields decoded;
+        auto const ok = decoder.decode(reinterpret_cast<const std::uint8_t*>(block.data()), block.size(),
+                                       [&decoded](std::string_view n, std::string_view v) { decoded.emplace_back(n, v); });
+        if (!ok || decoded != fields) {
+            std::cerr << name << ": decoded differently" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Encodes the fields of the examples in order with one encoder, indexing them all.
+template <std::size_t N> bool encodes(const Example (&examples)[N]) {
+    swp::hpack::Encoder encoder;
+    for (const auto& [name, hex, fields] : examples) {
+        std::string block;
+        encoder.begin(block);
+        for (const auto& [field_name, value] : fields)
+            encoder.encode(block, field_name, value, swp::hpack::Encoder::Indexing::index);
+        if (to_hex(block) != hex) {
+            std::cerr << name << ": encoded as " << to_hex(block) << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Every octet, alone and in a string of all of them, comes back from its code.
+bool huffman_round_trips() {
+    std::string all;
+    for (int c = 0; c < 256; ++c)
+        all.push_back(static_cast<char>(c));
+    for (std::size_t i = 0; i <= all.size(); ++i) {
+        auto const s = i < all.size() ? all.substr(i, 1) : all;
+        std::string coded, decoded;
+        swp::hpack::huffman_encode(coded, s);
+        if (coded.size() != swp::hpack::huffman_size(s) ||
+            !swp::hpack::huffman_decode(reinterpret_cast<const std::uint8_t*>(coded.data()), coded.size(), decoded) || decoded != s) {
+            std::cerr << "Huffman: " << to_hex(s) << " doesn't round trip" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+} // namespace
+
+int main() {
+    if (!decodes(WITHOUT_HUFFMAN) || !decodes(WITH_HUFFMAN) || !encodes(WITH_HUFFMAN) || !huffman_round_trips())
+        return EXIT_FAILURE;
+    std::cout << "hpack: RFC 7541 C.3 and C.4 decoded, C.4 encoded, Huffman codes round trip" << std::endl;
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,77 @@
+//
+// Checks the bookkeeping of KdfExecutor: with its only worker held busy and its
+// one queue slot taken, a submission is refused and counted as rejected, and the
+// held jobs are counted as completed once they are released. Exits with a
+// failure on the first wrong counter.
+//
+
+#include <chrono>
+#include <cstdlib>
+#include <future>
+#include <iostream>
+#include <thread>
+#include <boost/asio/io_context.hpp>
+#include "kdf_executor.hpp"
+
+namespace {
+
+bool check(const char* what, std::uint64_t value, std::uint64_t expected) {
+    if (value == expected)
+        return true;
+    std::cerr << what << ": " << value << ", expected " << expected << std::endl;
+    return false;
+}
+
+} // namespace
+
+int main() {
+    boost::asio::io_context ioc;
+    std::promise<void> release;
+    const auto released = release.get_future().share();
+    int handled = 0;
+
+    swp::KdfExecutor kdf{1, 1, 1, 1};
+    const auto work = [released] {
+        released.wait();
+        return 0;
+    };
+    const auto handler = [&handled](int) { ++handled; };
+
+    if (!kdf.submit(ioc.get_executor(), work, handler)) {
+        std::cerr << "The first job was refused" << std::endl;
+        return EXIT_FAILURE;
+    }
+    // The worker takes the first job off the queue before the second fills it
+    while (kdf.stats().running == 0)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    if (!kdf.submit(ioc.get_executor(), work, handler)) {
+        std::cerr << "The second job was refused" << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (kdf.submit(ioc.get_executor(), work, handler)) {
+        std::cerr << "A job was queued past the queue limit" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    auto stats = kdf.stats();
+    if (!check("queued", stats.queued, 1) || !check("running", stats.running, 1) || !check("rejected", stats.rejected, 1) ||
+        !check("completed", stats.completed, 0))
+        return EXIT_FAILURE;
+
+    release.set_value();
+    while (kdf.stats().completed < 2)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    ioc.run();
+
+    stats = kdf.stats();
+    if (!check("queued", stats.queued, 0) || !check("running", stats.running, 0) || !check("rejected", stats.rejected, 1) ||
+        !check("completed", stats.completed, 2) || !check("handled", handled, 2))
+        return EXIT_FAILURE;
+    if (stats.average_run() > stats.total_run || stats.average_wait() > stats.total_wait) {
+        std::cerr << "The averages exceed the totals" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::cout << "KdfExecutor: OK" << std::endl;
+    return EXIT_SUCCESS;
+}
@@ -24,6 +24,16 @@ int main(int argc, char* argv[]) {
     std::cout << rc << std::endl;
     rc = db.updateVault("test_vault", "test", swp::BLOB_Data{72, 101, 108, 108, 111, 44, 32, 87, 111, 114, 108, 100, 33});
     std::cout << rc << std::endl;
+    // Without If-Match, the update takes place whatever the vault's hash
+    if (auto [data, get_rc] = db.getVault<std::string>("test", "test_vault"); get_rc != SQLITE_OK) {
+        std::cerr << "Cannot read the vault back after updateVault: " << sqlite3_errstr(get_rc) << std::endl;
+        return 1;
+    } else if (data != "Hello, World!") {
+        std::cerr << "updateVault didn't replace the vault: '" << data << "'" << std::endl;
+        return 1;
+    }
+    const auto cache = db.statementCacheStats();
+    std::cout << "Statement cache: " << cache.hits << " hits, " << cache.misses << " misses" << std::endl;
 //    auto data = db.getVault("test", "test_vault").first;
 //    std::cout << std::string(data.begin(), data.end());
 
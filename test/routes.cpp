@@ -0,0 +1,101 @@
+//
+// Checks that the API routes reach the handlers they are meant for, vaults
+// stored under the names of other endpoints included. Exits with a failure
+// on the first request which is answered otherwise.
+//
+
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <boost/asio/io_context.hpp>
+#include "request_handler.hpp"
+
+namespace {
+
+// Keeps the status and the body of each response.
+struct Sink {
+    boost::asio::io_context& ioc;
+    unsigned& status;
+    std::string& body;
+
+    template <bool isRequest, class Body, class Fields> void operator()(http::message<isRequest, Body, Fields>&& msg) const {
+        status = msg.result_int();
+        if constexpr (std::is_same_v<Body, swp::PooledStringBody>)
+            body.assign(msg.body().data(), msg.body().size());
+        else
+            body.clear();
+    }
+
+    [[nodiscard]] std::shared_ptr<void> lifetime() const { return nullptr; }
+
+    [[nodiscard]] auto get_executor() const { return ioc.get_executor(); }
+};
+
+struct Case {
+    http::verb method;
+    const char* target;
+    const char* body;
+    unsigned status;
+    const char* answer; // checked when given
+};
+} // namespace
+
+int main() {
+    auto const root = std::filesystem::temp_directory_path() / "swp-routes";
+    std::filesystem::remove_all(root);
+    std::filesystem::create_directories(root);
+
+    swp::ServerDB db((root / "server.db").c_str());
+    swp::KdfExecutor kdf(1, 64 << 20, 64 << 20, 1);
+    swp::StaticCache assets(1 << 20, 1 << 20, std::chrono::hours(1), &mime_type);
+    boost::asio::io_context ioc;
+    unsigned status = 0;
+    std::string body;
+    Sink sink{ioc, status, body};
+
+    const SessionId<swp::SESSIONID_SIZE> session;
+    if (db.registerUser("test", "password") != SQLITE_OK || db.setSessionID(session, "test") != SQLITE_OK) {
+        std::cerr << "Cannot set up the user" << std::endl;
+        return EXIT_FAILURE;
+    }
+    // Stored under these names before the change feed and batches had their own routes
+    db.storeVault("test", "changes", swp::BLOB_Data{'o', 'l', 'd'});
+    db.storeVault("test", "batch", swp::BLOB_Data{'o', 'l', 'd'});
+
+    const Case cases[] = {
+        {http::verb::get, "/api/vault/changes", "", 200, "old"},
+        {http::verb::patch, "/api/vault/changes", "new", 200, nullptr},
+        {http::verb::get, "/api/vault/changes", "", 200, "new"},
+        {http::verb::get, "/api/sync/changes?since=1", "", 200, nullptr},
+        {http::verb::delete_, "/api/vault/changes", "", 200, nullptr},
+        {http::verb::get, "/api/vault/changes", "", 404, nullptr},
+        {http::verb::post, "/api/batch", "PUT 3 batch\nnewGET batch\n", 200, nullptr},
+        {http::verb::get, "/api/vault/batch", "", 200, "new"},
+        {http::verb::patch, "/api/vault/batch", "newer", 200, nullptr},
+        {http::verb::delete_, "/api/vault/batch", "", 200, nullptr},
+    };
+    int failures = 0;
+    for (const auto& [method, target, content, expected, answer] : cases) {
+        http::request<http::string_body> req{method, target, 11};
+        req.set(http::field::host, "localhost");
+        req.set("Username", "test");
+        req.set("Session-Id", std::string(session.view()));
+        req.body() = content;
+        req.prepare_payload();
+        handle_request(root.string(), std::move(req), sink, db, kdf, assets);
+        if (status != expected || (answer && body != answer)) {
+            std::cerr << http::to_string(method) << " " << target << ": answered " << status << " '" << body << "' instead of " << expected
+                      << std::endl;
+            ++failures;
+        }
+    }
+
+    std::filesystem::remove_all(root);
+    if (failures)
+        return EXIT_FAILURE;
+    std::cout << "routes: all requests reached their handler" << std::endl;
+    return EXIT_SUCCESS;
+}